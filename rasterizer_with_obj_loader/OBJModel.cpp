@@ -26,15 +26,19 @@
 #include <list>
 #include <algorithm>
 #include <float.h>
+#ifndef OBJ_MODEL_NO_GL
 #include "GL/glew.h"
 #include "GL/glut.h"
+#endif // OBJ_MODEL_NO_GL
 #include "OBJModel.h"
 #include <stdlib.h>
 #include "PathUtils.h"
 #include <glm/gtx/norm.hpp>
 
+#ifndef OBJ_MODEL_NO_GL
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
+#endif // OBJ_MODEL_NO_GL
 
 using glm::vec2;
 using glm::vec3;
@@ -68,7 +72,7 @@ OBJModel::OBJModel(void) :
 m_numVerts(0),
 m_overrideDiffuseTextureWithDefault(false)
 {
-#if 1
+#ifndef OBJ_MODEL_NO_GL
 	// TODO: This is really not the best place for a thing like this, since we might be creating multiple models, on the other hand, not such a big deal either...
 	glGenTextures(1, &m_defaultTextureOne);
 	glBindTexture(GL_TEXTURE_2D, m_defaultTextureOne);
@@ -557,6 +561,7 @@ bool FLATTEN OBJModel::loadOBJ(std::ifstream &file, std::string basePath)
 	}
 	std::cout << "done." << std::endl;
 
+#ifndef OBJ_MODEL_NO_GL
 	glGenVertexArrays(1, &m_vaob); 
 	glBindVertexArray(m_vaob);
 	glGenBuffers(1, &m_positions_bo); 
@@ -614,10 +619,12 @@ bool FLATTEN OBJModel::loadOBJ(std::ifstream &file, std::string basePath)
 	glGenBuffers(1, &m_materialPropertiesBuffer);
 	glBindBuffer(GL_ARRAY_BUFFER, m_materialPropertiesBuffer);
 	glBufferData(GL_ARRAY_BUFFER, tmpMaterials.size() * sizeof(tmpMaterials[0]), &tmpMaterials[0], GL_STATIC_DRAW);
+#endif // OBJ_MODEL_NO_GL
 
 	return true;
 }
 
+#ifndef OBJ_MODEL_NO_GL
 // helper to bind texture...
 static void bindTexture(int texUnit, int textureId, GLuint defaultTexture)
 {
@@ -716,6 +723,7 @@ void OBJModel::render(GLuint shaderProgram, uint32_t renderFlags, const glm::mat
 		}
 	}
 }
+#endif // OBJ_MODEL_NO_GL
 
 bool OBJModel::loadMaterials(std::string fileName, std::string basePath )
 {
@@ -844,6 +852,10 @@ bool OBJModel::loadMaterials(std::string fileName, std::string basePath )
 
 unsigned int OBJModel::loadTexture(std::string fileName, std::string /*basePath*/, bool srgb )
 {
+#ifdef OBJ_MODEL_NO_GL
+	// No textures without GL, -1 is used to mean no texture.
+	return (unsigned int)(-1);
+#else // !OBJ_MODEL_NO_GL
 	fileName = path_utils::normalizePath(fileName);
 
 
@@ -889,4 +901,5 @@ unsigned int OBJModel::loadTexture(std::string fileName, std::string /*basePath*
 		std::cout << "    FAILED TO LOAD: texture '" << fileName << "', (" << width << "x" << height << ")" << std::endl;
 	}
 	return texid;
+#endif // OBJ_MODEL_NO_GL
 }
@@ -23,14 +23,20 @@
 #ifndef __OBJModel_h_
 #define __OBJModel_h_
 
+// Define OBJ_MODEL_NO_GL to build without any OpenGL dependency (e.g., in the ray tracers). Only the data on the host is then
+// loaded, no textures are loaded and the rendering functions are not available. This means it can be used without a GL context.
+#ifndef OBJ_MODEL_NO_GL
 #include "GL/glew.h"
 #include "GL/glut.h"
+#endif // OBJ_MODEL_NO_GL
 #include <string>
 #include <fstream>
 #include <iostream>
 #include <vector>
 #include <map>
 #include <set>
+#include <assert.h>
+#include <stdint.h>
 #include <glm/glm.hpp>
 #include "Aabb.h"
 
@@ -48,10 +54,12 @@ public:
 
 	OBJModel(void);
 	~OBJModel(void);
+#ifndef OBJ_MODEL_NO_GL
 	/**
 	 */
 	void render(GLuint shaderProgram, uint32_t renderFlags, const glm::mat4 &viewMatrix);
 	void render(GLuint shaderProgram, uint32_t renderFlags = RF_All) { render(shaderProgram, renderFlags, glm::mat4(1.0f)); }
+#endif // OBJ_MODEL_NO_GL
 	/**
 	 */
 	bool load(std::string fileName); 
@@ -96,6 +104,7 @@ public:
   };
 
 
+#ifndef OBJ_MODEL_NO_GL
 	/**
 	 * Helper to ensure the attribute arrays provided by ObjModel is assigned to the default names in the shader.
 	 * A program can call this to conveniently set these up before linking the shader.
@@ -125,6 +134,7 @@ public:
 		glUniform1i(glGetUniformLocation(shaderProgram, "normal_texture"), TU_Normal);
 		glUniformBlockBinding(shaderProgram, glGetUniformBlockIndex(shaderProgram, "MaterialProperties"), UBS_MaterialProperties);
 	}
+#endif // OBJ_MODEL_NO_GL
 
 public:
 
@@ -173,7 +183,9 @@ public:
     // compatible with AMD integrated Radeon HD 3100, and modern Intel ingerated GPUs (16 bytes).
     float alignPad[52]; // Pads struct to 256 bytes, large enough for everyone...
   };
+#ifndef OBJ_MODEL_NO_GL
   GLuint m_materialPropertiesBuffer;
+#endif // OBJ_MODEL_NO_GL
 
 	struct Chunk
 	{
@@ -191,6 +203,7 @@ public:
 	std::vector<glm::vec2> m_uvs; 
 	std::vector<glm::vec3> m_tangents;
 	std::vector<glm::vec3> m_bitangents;
+#ifndef OBJ_MODEL_NO_GL
   // Data on GPU
 	GLuint	m_positions_bo; 
 	GLuint	m_normals_bo; 
@@ -199,12 +212,15 @@ public:
 	GLuint	m_bitangents_bo; 
 	// Vertex Array Object
 	GLuint	m_vaob;
+#endif // OBJ_MODEL_NO_GL
 
 	std::vector<Chunk> m_chunks;
 
   Aabb m_aabb;
+#ifndef OBJ_MODEL_NO_GL
   GLuint m_defaultTextureOne; /**< all 1, single pixel texture to use when no texture is loaded. */
   GLuint m_defaultNormalTexture;  /**< { 0.5, 0.5, 1, 1 }, single pixel float texture to use when no normal texture is loaded. */
+#endif // OBJ_MODEL_NO_GL
 
 	friend struct SortAlphaChunksPred;
 
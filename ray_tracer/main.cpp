@@ -1,10 +1,13 @@
 /****************************************************************************/
 /* Copyright (c) 2016, Ola Olsson */
 /****************************************************************************/
+#include <GL/glew.h>
 #include <GL/freeglut.h>
 
 #include <glm/glm.hpp>
 
+#include "../recursive_ray_tracer/FrameBuffer.h"
+
 #include <stdio.h>
 #include <vector>
 #include <algorithm>
@@ -69,6 +72,9 @@ inline bool intersectRaySphere(const vec3 &rayO, const vec3 &rayD, const vec3 &s
 }
 
 
+// The image shown in the window, kept between frames so that the memory is not allocated every frame. The colours are shown as they are.
+FrameBuffer g_frameBuffer(FrameBuffer::F_Rgba8, false);
+
 // Callback that is called by GLUT system when a frame needs to be drawn, set up in main() using 'glutDisplayFunc'
 static void onGlutDisplay()
 {
@@ -85,7 +91,9 @@ static void onGlutDisplay()
 	const float aspectRatio = float(width) / float(height);
 
 	// memory to use to store the pixels to
-	std::vector<vec3> pixels(width * height, g_backGroundColour);
+	g_frameBuffer.resize(width, height);
+	std::vector<vec3> &pixels = g_frameBuffer.getPixels();
+	std::fill(pixels.begin(), pixels.end(), g_backGroundColour);
 	for (int y = 0; y < height; ++y)
 	{
 		for (int x = 0; x < width; ++x)
@@ -110,11 +118,9 @@ static void onGlutDisplay()
 		}
 	}
 
-	// Must check for empty vector
-	if (!pixels.empty())
-	{
-		glDrawPixels(width, height, GL_RGB, GL_FLOAT, &pixels[0]);
-	}
+	// Pack the pixels to 8 bits per channel and draw them in the window.
+	g_frameBuffer.pack(0, 0, width, height);
+	g_frameBuffer.present();
 	glutSwapBuffers();
 }
 
@@ -129,6 +135,9 @@ int main(int argc, char* argv[])
 	glutInitWindowSize(g_startWidth, g_startHeight);
 	glutCreateWindow("A rather short \"ray tracer\"");
 
+	// glewInit sets up the function pointers for the OpenGL functionality beyond 1.1, e.g., the pixel buffer objects used by the FrameBuffer.
+	glewInit();
+
 	glClearColor(0.5f, 0.5f, 0.5f, 1.0f);
 	glClear(GL_COLOR_BUFFER_BIT);
 	glutSwapBuffers();
@@ -0,0 +1,622 @@
+/****************************************************************************/
+/* Copyright (c) 2016, Ola Olsson */
+/****************************************************************************/
+#include "Bvh.h"
+
+#include <float.h>
+#include <assert.h>
+
+namespace
+{
+	// Number of bins used to evaluate the SAH along each axis, 16 is usually plenty to get close to a full sweep.
+	const int g_numSahBins = 16;
+	// Relative cost of visiting a node compared to intersecting a primitive, used to decide when to stop splitting.
+	const float g_traversalCost = 1.0f;
+	const float g_intersectionCost = 1.0f;
+	// Below this depth the SAH is used, after that we just split in the middle of the list to make sure the tree cannot get deeper than
+	// the traversal stack, even for very unfortunate input. Since each split then halves the number of primitives it is plenty.
+	const int g_sahMaxDepth = Bvh::s_maxDepth / 2;
+
+	struct SahBin
+	{
+		Aabb aabb;
+		uint32_t count;
+	};
+
+	// Number of subtrees per thread that 'refit' splits the tree into, more than one evens out the differences in size.
+	const int g_refitRangesPerThread = 4;
+
+	Aabb getLeafAabb(const std::vector<uint32_t> &primitiveIndices, uint32_t offset, uint32_t count, const std::vector<Aabb> &primitiveAabbs)
+	{
+		Aabb aabb = make_inverse_extreme_aabb();
+		for (uint32_t i = offset; i < offset + count; ++i)
+		{
+			aabb = combine(aabb, primitiveAabbs[primitiveIndices[i]]);
+		}
+		return aabb;
+	}
+};
+
+
+
+void Bvh::build(const std::vector<Aabb> &primitiveAabbs, int maxLeafSize, int leafGroupSize, NodeFormat nodeFormat)
+{
+	clear();
+	assert(maxLeafSize >= 1 && maxLeafSize <= s_maxLeafSize);
+	assert(leafGroupSize >= 1);
+
+	if (primitiveAabbs.empty())
+	{
+		return;
+	}
+
+	std::vector<BuildPrimitive> prims(primitiveAabbs.size());
+	for (size_t i = 0; i < primitiveAabbs.size(); ++i)
+	{
+		prims[i].aabb = primitiveAabbs[i];
+		prims[i].centre = primitiveAabbs[i].getCentre();
+		prims[i].index = uint32_t(i);
+	}
+
+	// A binary tree with N leaves has 2N-1 nodes, and we never have more leaves than primitives.
+	m_nodes.reserve(prims.size() * 2);
+	buildRecursive(prims, 0, uint32_t(prims.size()), 0, uint32_t(maxLeafSize), uint32_t(leafGroupSize));
+
+	m_primitiveIndices.resize(prims.size());
+	for (size_t i = 0; i < prims.size(); ++i)
+	{
+		m_primitiveIndices[i] = prims[i].index;
+	}
+	m_rootAabb = m_nodes[0].aabb;
+
+	// The float nodes are only needed to build the quantized nodes, after which the memory is released.
+	if (nodeFormat == NF_Quantized && m_nodes.size() < size_t(s_maxQuantizedSize) && prims.size() < size_t(s_maxQuantizedSize))
+	{
+		m_quantizedNodes.resize(m_nodes.size());
+		quantizeRecursive(0, m_rootAabb);
+		std::vector<BvhNode>().swap(m_nodes);
+		m_nodeFormat = NF_Quantized;
+	}
+	else if (nodeFormat == NF_Wide)
+	{
+		// A wide node replaces at least one binary inner node, usually about seven.
+		m_wideNodes.reserve(m_nodes.size() / 2 + 1);
+		collapseRecursive(0);
+		std::vector<BvhNode>().swap(m_nodes);
+		m_nodeFormat = NF_Wide;
+	}
+	setDataPointers();
+	m_sahCost = computeSahCost();
+	m_buildSahCost = m_sahCost;
+}
+
+
+
+void Bvh::clear()
+{
+	m_nodeFormat = NF_Float;
+	m_nodes.clear();
+	m_quantizedNodes.clear();
+	m_wideNodes.clear();
+	m_primitiveIndices.clear();
+	m_sahCost = 0.0f;
+	m_buildSahCost = 0.0f;
+	setDataPointers();
+}
+
+
+
+size_t Bvh::getMemoryUsage() const
+{
+	return m_numNodes * getNodeSize(m_nodeFormat) + m_numPrimitives * sizeof(uint32_t);
+}
+
+
+
+Bvh::Data Bvh::getData() const
+{
+	Data data = { m_nodeFormat, m_rootAabb, m_sahCost, m_nodeData, m_numNodes, m_primitiveIndexData, m_numPrimitives };
+	return data;
+}
+
+
+
+void Bvh::useData(const Data &data)
+{
+	clear();
+	m_nodeFormat = data.nodeFormat;
+	m_rootAabb = data.rootAabb;
+	m_sahCost = data.sahCost;
+	m_buildSahCost = data.sahCost;
+	m_nodeData = data.nodes;
+	m_numNodes = data.numNodes;
+	m_primitiveIndexData = data.primitiveIndices;
+	m_numPrimitives = data.numPrimitives;
+}
+
+
+
+size_t Bvh::getNodeSize(NodeFormat nodeFormat)
+{
+	switch (nodeFormat)
+	{
+	case NF_Quantized:
+		return sizeof(BvhQuantizedNode);
+	case NF_Wide:
+		return sizeof(BvhWideNode);
+	default:
+		return sizeof(BvhNode);
+	}
+}
+
+
+
+void Bvh::setDataPointers()
+{
+	switch (m_nodeFormat)
+	{
+	case NF_Quantized:
+		m_nodeData = m_quantizedNodes.data();
+		m_numNodes = m_quantizedNodes.size();
+		break;
+	case NF_Wide:
+		m_nodeData = m_wideNodes.data();
+		m_numNodes = m_wideNodes.size();
+		break;
+	default:
+		m_nodeData = m_nodes.data();
+		m_numNodes = m_nodes.size();
+		break;
+	}
+	m_primitiveIndexData = m_primitiveIndices.data();
+	m_numPrimitives = m_primitiveIndices.size();
+}
+
+
+
+void Bvh::resetPrimitiveOrder()
+{
+	for (size_t i = 0; i < m_primitiveIndices.size(); ++i)
+	{
+		m_primitiveIndices[i] = uint32_t(i);
+	}
+}
+
+
+
+uint32_t Bvh::buildRecursive(std::vector<BuildPrimitive> &prims, uint32_t start, uint32_t end, int depth, uint32_t maxLeafSize, uint32_t leafGroupSize)
+{
+	Aabb aabb = make_inverse_extreme_aabb();
+	Aabb centreAabb = make_inverse_extreme_aabb();
+	for (uint32_t i = start; i < end; ++i)
+	{
+		aabb = combine(aabb, prims[i].aabb);
+		centreAabb = combine(centreAabb, prims[i].centre);
+	}
+
+	// Note: we refer to the node by index since the vector may be reallocated as the children are added.
+	uint32_t nodeIndex = uint32_t(m_nodes.size());
+	m_nodes.push_back(BvhNode());
+	m_nodes[nodeIndex].aabb = aabb;
+	m_nodes[nodeIndex].offset = start;
+	m_nodes[nodeIndex].count = uint16_t(end - start);
+	m_nodes[nodeIndex].axis = 0;
+
+	const uint32_t count = end - start;
+	if (count == 1 || depth >= s_maxDepth - 1)
+	{
+		return nodeIndex;
+	}
+
+	// 1. Find the best split plane using binned SAH over the primitive centres.
+	int bestAxis = -1;
+	int bestSplit = 0;
+	float bestCost = FLT_MAX;
+	const glm::vec3 centreExtent = centreAabb.getDiagonal();
+
+	if (depth < g_sahMaxDepth)
+	{
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			// All centres in the same plane, no way to split along this axis.
+			if (centreExtent[axis] <= 0.0f)
+			{
+				continue;
+			}
+
+			SahBin bins[g_numSahBins];
+			for (int b = 0; b < g_numSahBins; ++b)
+			{
+				bins[b].aabb = make_inverse_extreme_aabb();
+				bins[b].count = 0;
+			}
+			const float binScale = float(g_numSahBins) / centreExtent[axis];
+			for (uint32_t i = start; i < end; ++i)
+			{
+				int b = std::min(g_numSahBins - 1, int((prims[i].centre[axis] - centreAabb.min[axis]) * binScale));
+				bins[b].aabb = combine(bins[b].aabb, prims[i].aabb);
+				bins[b].count += 1;
+			}
+
+			// Sweep from the right to get the area & count for all the right hand sides, then sweep from the left to evaluate the cost.
+			float rightArea[g_numSahBins];
+			uint32_t rightCount[g_numSahBins];
+			Aabb rightAabb = make_inverse_extreme_aabb();
+			uint32_t rightSum = 0;
+			for (int b = g_numSahBins - 1; b > 0; --b)
+			{
+				rightAabb = combine(rightAabb, bins[b].aabb);
+				rightSum += bins[b].count;
+				rightArea[b] = rightAabb.getSurfaceArea();
+				rightCount[b] = rightSum;
+			}
+
+			Aabb leftAabb = make_inverse_extreme_aabb();
+			uint32_t leftSum = 0;
+			for (int b = 1; b < g_numSahBins; ++b)
+			{
+				leftAabb = combine(leftAabb, bins[b - 1].aabb);
+				leftSum += bins[b - 1].count;
+				if (leftSum == 0 || rightCount[b] == 0)
+				{
+					continue;
+				}
+				// Primitives are tested in groups of 'leafGroupSize', so a partially filled group costs as much as a full one.
+				float leftGroups = float((leftSum + leafGroupSize - 1) / leafGroupSize);
+				float rightGroups = float((rightCount[b] + leafGroupSize - 1) / leafGroupSize);
+				float cost = leftAabb.getSurfaceArea() * leftGroups + rightArea[b] * rightGroups;
+				if (cost < bestCost)
+				{
+					bestCost = cost;
+					bestAxis = axis;
+					bestSplit = b;
+				}
+			}
+		}
+	}
+
+	// 2. Partition the primitives, using the SAH split if it was any good, or else in the middle along the longest axis.
+	uint32_t mid = start;
+	const float parentArea = aabb.getSurfaceArea();
+	if (bestAxis != -1)
+	{
+		// Compare the cost of splitting with that of making a leaf, the SAH cost was not normalized to the area of the parent so do that here.
+		float splitCost = g_traversalCost + g_intersectionCost * (parentArea > 0.0f ? bestCost / parentArea : float((count + leafGroupSize - 1) / leafGroupSize));
+		float leafCost = g_intersectionCost * float((count + leafGroupSize - 1) / leafGroupSize);
+		if (count <= maxLeafSize && leafCost <= splitCost)
+		{
+			return nodeIndex;
+		}
+
+		const float binScale = float(g_numSahBins) / centreExtent[bestAxis];
+		const float axisMin = centreAabb.min[bestAxis];
+		mid = uint32_t(std::partition(prims.begin() + start, prims.begin() + end, [=](const BuildPrimitive &p)
+		{
+			return std::min(g_numSahBins - 1, int((p.centre[bestAxis] - axisMin) * binScale)) < bestSplit;
+		}) - prims.begin());
+	}
+	else
+	{
+		if (count <= maxLeafSize && depth < g_sahMaxDepth)
+		{
+			return nodeIndex;
+		}
+		int axis = 0;
+		if (centreExtent.y > centreExtent[axis])
+		{
+			axis = 1;
+		}
+		if (centreExtent.z > centreExtent[axis])
+		{
+			axis = 2;
+		}
+		bestAxis = axis;
+		mid = start + count / 2;
+		std::nth_element(prims.begin() + start, prims.begin() + mid, prims.begin() + end, [=](const BuildPrimitive &a, const BuildPrimitive &b)
+		{
+			return a.centre[axis] < b.centre[axis];
+		});
+	}
+	assert(mid > start && mid < end);
+
+	// 3. Build the children, the first child ends up directly after the parent, and the parent must store the index of the second.
+	m_nodes[nodeIndex].count = 0;
+	m_nodes[nodeIndex].axis = uint16_t(bestAxis);
+	buildRecursive(prims, start, mid, depth + 1, maxLeafSize, leafGroupSize);
+	uint32_t secondChild = buildRecursive(prims, mid, end, depth + 1, maxLeafSize, leafGroupSize);
+	m_nodes[nodeIndex].offset = secondChild;
+
+	return nodeIndex;
+}
+
+
+
+void Bvh::quantizeRecursive(uint32_t nodeIndex, const Aabb &nodeAabb)
+{
+	const BvhNode &node = m_nodes[nodeIndex];
+	BvhQuantizedNode &qNode = m_quantizedNodes[nodeIndex];
+	qNode.offset = node.offset;
+	qNode.count = node.count;
+	qNode.axis = node.axis;
+	assert(qNode.count == node.count);
+	if (node.isLeaf())
+	{
+		std::fill(&qNode.childBounds[0][0], &qNode.childBounds[0][0] + 12, uint8_t(0));
+		return;
+	}
+
+	const uint32_t children[2] = { nodeIndex + 1, node.offset };
+	const glm::vec3 step = (nodeAabb.max - nodeAabb.min) * (1.0f / 255.0f);
+	for (int c = 0; c < 2; ++c)
+	{
+		const Aabb &childAabb = m_nodes[children[c]].aabb;
+		for (int i = 0; i < 3; ++i)
+		{
+			// Round the min down and the max up, the guess from the division may be off by one either way due to rounding, so step
+			// until the decoded plane is on the right side, 0 and 255 always work since they decode to the planes of the node box.
+			int qMin = step[i] > 0.0f ? std::min(255, std::max(0, int(floorf((childAabb.min[i] - nodeAabb.min[i]) / step[i])))) : 0;
+			while (qMin > 0 && decodeQuantizedMin(nodeAabb.min[i], step[i], qMin) > childAabb.min[i])
+			{
+				--qMin;
+			}
+			int qMax = step[i] > 0.0f ? std::min(255, std::max(0, 255 - int(floorf((nodeAabb.max[i] - childAabb.max[i]) / step[i])))) : 255;
+			while (qMax < 255 && decodeQuantizedMax(nodeAabb.max[i], step[i], qMax) < childAabb.max[i])
+			{
+				++qMax;
+			}
+			qNode.childBounds[i][c] = uint8_t(qMin);
+			qNode.childBounds[i][c + 2] = uint8_t(qMax);
+		}
+	}
+
+	// The children are quantized relative to the boxes the traversal will decode, not the real boxes.
+	quantizeRecursive(children[0], decodeChildAabb(qNode, 0, nodeAabb));
+	quantizeRecursive(children[1], decodeChildAabb(qNode, 1, nodeAabb));
+}
+
+
+
+uint32_t Bvh::collapseRecursive(uint32_t nodeIndex)
+{
+	// Start with the node itself and open up the inner node with the largest surface area, i.e., the one most likely to be hit, until
+	// there are eight children or only leaves left. The root may be a leaf, then the wide root has a single leaf child.
+	uint32_t children[BvhWideNode::s_maxChildren];
+	int numChildren = 1;
+	children[0] = nodeIndex;
+	while (numChildren < BvhWideNode::s_maxChildren)
+	{
+		int best = -1;
+		float bestArea = -1.0f;
+		for (int i = 0; i < numChildren; ++i)
+		{
+			const BvhNode &child = m_nodes[children[i]];
+			if (!child.isLeaf() && child.aabb.getSurfaceArea() > bestArea)
+			{
+				best = i;
+				bestArea = child.aabb.getSurfaceArea();
+			}
+		}
+		if (best < 0)
+		{
+			break;
+		}
+		const uint32_t opened = children[best];
+		children[best] = opened + 1;
+		children[numChildren++] = m_nodes[opened].offset;
+	}
+
+	// Note: we refer to the node by index since the vector may be reallocated as the children are added.
+	const uint32_t wideIndex = uint32_t(m_wideNodes.size());
+	m_wideNodes.push_back(BvhWideNode());
+	m_wideNodes[wideIndex].numChildren = uint32_t(numChildren);
+	for (int c = 0; c < numChildren; ++c)
+	{
+		const BvhNode &child = m_nodes[children[c]];
+		for (int i = 0; i < 3; ++i)
+		{
+			m_wideNodes[wideIndex].bounds[i][c] = child.aabb.min[i];
+			m_wideNodes[wideIndex].bounds[i + 3][c] = child.aabb.max[i];
+		}
+		const uint32_t offset = child.isLeaf() ? child.offset : collapseRecursive(children[c]);
+		m_wideNodes[wideIndex].offset[c] = offset;
+		m_wideNodes[wideIndex].count[c] = uint8_t(child.count);
+	}
+	return wideIndex;
+}
+
+
+
+void Bvh::refit(const std::vector<Aabb> &primitiveAabbs, int numThreads, const ParallelForFn &parallelFor)
+{
+	assert(m_nodeFormat != NF_Quantized);
+	// Data given to 'useData' is read only, the arrays are empty.
+	assert(m_primitiveIndexData == m_primitiveIndices.data());
+	if (empty() || m_nodeFormat == NF_Quantized || m_primitiveIndexData != m_primitiveIndices.data())
+	{
+		return;
+	}
+
+	// 1. Split the tree into subtrees, a few per thread, which are cut off at the depth where there are enough of them (if the tree is
+	//    balanced). Without threads (or 'parallelFor') the whole tree is a single range.
+	std::vector<uint32_t> topNodes;
+	std::vector<uint32_t> rangeStarts;
+	std::vector<uint32_t> rangeEnds;
+	int splitDepth = 0;
+	if (parallelFor && numThreads > 1)
+	{
+		while ((1 << splitDepth) < numThreads * g_refitRangesPerThread)
+		{
+			++splitDepth;
+		}
+	}
+	collectRefitRanges(0, uint32_t(getNumNodes()), splitDepth, topNodes, rangeStarts, rangeEnds);
+
+	// 2. Refit the subtrees, each back to front, since the children are always after their parent.
+	std::vector<float> rangeCosts(rangeStarts.size(), 0.0f);
+	auto refitRange = [&](int range, int)
+	{
+		float cost = 0.0f;
+		for (uint32_t i = rangeEnds[range]; i-- > rangeStarts[range];)
+		{
+			cost += refitNode(i, primitiveAabbs);
+		}
+		rangeCosts[range] = cost;
+	};
+	if (rangeStarts.size() > 1)
+	{
+		parallelFor(int(rangeStarts.size()), refitRange);
+	}
+	else
+	{
+		refitRange(0, 0);
+	}
+
+	// 3. Then the nodes above the subtrees, which were collected parents first.
+	float cost = 0.0f;
+	for (float c : rangeCosts)
+	{
+		cost += c;
+	}
+	for (size_t i = topNodes.size(); i-- > 0;)
+	{
+		cost += refitNode(topNodes[i], primitiveAabbs);
+	}
+
+	if (m_nodeFormat == NF_Wide)
+	{
+		m_rootAabb = make_inverse_extreme_aabb();
+		for (uint32_t c = 0; c < m_wideNodes[0].numChildren; ++c)
+		{
+			m_rootAabb = combine(m_rootAabb, m_wideNodes[0].getChildAabb(c));
+		}
+		cost += g_traversalCost * m_rootAabb.getSurfaceArea();
+	}
+	else
+	{
+		m_rootAabb = m_nodes[0].aabb;
+	}
+	const float rootArea = m_rootAabb.getSurfaceArea();
+	m_sahCost = rootArea > 0.0f ? cost / rootArea : 0.0f;
+}
+
+
+
+int Bvh::getChildNodes(uint32_t nodeIndex, uint32_t children[BvhWideNode::s_maxChildren]) const
+{
+	if (m_nodeFormat == NF_Wide)
+	{
+		const BvhWideNode &node = m_wideNodes[nodeIndex];
+		int numChildren = 0;
+		for (uint32_t c = 0; c < node.numChildren; ++c)
+		{
+			if (node.count[c] == 0)
+			{
+				children[numChildren++] = node.offset[c];
+			}
+		}
+		return numChildren;
+	}
+	const BvhNode &node = m_nodes[nodeIndex];
+	if (node.isLeaf())
+	{
+		return 0;
+	}
+	children[0] = nodeIndex + 1;
+	children[1] = node.offset;
+	return 2;
+}
+
+
+
+void Bvh::collectRefitRanges(uint32_t nodeIndex, uint32_t end, int depth, std::vector<uint32_t> &topNodes, std::vector<uint32_t> &rangeStarts, std::vector<uint32_t> &rangeEnds) const
+{
+	uint32_t children[BvhWideNode::s_maxChildren];
+	const int numChildren = depth > 0 ? getChildNodes(nodeIndex, children) : 0;
+	if (numChildren == 0)
+	{
+		rangeStarts.push_back(nodeIndex);
+		rangeEnds.push_back(end);
+		return;
+	}
+	topNodes.push_back(nodeIndex);
+	for (int c = 0; c < numChildren; ++c)
+	{
+		collectRefitRanges(children[c], c + 1 < numChildren ? children[c + 1] : end, depth - 1, topNodes, rangeStarts, rangeEnds);
+	}
+}
+
+
+
+float Bvh::refitNode(uint32_t nodeIndex, const std::vector<Aabb> &primitiveAabbs)
+{
+	if (m_nodeFormat == NF_Wide)
+	{
+		BvhWideNode &node = m_wideNodes[nodeIndex];
+		for (uint32_t c = 0; c < node.numChildren; ++c)
+		{
+			Aabb aabb = make_inverse_extreme_aabb();
+			if (node.count[c] != 0)
+			{
+				aabb = getLeafAabb(m_primitiveIndices, node.offset[c], node.count[c], primitiveAabbs);
+			}
+			else
+			{
+				const BvhWideNode &child = m_wideNodes[node.offset[c]];
+				for (uint32_t cc = 0; cc < child.numChildren; ++cc)
+				{
+					aabb = combine(aabb, child.getChildAabb(cc));
+				}
+			}
+			for (int i = 0; i < 3; ++i)
+			{
+				node.bounds[i][c] = aabb.min[i];
+				node.bounds[i + 3][c] = aabb.max[i];
+			}
+		}
+	}
+	else
+	{
+		BvhNode &node = m_nodes[nodeIndex];
+		node.aabb = node.isLeaf() ? getLeafAabb(m_primitiveIndices, node.offset, node.count, primitiveAabbs) : combine(m_nodes[nodeIndex + 1].aabb, m_nodes[node.offset].aabb);
+	}
+	return getNodeSahCost(nodeIndex);
+}
+
+
+
+float Bvh::getNodeSahCost(uint32_t nodeIndex) const
+{
+	// For the wide nodes the cost is counted per child, since that is where the boxes are, the root is counted by the caller.
+	if (m_nodeFormat == NF_Wide)
+	{
+		const BvhWideNode &node = m_wideNodes[nodeIndex];
+		float cost = 0.0f;
+		for (uint32_t c = 0; c < node.numChildren; ++c)
+		{
+			const float area = node.getChildAabb(c).getSurfaceArea();
+			cost += node.count[c] != 0 ? g_intersectionCost * float(node.count[c]) * area : g_traversalCost * area;
+		}
+		return cost;
+	}
+	const BvhNode &node = m_nodes[nodeIndex];
+	const float area = node.aabb.getSurfaceArea();
+	return node.isLeaf() ? g_intersectionCost * float(node.count) * area : g_traversalCost * area;
+}
+
+
+
+float Bvh::computeSahCost() const
+{
+	// The quantized nodes are not refitted, so there is nothing to compare with.
+	if (empty() || m_nodeFormat == NF_Quantized)
+	{
+		return 0.0f;
+	}
+	float cost = m_nodeFormat == NF_Wide ? g_traversalCost * m_rootAabb.getSurfaceArea() : 0.0f;
+	for (uint32_t i = 0; i < uint32_t(getNumNodes()); ++i)
+	{
+		cost += getNodeSahCost(i);
+	}
+	const float rootArea = m_rootAabb.getSurfaceArea();
+	return rootArea > 0.0f ? cost / rootArea : 0.0f;
+}
@@ -0,0 +1,1062 @@
+/****************************************************************************/
+/* Copyright (c) 2016, Ola Olsson */
+/****************************************************************************/
+#ifndef _Bvh_h_
+#define _Bvh_h_
+
+#include "../rasterizer_with_obj_loader/Aabb.h"
+#include "RayPacket.h"
+#include "Counters.h"
+
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <stdint.h>
+#include <float.h>
+#include <emmintrin.h>
+
+/**
+ * Node of a flattened Bounding Volume Hierarchy (BVH). The node is 32 bytes, so two nodes fit in a 64 byte cache line.
+ * The nodes are stored in depth first order, which means that the first child of an inner node is always found directly
+ * after it in memory, and only the index of the second child needs to be stored. During traversal this means that
+ * one child is very likely to already be in the cache.
+ */
+struct BvhNode
+{
+	Aabb aabb;
+	// For inner nodes: the index of the second child, for leaves: the index of the first primitive in the primitive index list.
+	uint32_t offset;
+	// Number of primitives in the leaf, zero for inner nodes.
+	uint16_t count;
+	// The axis that was used to split the node (0, 1, 2 for x, y, z), not meaningful for leaves.
+	uint16_t axis;
+
+	inline bool isLeaf() const
+	{
+		return count != 0;
+	}
+};
+
+static_assert(sizeof(BvhNode) == 32, "BvhNode should be 32 bytes to keep two nodes to a cache line");
+
+/**
+ * Compressed version of 'BvhNode', for huge scenes where the memory used by the BVH (and the bandwidth needed to traverse it) matters
+ * more than the few instructions needed to decode it. Instead of its own box, an inner node stores the boxes of its two children,
+ * quantized to 8 bits per plane relative to its own box, which the traversal has already decoded on the way down (the box of the root
+ * is stored as floats in the BVH). The node is 16 bytes, half a BvhNode, so four nodes fit in a cache line. The nodes are in the same
+ * order as the BvhNodes they are made from.
+ *
+ * The quantized boxes are rounded outwards, so they always contain the real box, and the traversal is conservative: it may visit a few
+ * more nodes than with the float boxes, but never misses a primitive.
+ *
+ * The bytes are ordered so that one SSE load gets the planes of both children, four per axis, which lets the traversal decode and
+ * test both children at once (see 'Bvh::QuantizedNodes').
+ */
+struct BvhQuantizedNode
+{
+	// For inner nodes: the boxes of the two children, [axis][child 0 min, child 1 min, child 0 max, child 1 max], see 'decodeChildAabb'.
+	uint8_t childBounds[3][4];
+	// Same as in BvhNode, with fewer bits, which limits the number of nodes and primitives to 2^26 (see 'Bvh::build').
+	uint32_t offset : 26;
+	uint32_t count : 4;
+	uint32_t axis : 2;
+
+	inline bool isLeaf() const
+	{
+		return count != 0;
+	}
+};
+
+static_assert(sizeof(BvhQuantizedNode) == 16, "BvhQuantizedNode should be 16 bytes, half of a BvhNode");
+
+/**
+ * The planes of a quantized box, 'q' in [0,255], given the plane of the parent box on the same side and the step size, which is the
+ * size of the parent box along the axis divided by 255. The min planes are stepped from the min side and the max planes from the max
+ * side, so that 0 and 255 give exactly the planes of the parent box. The quantization (in Bvh.cpp) calls the same functions to
+ * make sure the decoded box contains the real box.
+ */
+inline float decodeQuantizedMin(float parentMin, float step, int q)
+{
+	return parentMin + float(q) * step;
+}
+
+inline float decodeQuantizedMax(float parentMax, float step, int q)
+{
+	return parentMax - float(255 - q) * step;
+}
+
+/**
+ * Returns the box of the child (0 or 1) of a quantized inner node, given the decoded box of the node itself.
+ */
+inline Aabb decodeChildAabb(const BvhQuantizedNode &node, int child, const Aabb &nodeAabb)
+{
+	// Note: the same as 'decodeQuantizedMin/Max' for each component.
+	const glm::vec3 step = (nodeAabb.max - nodeAabb.min) * (1.0f / 255.0f);
+	const uint8_t (&q)[3][4] = node.childBounds;
+	Aabb result = 
+	{
+		nodeAabb.min + glm::vec3(float(q[0][child]), float(q[1][child]), float(q[2][child])) * step,
+		nodeAabb.max - glm::vec3(float(255 - q[0][child + 2]), float(255 - q[1][child + 2]), float(255 - q[2][child + 2])) * step,
+	};
+	return result;
+}
+
+/**
+ * Node of a wide BVH (a BVH8), with up to eight children, made by collapsing a binary BVH (see 'Bvh::build'). The child boxes are
+ * stored as a structure of arrays, so that the ray can be tested against all of them with one set of AVX instructions (or two with
+ * SSE), see 'intersectRayWideNode'. Each child is either another wide node or a leaf, which is stored directly in the parent as the
+ * range of primitives, so there are no leaf nodes. The node is 256 bytes, i.e., four cache lines, which is less than the seven binary
+ * nodes (and cache misses) it replaces.
+ */
+struct BvhWideNode
+{
+	enum
+	{
+		s_maxChildren = 8,
+	};
+	// The boxes of the children, [min x, y, z, max x, y, z][child].
+	float bounds[6][s_maxChildren];
+	// For inner children: the index of the wide node, for leaves: the index of the first primitive.
+	uint32_t offset[s_maxChildren];
+	// Number of primitives in the leaf, zero for inner children.
+	uint8_t count[s_maxChildren];
+	// The children [0, numChildren) are used, the boxes of the rest are never tested.
+	uint32_t numChildren;
+	uint32_t padding[5];
+
+	Aabb getChildAabb(int child) const
+	{
+		Aabb result = { glm::vec3(bounds[0][child], bounds[1][child], bounds[2][child]), glm::vec3(bounds[3][child], bounds[4][child], bounds[5][child]) };
+		return result;
+	}
+};
+
+static_assert(sizeof(BvhWideNode) == 256, "BvhWideNode should be 256 bytes, four cache lines");
+
+/**
+ * Precalculated ray data used when testing against the BVH node boxes. The reciprocal of the direction is
+ * calculated once per ray, to avoid doing divisions for every node visited.
+ */
+struct BvhRay
+{
+	glm::vec3 origin;
+	glm::vec3 direction;
+	glm::vec3 invDirection;
+};
+
+inline BvhRay makeBvhRay(const glm::vec3 &origin, const glm::vec3 &direction)
+{
+	BvhRay r;
+	r.origin = origin;
+	r.direction = direction;
+	r.invDirection = 1.0f / direction;
+	return r;
+}
+
+/**
+ * Slab test of a ray against an aabb, returns true if the ray enters the box before 'tMax', and if so, the
+ * entry time is returned in 'tEntry'. Note that infinities from the reciprocal of zero direction components
+ * work out fine, as long as the origin is not exactly on one of the slab planes.
+ */
+inline bool intersectRayAabb(const BvhRay &ray, const Aabb &aabb, float tMax, float &tEntry)
+{
+	glm::vec3 t0 = (aabb.min - ray.origin) * ray.invDirection;
+	glm::vec3 t1 = (aabb.max - ray.origin) * ray.invDirection;
+	glm::vec3 tNear = glm::min(t0, t1);
+	glm::vec3 tFar = glm::max(t0, t1);
+
+	float tEnter = std::max(std::max(tNear.x, tNear.y), std::max(tNear.z, 0.0f));
+	float tExit = std::min(std::min(tFar.x, tFar.y), std::min(tFar.z, tMax));
+
+	tEntry = tEnter;
+	return tEnter <= tExit;
+}
+
+/**
+ * Slab test of a ray against all the child boxes of a wide node, 'g_simdWidth' children at a time. Returns a bit for each child that
+ * the ray enters before 'tMax', with the entry times in 'tEntry'. Same as 'intersectRayAabb', except that the NaN from an origin on a
+ * plane with a zero direction is ignored by the order of the arguments to min/max, which treats that slab as infinite.
+ */
+inline int intersectRayWideNode(const BvhRay &ray, const BvhWideNode &node, float tMax, float tEntry[BvhWideNode::s_maxChildren])
+{
+	int hits = 0;
+	for (int i = 0; i < BvhWideNode::s_maxChildren; i += g_simdWidth)
+	{
+		SimdFloat tEnter = simdZero();
+		SimdFloat tExit = simdSet(tMax);
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			const SimdFloat origin = simdSet(ray.origin[axis]);
+			const SimdFloat invDirection = simdSet(ray.invDirection[axis]);
+			SimdFloat t0 = simdMul(simdSub(simdLoad(&node.bounds[axis][i]), origin), invDirection);
+			SimdFloat t1 = simdMul(simdSub(simdLoad(&node.bounds[axis + 3][i]), origin), invDirection);
+			tEnter = simdMax(simdMin(t0, t1), tEnter);
+			tExit = simdMin(simdMax(t0, t1), tExit);
+		}
+		simdStore(tEntry + i, tEnter);
+		hits |= simdMoveMask(simdCmpLe(tEnter, tExit)) << i;
+	}
+	return hits & ((1 << node.numChildren) - 1);
+}
+
+
+/**
+ * Binary BVH built using the Surface Area Heuristic (SAH). The BVH does not know anything about the primitives, it is built
+ * from a list of aabbs and the traversal calls a user provided function to intersect the primitives in the leaves. The
+ * primitives are referred to using their index in the list passed to 'build'.
+ */
+class Bvh
+{
+public:
+	enum
+	{
+		s_maxLeafSize = 8,
+		// Traversal uses a fixed size stack, the build makes sure to never make a tree deeper than this.
+		s_maxDepth = 64,
+		// The largest number of nodes or primitives that fit in a BvhQuantizedNode.
+		s_maxQuantizedSize = 1 << 26,
+	};
+
+	/**
+	 * How the nodes are stored, as BvhNode (NF_Float), BvhQuantizedNode (NF_Quantized), which uses half the memory, or BvhWideNode
+	 * (NF_Wide), which tests eight boxes at a time.
+	 */
+	enum NodeFormat
+	{
+		NF_Float,
+		NF_Quantized,
+		NF_Wide,
+	};
+
+	/**
+	 * The arrays of a built BVH, which can be stored (e.g., in a scene file, see SceneFile.h) and used in place later on, see 'useData'.
+	 * 'nodes' points to 'numNodes' nodes of the type given by the node format.
+	 */
+	struct Data
+	{
+		NodeFormat nodeFormat;
+		Aabb rootAabb;
+		float sahCost;
+		const void *nodes;
+		size_t numNodes;
+		const uint32_t *primitiveIndices;
+		size_t numPrimitives;
+	};
+
+	/**
+	 * Runs 'taskFn' for each task in [0, numTasks), possibly in parallel, passing the task and the index of the thread running it, e.g.,
+	 * ThreadPool::parallelFor in the recursive ray tracer. This keeps the BVH free of any particular thread pool.
+	 */
+	typedef std::function<void(int numTasks, const std::function<void(int, int)> &taskFn)> ParallelForFn;
+
+	Bvh() = default;
+	// The nodes may be referred to by pointers into the arrays, which would end up pointing into the wrong BVH in a copy.
+	Bvh(const Bvh &) = delete;
+	Bvh &operator=(const Bvh &) = delete;
+	Bvh(Bvh &&) = default;
+	Bvh &operator=(Bvh &&) = default;
+
+	/**
+	 * Builds the hierarchy over the given primitive aabbs, any previous contents is discarded. Call again whenever the primitives change.
+	 * 'maxLeafSize' (at most s_maxLeafSize) limits the number of primitives in a leaf, and 'leafGroupSize' is the number of primitives
+	 * that can be tested for the price of one, e.g., the SIMD width when the leaves are intersected using SIMD. The SAH then charges
+	 * a leaf for the number of groups rather than the number of primitives, which makes for fuller leaves.
+	 * 'nodeFormat' selects how the nodes are stored, if there are too many nodes or primitives for the quantized format, the float
+	 * format is used anyway.
+	 */
+	void build(const std::vector<Aabb> &primitiveAabbs, int maxLeafSize = s_maxLeafSize, int leafGroupSize = 1, NodeFormat nodeFormat = NF_Float);
+
+	/**
+	 * Removes all nodes, traversing an empty BVH never finds anything.
+	 */
+	void clear();
+
+	/**
+	 * Makes the leaves refer to the primitives by their position in the list of primitive indices. Call this after reordering the
+	 * primitive data according to 'getPrimitiveIndices()', then the primitives in each leaf are next to each other in memory.
+	 */
+	void resetPrimitiveOrder();
+
+	/**
+	 * Updates the boxes of the nodes to the new primitive aabbs (in the same order as given to 'build'), without changing the tree, e.g.,
+	 * when the primitives have moved. This is much faster than a rebuild, but the tree gets worse the further the primitives move from
+	 * where they were built, which shows as a growing SAH cost (see 'getSahCost'). The nodes are stored depth first, so the subtrees are
+	 * contiguous ranges of nodes, which are refitted in parallel (if 'parallelFor' is given), back to front so that the children are
+	 * done before their parents, after which the few nodes above them are done the same way.
+	 * The quantized nodes cannot be refitted, since their boxes depend on the boxes of the parents, those must be rebuilt.
+	 */
+	void refit(const std::vector<Aabb> &primitiveAabbs, int numThreads = 1, const ParallelForFn &parallelFor = ParallelForFn());
+
+	/**
+	 * Returns the arrays of the BVH, for storing it, which are valid until the BVH is changed.
+	 */
+	Data getData() const;
+
+	/**
+	 * Uses BVH data stored elsewhere in place, e.g., in a memory mapped file, instead of building it. Nothing is copied, so the data
+	 * must stay valid and unchanged as long as the BVH is used. The BVH cannot be refitted, but can be rebuilt, which stops using
+	 * the data.
+	 */
+	void useData(const Data &data);
+
+	// The size of one node in the format.
+	static size_t getNodeSize(NodeFormat nodeFormat);
+
+	/**
+	 * The expected cost of tracing a ray according to the Surface Area Heuristic, i.e., the cost of testing each node and primitive
+	 * weighted by the probability of a random ray hitting its box, relative to the root box. Updated by 'build' and 'refit', so the
+	 * ratio to 'getBuildSahCost' tells how much the tree has degraded since it was built.
+	 */
+	float getSahCost() const { return m_sahCost; }
+	float getBuildSahCost() const { return m_buildSahCost; }
+
+	/**
+	 * Traverses the BVH front to back, i.e., visits the nearest child first. For each primitive in the leaves reached, the function
+	 * 'intersectFn(primitiveIndex, tMax)' is called. It should test the primitive and if it was hit closer than 'tMax', it should
+	 * update 'tMax' (which is a reference) to shrink the search interval. The function returns a bool, if it is true
+	 * the traversal is terminated (this is useful for occlusion queries, where any hit will do).
+	 * Returns true if the traversal was terminated by the intersect function.
+	 */
+	template <typename INTERSECT_FN>
+	bool traverse(const BvhRay &ray, float &tMax, INTERSECT_FN intersectFn) const;
+
+	/**
+	 * Any-hit traversal for occlusion queries, e.g., shadow rays. The function 'occludedFn(primitiveIndex)' is called for the primitives
+	 * and the traversal stops as soon as it returns true. Since there is no closest hit, the interval never shrinks and the stack
+	 * only needs to store node indices. The children are still visited in the order the ray enters them, to find an occluder as
+	 * early as possible. Returns true if anything was hit before 'tMax'.
+	 */
+	template <typename OCCLUDED_FN>
+	bool traverseAny(const BvhRay &ray, float tMax, OCCLUDED_FN occludedFn) const;
+
+	/**
+	 * Same as 'traverse' but the function is called once per leaf, as 'leafFn(firstPrimitive, count, tMax)', where the primitives are
+	 * at the positions [firstPrimitive, firstPrimitive + count) in the list of primitive indices. After 'resetPrimitiveOrder' this is also
+	 * where they are found in the primitive data, which makes it possible to test all primitives in a leaf at once, e.g., using SIMD.
+	 */
+	template <typename LEAF_FN>
+	bool traverseLeaves(const BvhRay &ray, float &tMax, LEAF_FN leafFn) const;
+
+	/**
+	 * Per-leaf version of 'traverseAny', the function 'leafFn(firstPrimitive, count)' returns true if any primitive in the leaf is hit.
+	 */
+	template <typename LEAF_FN>
+	bool traverseLeavesAny(const BvhRay &ray, float tMax, LEAF_FN leafFn) const;
+
+	/**
+	 * Traverses the BVH with a packet of rays, for the rays set in 'activeMask'. Each node is tested against the packet frustum and then
+	 * against the rays in SIMD groups, and the children are visited with the mask of the rays that hit them. For each leaf reached the
+	 * function 'leafFn(firstPrimitive, count, mask)' is called, and it should update 'packet.tMax' for the rays hitting something.
+	 * The children are ordered using the direction of the first active ray, which works well since the rays are coherent.
+	 */
+	template <typename LEAF_FN>
+	void traversePacket(const RayPacket &packet, PacketMask activeMask, LEAF_FN leafFn) const;
+
+	const uint32_t *getPrimitiveIndices() const { return m_primitiveIndexData; }
+	size_t getNumPrimitives() const { return m_numPrimitives; }
+	NodeFormat getNodeFormat() const { return m_nodeFormat; }
+	size_t getNumNodes() const { return m_numNodes; }
+	bool empty() const { return getNumNodes() == 0; }
+
+	/**
+	 * The box around all the primitives, must not be called for an empty BVH.
+	 */
+	const Aabb &getAabb() const { return m_rootAabb; }
+
+	/**
+	 * The memory used by the nodes and the primitive indices, in bytes.
+	 */
+	size_t getMemoryUsage() const;
+
+protected:
+	/**
+	 * The traversal is written once for both node formats, using these to access the nodes. A 'NodeRef' is what the traversal keeps
+	 * for each node it is going to visit, i.e., the index, and for quantized nodes also the decoded box. 'intersectChildren' finds
+	 * the children of an inner node and tests the ray against them, returning a bit for each child hit and their entry times.
+	 */
+	struct FloatNodes
+	{
+		struct NodeRef
+		{
+			uint32_t index;
+		};
+		const BvhNode *nodes;
+
+		NodeRef getRoot() const { return NodeRef{ 0 }; }
+		const Aabb &getAabb(const NodeRef &n) const { return nodes[n.index].aabb; }
+		bool isLeaf(const NodeRef &n) const { return nodes[n.index].isLeaf(); }
+		uint32_t getOffset(const NodeRef &n) const { return nodes[n.index].offset; }
+		uint32_t getCount(const NodeRef &n) const { return nodes[n.index].count; }
+		int getAxis(const NodeRef &n) const { return nodes[n.index].axis; }
+		void getChildren(const NodeRef &n, NodeRef &child0, NodeRef &child1) const
+		{
+			child0.index = n.index + 1;
+			child1.index = nodes[n.index].offset;
+		}
+		int intersectChildren(const BvhRay &ray, const NodeRef &n, float tMax, NodeRef &child0, NodeRef &child1, float &t0, float &t1) const
+		{
+			getChildren(n, child0, child1);
+			int hits = intersectRayAabb(ray, nodes[child0.index].aabb, tMax, t0) ? 1 : 0;
+			if (intersectRayAabb(ray, nodes[child1.index].aabb, tMax, t1))
+			{
+				hits |= 2;
+			}
+			return hits;
+		}
+	};
+
+	/**
+	 * The boxes are decoded and tested using SSE directly, rather than 'SimdFloat', since it is always two boxes of three axes, whatever
+	 * the SIMD width. Decoding costs a handful of instructions per node, which would otherwise be more than the loads saved.
+	 */
+	struct QuantizedNodes
+	{
+		struct NodeRef
+		{
+			// The decoded box, one register per axis holding (min, min, max, max), since this is what 'decodeChildPlanes' needs.
+			__m128 bounds[3];
+			uint32_t index;
+		};
+		const BvhQuantizedNode *nodes;
+		Aabb rootAabb;
+
+		NodeRef getRoot() const
+		{
+			NodeRef n;
+			n.index = 0;
+			for (int i = 0; i < 3; ++i)
+			{
+				n.bounds[i] = _mm_setr_ps(rootAabb.min[i], rootAabb.min[i], rootAabb.max[i], rootAabb.max[i]);
+			}
+			return n;
+		}
+		Aabb getAabb(const NodeRef &n) const
+		{
+			float b[3][4];
+			for (int i = 0; i < 3; ++i)
+			{
+				_mm_storeu_ps(b[i], n.bounds[i]);
+			}
+			Aabb result = { glm::vec3(b[0][0], b[1][0], b[2][0]), glm::vec3(b[0][2], b[1][2], b[2][2]) };
+			return result;
+		}
+		bool isLeaf(const NodeRef &n) const { return nodes[n.index].isLeaf(); }
+		uint32_t getOffset(const NodeRef &n) const { return nodes[n.index].offset; }
+		uint32_t getCount(const NodeRef &n) const { return nodes[n.index].count; }
+		int getAxis(const NodeRef &n) const { return nodes[n.index].axis; }
+
+		// Decodes the planes of both children of an inner node, per axis (child 0 min, child 1 min, child 0 max, child 1 max). The
+		// arithmetic is the same as in 'decodeQuantizedMin/Max', so the planes are exactly the ones the quantization checked.
+		void decodeChildPlanes(const NodeRef &n, __m128 planes[3]) const
+		{
+			const __m128i zero = _mm_setzero_si128();
+			const __m128i q = _mm_loadu_si128((const __m128i *)&nodes[n.index]);
+			const __m128i q16 = _mm_unpacklo_epi8(q, zero);
+			const __m128i q32[3] = { _mm_unpacklo_epi16(q16, zero), _mm_unpackhi_epi16(q16, zero), _mm_unpacklo_epi16(_mm_unpackhi_epi8(q, zero), zero) };
+			for (int i = 0; i < 3; ++i)
+			{
+				const __m128 b = n.bounds[i];
+				const __m128 step = _mm_mul_ps(_mm_sub_ps(_mm_shuffle_ps(b, b, _MM_SHUFFLE(2, 2, 2, 2)), _mm_shuffle_ps(b, b, _MM_SHUFFLE(0, 0, 0, 0))), _mm_set1_ps(1.0f / 255.0f));
+				const __m128 qf = _mm_cvtepi32_ps(q32[i]);
+				const __m128 lo = _mm_add_ps(b, _mm_mul_ps(qf, step));
+				const __m128 hi = _mm_sub_ps(b, _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(255.0f), qf), step));
+				planes[i] = _mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 2, 1, 0));
+			}
+		}
+		void makeChildren(const NodeRef &n, const __m128 planes[3], NodeRef &child0, NodeRef &child1) const
+		{
+			child0.index = n.index + 1;
+			child1.index = nodes[n.index].offset;
+			for (int i = 0; i < 3; ++i)
+			{
+				child0.bounds[i] = _mm_shuffle_ps(planes[i], planes[i], _MM_SHUFFLE(2, 2, 0, 0));
+				child1.bounds[i] = _mm_shuffle_ps(planes[i], planes[i], _MM_SHUFFLE(3, 3, 1, 1));
+			}
+		}
+		void getChildren(const NodeRef &n, NodeRef &child0, NodeRef &child1) const
+		{
+			__m128 planes[3];
+			decodeChildPlanes(n, planes);
+			makeChildren(n, planes, child0, child1);
+		}
+		int intersectChildren(const BvhRay &ray, const NodeRef &n, float tMax, NodeRef &child0, NodeRef &child1, float &t0, float &t1) const
+		{
+			__m128 planes[3];
+			decodeChildPlanes(n, planes);
+			makeChildren(n, planes, child0, child1);
+
+			// Same slab test as 'intersectRayAabb', for both children at once: swapping the halves pairs each min plane with its max plane,
+			// after which lane 0 is child 0 and lane 1 is child 1. The NaN from an origin on a plane with a zero direction is ignored by
+			// the order of the arguments to min/max, which treats that slab as infinite.
+			__m128 tEnter = _mm_setzero_ps();
+			__m128 tExit = _mm_set1_ps(tMax);
+			for (int i = 0; i < 3; ++i)
+			{
+				const __m128 t = _mm_mul_ps(_mm_sub_ps(planes[i], _mm_set1_ps(ray.origin[i])), _mm_set1_ps(ray.invDirection[i]));
+				const __m128 tSwapped = _mm_shuffle_ps(t, t, _MM_SHUFFLE(1, 0, 3, 2));
+				tEnter = _mm_max_ps(_mm_min_ps(t, tSwapped), tEnter);
+				tExit = _mm_min_ps(_mm_max_ps(t, tSwapped), tExit);
+			}
+			t0 = _mm_cvtss_f32(tEnter);
+			t1 = _mm_cvtss_f32(_mm_shuffle_ps(tEnter, tEnter, _MM_SHUFFLE(1, 1, 1, 1)));
+			return _mm_movemask_ps(_mm_cmple_ps(tEnter, tExit)) & 3;
+		}
+	};
+
+	FloatNodes getFloatNodes() const { return FloatNodes{ static_cast<const BvhNode*>(m_nodeData) }; }
+	QuantizedNodes getQuantizedNodes() const { return QuantizedNodes{ static_cast<const BvhQuantizedNode*>(m_nodeData), m_rootAabb }; }
+	const BvhWideNode *getWideNodes() const { return static_cast<const BvhWideNode*>(m_nodeData); }
+
+	template <typename NODES, typename LEAF_FN>
+	static bool traverseLeaves(const NODES &nodes, const BvhRay &ray, float &tMax, LEAF_FN leafFn);
+	template <typename NODES, typename LEAF_FN>
+	static bool traverseLeavesAny(const NODES &nodes, const BvhRay &ray, float tMax, LEAF_FN leafFn);
+	template <typename NODES, typename LEAF_FN>
+	static void traversePacket(const NODES &nodes, const RayPacket &packet, PacketMask activeMask, LEAF_FN leafFn);
+
+	// The wide nodes have a different number of children, and keep the leaves in the parent, so they have their own traversal.
+	template <typename LEAF_FN>
+	bool traverseLeavesWide(const BvhRay &ray, float &tMax, LEAF_FN leafFn) const;
+	template <typename LEAF_FN>
+	bool traverseLeavesAnyWide(const BvhRay &ray, float tMax, LEAF_FN leafFn) const;
+	template <typename LEAF_FN>
+	void traversePacketWide(const RayPacket &packet, PacketMask activeMask, LEAF_FN leafFn) const;
+
+	struct BuildPrimitive
+	{
+		Aabb aabb;
+		glm::vec3 centre;
+		uint32_t index;
+	};
+
+	uint32_t buildRecursive(std::vector<BuildPrimitive> &prims, uint32_t start, uint32_t end, int depth, uint32_t maxLeafSize, uint32_t leafGroupSize);
+	// Quantizes the children of the node relative to 'nodeAabb', the decoded box of the node, and then does the same for the children.
+	void quantizeRecursive(uint32_t nodeIndex, const Aabb &nodeAabb);
+	// Makes a wide node from the binary node and its descendants, and then does the same for the inner children, returns the index.
+	uint32_t collapseRecursive(uint32_t nodeIndex);
+
+	// For 'refit': the child nodes of a node, in increasing order, not counting leaves stored in a wide node. The subtree of a node is
+	// the range of nodes [node, end), where 'end' is the next child of the parent (or the end of the parent's range).
+	int getChildNodes(uint32_t nodeIndex, uint32_t children[BvhWideNode::s_maxChildren]) const;
+	void collectRefitRanges(uint32_t nodeIndex, uint32_t end, int depth, std::vector<uint32_t> &topNodes, std::vector<uint32_t> &rangeStarts, std::vector<uint32_t> &rangeEnds) const;
+	// Updates the box(es) of the node from its children and returns the SAH cost (not normalized) of the node.
+	float refitNode(uint32_t nodeIndex, const std::vector<Aabb> &primitiveAabbs);
+	float getNodeSahCost(uint32_t nodeIndex) const;
+	float computeSahCost() const;
+	// Points the data used by the traversal to the arrays, must be called when they have been (re-)allocated.
+	void setDataPointers();
+
+	NodeFormat m_nodeFormat = NF_Float;
+	Aabb m_rootAabb;
+	std::vector<BvhNode> m_nodes;
+	std::vector<BvhQuantizedNode> m_quantizedNodes;
+	std::vector<BvhWideNode> m_wideNodes;
+	std::vector<uint32_t> m_primitiveIndices;
+	float m_sahCost = 0.0f;
+	float m_buildSahCost = 0.0f;
+	// What the traversal uses, either the nodes in the array for the node format and 'm_primitiveIndices', or the data given to 'useData'.
+	const void *m_nodeData = nullptr;
+	size_t m_numNodes = 0;
+	const uint32_t *m_primitiveIndexData = nullptr;
+	size_t m_numPrimitives = 0;
+};
+
+
+
+template <typename INTERSECT_FN>
+inline bool Bvh::traverse(const BvhRay &ray, float &tMax, INTERSECT_FN intersectFn) const
+{
+	return traverseLeaves(ray, tMax, [&](uint32_t firstPrimitive, uint32_t count, float &leafTMax)
+	{
+		for (uint32_t i = firstPrimitive; i < firstPrimitive + count; ++i)
+		{
+			if (intersectFn(m_primitiveIndexData[i], leafTMax))
+			{
+				return true;
+			}
+		}
+		return false;
+	});
+}
+
+
+
+template <typename OCCLUDED_FN>
+inline bool Bvh::traverseAny(const BvhRay &ray, float tMax, OCCLUDED_FN occludedFn) const
+{
+	return traverseLeavesAny(ray, tMax, [&](uint32_t firstPrimitive, uint32_t count)
+	{
+		for (uint32_t i = firstPrimitive; i < firstPrimitive + count; ++i)
+		{
+			if (occludedFn(m_primitiveIndexData[i]))
+			{
+				return true;
+			}
+		}
+		return false;
+	});
+}
+
+
+
+template <typename LEAF_FN>
+inline bool Bvh::traverseLeaves(const BvhRay &ray, float &tMax, LEAF_FN leafFn) const
+{
+	if (empty())
+	{
+		return false;
+	}
+	if (m_nodeFormat == NF_Quantized)
+	{
+		return traverseLeaves(getQuantizedNodes(), ray, tMax, leafFn);
+	}
+	if (m_nodeFormat == NF_Wide)
+	{
+		return traverseLeavesWide(ray, tMax, leafFn);
+	}
+	return traverseLeaves(getFloatNodes(), ray, tMax, leafFn);
+}
+
+
+
+template <typename LEAF_FN>
+inline bool Bvh::traverseLeavesAny(const BvhRay &ray, float tMax, LEAF_FN leafFn) const
+{
+	if (empty())
+	{
+		return false;
+	}
+	if (m_nodeFormat == NF_Quantized)
+	{
+		return traverseLeavesAny(getQuantizedNodes(), ray, tMax, leafFn);
+	}
+	if (m_nodeFormat == NF_Wide)
+	{
+		return traverseLeavesAnyWide(ray, tMax, leafFn);
+	}
+	return traverseLeavesAny(getFloatNodes(), ray, tMax, leafFn);
+}
+
+
+
+template <typename LEAF_FN>
+inline void Bvh::traversePacket(const RayPacket &packet, PacketMask activeMask, LEAF_FN leafFn) const
+{
+	if (empty())
+	{
+		return;
+	}
+	if (m_nodeFormat == NF_Quantized)
+	{
+		traversePacket(getQuantizedNodes(), packet, activeMask, leafFn);
+		return;
+	}
+	if (m_nodeFormat == NF_Wide)
+	{
+		traversePacketWide(packet, activeMask, leafFn);
+		return;
+	}
+	traversePacket(getFloatNodes(), packet, activeMask, leafFn);
+}
+
+
+
+template <typename NODES, typename LEAF_FN>
+inline bool Bvh::traverseLeaves(const NODES &nodes, const BvhRay &ray, float &tMax, LEAF_FN leafFn)
+{
+	typedef typename NODES::NodeRef NodeRef;
+
+	NodeRef node = nodes.getRoot();
+	float tEntry = 0.0f;
+	if (!intersectRayAabb(ray, nodes.getAabb(node), tMax, tEntry))
+	{
+		return false;
+	}
+
+	// The stack stores the node and the entry time, so that nodes which are further away than the current closest hit can be skipped when popped.
+	struct StackEntry
+	{
+		NodeRef node;
+		float tEntry;
+	};
+	StackEntry stack[s_maxDepth];
+	int stackSize = 0;
+
+	for (;;)
+	{
+		COUNTER_ADD(nodeVisits, 1);
+		if (nodes.isLeaf(node))
+		{
+			if (leafFn(nodes.getOffset(node), nodes.getCount(node), tMax))
+			{
+				return true;
+			}
+		}
+		else
+		{
+			NodeRef child0, child1;
+			float t0 = 0.0f;
+			float t1 = 0.0f;
+			const int hits = nodes.intersectChildren(ray, node, tMax, child0, child1, t0, t1);
+			const bool hit0 = (hits & 1) != 0;
+			const bool hit1 = (hits & 2) != 0;
+
+			if (hit0 && hit1)
+			{
+				// Visit the nearest first, push the other one.
+				if (t1 < t0)
+				{
+					std::swap(child0, child1);
+					std::swap(t0, t1);
+				}
+				stack[stackSize].node = child1;
+				stack[stackSize].tEntry = t1;
+				++stackSize;
+				node = child0;
+				continue;
+			}
+			if (hit0 || hit1)
+			{
+				node = hit0 ? child0 : child1;
+				continue;
+			}
+		}
+
+		// Pop the next node, skipping any that are entered after the closest hit found so far.
+		do
+		{
+			if (stackSize == 0)
+			{
+				return false;
+			}
+			--stackSize;
+		} while (stack[stackSize].tEntry > tMax);
+		node = stack[stackSize].node;
+	}
+}
+
+
+
+template <typename NODES, typename LEAF_FN>
+inline bool Bvh::traverseLeavesAny(const NODES &nodes, const BvhRay &ray, float tMax, LEAF_FN leafFn)
+{
+	typedef typename NODES::NodeRef NodeRef;
+
+	NodeRef node = nodes.getRoot();
+	float tEntry = 0.0f;
+	if (!intersectRayAabb(ray, nodes.getAabb(node), tMax, tEntry))
+	{
+		return false;
+	}
+
+	NodeRef stack[s_maxDepth];
+	int stackSize = 0;
+
+	for (;;)
+	{
+		COUNTER_ADD(nodeVisits, 1);
+		if (nodes.isLeaf(node))
+		{
+			if (leafFn(nodes.getOffset(node), nodes.getCount(node)))
+			{
+				return true;
+			}
+		}
+		else
+		{
+			NodeRef child0, child1;
+			float t0 = 0.0f;
+			float t1 = 0.0f;
+			const int hits = nodes.intersectChildren(ray, node, tMax, child0, child1, t0, t1);
+			const bool hit0 = (hits & 1) != 0;
+			const bool hit1 = (hits & 2) != 0;
+			if (hit0 && hit1)
+			{
+				// Visit the child the ray enters first, since this is where the occluder most likely is found.
+				if (t1 < t0)
+				{
+					std::swap(child0, child1);
+				}
+				stack[stackSize++] = child1;
+				node = child0;
+				continue;
+			}
+			if (hit0 || hit1)
+			{
+				node = hit0 ? child0 : child1;
+				continue;
+			}
+		}
+
+		if (stackSize == 0)
+		{
+			return false;
+		}
+		node = stack[--stackSize];
+	}
+}
+
+
+
+template <typename NODES, typename LEAF_FN>
+inline void Bvh::traversePacket(const NODES &nodes, const RayPacket &packet, PacketMask activeMask, LEAF_FN leafFn)
+{
+	typedef typename NODES::NodeRef NodeRef;
+
+	NodeRef node = nodes.getRoot();
+	PacketMask mask = intersectRayPacketAabb(packet, activeMask, nodes.getAabb(node));
+	if (mask == 0)
+	{
+		return;
+	}
+
+	struct StackEntry
+	{
+		NodeRef node;
+		PacketMask mask;
+	};
+	StackEntry stack[s_maxDepth];
+	int stackSize = 0;
+
+	for (;;)
+	{
+		COUNTER_ADD(nodeVisits, 1);
+		if (nodes.isLeaf(node))
+		{
+			leafFn(nodes.getOffset(node), nodes.getCount(node), mask);
+		}
+		else
+		{
+			NodeRef child0, child1;
+			nodes.getChildren(node, child0, child1);
+			PacketMask mask0 = intersectRayPacketAabb(packet, mask, nodes.getAabb(child0));
+			PacketMask mask1 = intersectRayPacketAabb(packet, mask, nodes.getAabb(child1));
+
+			if (mask0 != 0 && mask1 != 0)
+			{
+				// The first child is on the low side of the split axis, so a ray pointing the other way should visit the second child first.
+				int firstRay = 0;
+				while (((mask >> firstRay) & 1) == 0)
+				{
+					++firstRay;
+				}
+				const float *direction[3] = { packet.directionX, packet.directionY, packet.directionZ };
+				if (direction[nodes.getAxis(node)][firstRay] < 0.0f)
+				{
+					std::swap(child0, child1);
+					std::swap(mask0, mask1);
+				}
+				stack[stackSize].node = child1;
+				stack[stackSize].mask = mask1;
+				++stackSize;
+				node = child0;
+				mask = mask0;
+				continue;
+			}
+			if (mask0 != 0 || mask1 != 0)
+			{
+				node = mask0 != 0 ? child0 : child1;
+				mask = mask0 | mask1;
+				continue;
+			}
+		}
+
+		// Pop the next node, since closer hits may have been found after it was pushed the rays are tested again.
+		do
+		{
+			if (stackSize == 0)
+			{
+				return;
+			}
+			--stackSize;
+			node = stack[stackSize].node;
+			mask = intersectRayPacketAabb(packet, stack[stackSize].mask, nodes.getAabb(node));
+		} while (mask == 0);
+	}
+}
+
+
+
+/**
+ * The children of a wide node on the traversal stack, which are either wide nodes ('count' is 0) or leaves.
+ */
+struct BvhWideStackEntry
+{
+	uint32_t offset;
+	uint32_t count;
+	float tEntry;
+};
+
+/**
+ * Pushes the children hit (the bits in 'hits') onto the stack, sorted so that the nearest ends up on top, and is popped first.
+ * There are at most eight, so an insertion sort is as good as anything.
+ */
+inline void pushWideChildrenSorted(const BvhWideNode &node, int hits, const float tEntry[BvhWideNode::s_maxChildren], BvhWideStackEntry *stack, int &stackSize)
+{
+	const int first = stackSize;
+	for (int c = 0; c < BvhWideNode::s_maxChildren; ++c)
+	{
+		if (hits & (1 << c))
+		{
+			BvhWideStackEntry e = { node.offset[c], node.count[c], tEntry[c] };
+			int i = stackSize++;
+			for (; i > first && stack[i - 1].tEntry < e.tEntry; --i)
+			{
+				stack[i] = stack[i - 1];
+			}
+			stack[i] = e;
+		}
+	}
+}
+
+
+
+template <typename LEAF_FN>
+inline bool Bvh::traverseLeavesWide(const BvhRay &ray, float &tMax, LEAF_FN leafFn) const
+{
+	float tEntry = 0.0f;
+	if (!intersectRayAabb(ray, m_rootAabb, tMax, tEntry))
+	{
+		return false;
+	}
+
+	// Each wide node visited replaces itself on the stack with at most eight children, and the depth is at most that of the binary tree.
+	BvhWideStackEntry stack[s_maxDepth * (BvhWideNode::s_maxChildren - 1) + 1];
+	int stackSize = 0;
+	stack[stackSize++] = BvhWideStackEntry{ 0, 0, tEntry };
+
+	while (stackSize != 0)
+	{
+		// Skip any nodes that are entered after the closest hit found so far.
+		const BvhWideStackEntry entry = stack[--stackSize];
+		if (entry.tEntry > tMax)
+		{
+			continue;
+		}
+		COUNTER_ADD(nodeVisits, 1);
+		if (entry.count != 0)
+		{
+			if (leafFn(entry.offset, entry.count, tMax))
+			{
+				return true;
+			}
+			continue;
+		}
+		const BvhWideNode &node = getWideNodes()[entry.offset];
+		float tChildren[BvhWideNode::s_maxChildren];
+		const int hits = intersectRayWideNode(ray, node, tMax, tChildren);
+		pushWideChildrenSorted(node, hits, tChildren, stack, stackSize);
+	}
+	return false;
+}
+
+
+
+template <typename LEAF_FN>
+inline bool Bvh::traverseLeavesAnyWide(const BvhRay &ray, float tMax, LEAF_FN leafFn) const
+{
+	float tEntry = 0.0f;
+	if (!intersectRayAabb(ray, m_rootAabb, tMax, tEntry))
+	{
+		return false;
+	}
+
+	BvhWideStackEntry stack[s_maxDepth * (BvhWideNode::s_maxChildren - 1) + 1];
+	int stackSize = 0;
+	stack[stackSize++] = BvhWideStackEntry{ 0, 0, tEntry };
+
+	while (stackSize != 0)
+	{
+		const BvhWideStackEntry entry = stack[--stackSize];
+		COUNTER_ADD(nodeVisits, 1);
+		if (entry.count != 0)
+		{
+			if (leafFn(entry.offset, entry.count))
+			{
+				return true;
+			}
+			continue;
+		}
+		// The children are still visited in the order the ray enters them, to find an occluder as early as possible.
+		const BvhWideNode &node = getWideNodes()[entry.offset];
+		float tChildren[BvhWideNode::s_maxChildren];
+		const int hits = intersectRayWideNode(ray, node, tMax, tChildren);
+		pushWideChildrenSorted(node, hits, tChildren, stack, stackSize);
+	}
+	return false;
+}
+
+
+
+template <typename LEAF_FN>
+inline void Bvh::traversePacketWide(const RayPacket &packet, PacketMask activeMask, LEAF_FN leafFn) const
+{
+	PacketMask rootMask = intersectRayPacketAabb(packet, activeMask, m_rootAabb);
+	if (rootMask == 0)
+	{
+		return;
+	}
+
+	struct StackEntry
+	{
+		uint32_t offset;
+		uint32_t count;
+		PacketMask mask;
+	};
+	StackEntry stack[s_maxDepth * (BvhWideNode::s_maxChildren - 1) + 1];
+	int stackSize = 0;
+	stack[stackSize++] = StackEntry{ 0, 0, rootMask };
+
+	while (stackSize != 0)
+	{
+		const StackEntry entry = stack[--stackSize];
+		COUNTER_ADD(nodeVisits, 1);
+		if (entry.count != 0)
+		{
+			// Unlike the binary traversal, the mask is not tested again when popped, since the box is not at hand, the leaf function only
+			// accepts hits closer than 'tMax' anyway.
+			leafFn(entry.offset, entry.count, entry.mask);
+			continue;
+		}
+
+		// The children are tested one by one against the packet, and pushed in the order the first active ray enters them, which
+		// works well since the rays are coherent.
+		const BvhWideNode &node = getWideNodes()[entry.offset];
+		int firstRay = 0;
+		while (((entry.mask >> firstRay) & 1) == 0)
+		{
+			++firstRay;
+		}
+		const BvhRay firstBvhRay = makeBvhRay(glm::vec3(packet.originX[firstRay], packet.originY[firstRay], packet.originZ[firstRay]),
+			glm::vec3(packet.directionX[firstRay], packet.directionY[firstRay], packet.directionZ[firstRay]));
+		float tChildren[BvhWideNode::s_maxChildren];
+		intersectRayWideNode(firstBvhRay, node, FLT_MAX, tChildren);
+
+		// The children hit, furthest first, so that the nearest ends up on top of the stack.
+		int order[BvhWideNode::s_maxChildren];
+		PacketMask masks[BvhWideNode::s_maxChildren];
+		int numHit = 0;
+		for (int c = 0; c < int(node.numChildren); ++c)
+		{
+			masks[c] = intersectRayPacketAabb(packet, entry.mask, node.getChildAabb(c));
+			if (masks[c] != 0)
+			{
+				int i = numHit++;
+				for (; i > 0 && tChildren[order[i - 1]] < tChildren[c]; --i)
+				{
+					order[i] = order[i - 1];
+				}
+				order[i] = c;
+			}
+		}
+		for (int i = 0; i < numHit; ++i)
+		{
+			const int c = order[i];
+			stack[stackSize++] = StackEntry{ node.offset[c], node.count[c], masks[c] };
+		}
+	}
+}
+
+#endif // _Bvh_h_
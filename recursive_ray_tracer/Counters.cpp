@@ -0,0 +1,26 @@
+/****************************************************************************/
+/* Copyright (c) 2016, Ola Olsson */
+/****************************************************************************/
+#include "Counters.h"
+
+#include <inttypes.h>
+
+
+void Counters::writeJson(FILE *f, int frame) const
+{
+	fprintf(f, "{ \"frame\": %d, \"rays\": { \"primary\": %" PRIu64 ", \"shadow\": %" PRIu64 ", \"reflection\": %" PRIu64 " }, ", 
+		frame, rays[RT_Primary], rays[RT_Shadow], rays[RT_Reflection]);
+	fprintf(f, "\"queries\": %" PRIu64 ", \"nodeVisits\": %" PRIu64 ", \"primitiveTests\": %" PRIu64 ", \"shadeCalls\": %" PRIu64 ", \"terminatedRays\": %" PRIu64 ", \"cachedPrimaryRays\": %" PRIu64 ", \"occluderCacheTests\": %" PRIu64 ", \"occluderCacheHits\": %" PRIu64 ", \"depthHistogram\": [",
+		queries, nodeVisits, primitiveTests, shadeCalls, terminatedRays, cachedPrimaryRays, occluderCacheTests, occluderCacheHits);
+	// Leave out the empty bins at the end.
+	int numBins = s_maxDepth;
+	while (numBins > 1 && depthHistogram[numBins - 1] == 0)
+	{
+		--numBins;
+	}
+	for (int i = 0; i < numBins; ++i)
+	{
+		fprintf(f, "%s%" PRIu64, i > 0 ? ", " : "", depthHistogram[i]);
+	}
+	fprintf(f, "] }\n");
+}
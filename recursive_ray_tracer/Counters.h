@@ -0,0 +1,201 @@
+/****************************************************************************/
+/* Copyright (c) 2016, Ola Olsson */
+/****************************************************************************/
+#ifndef _Counters_h_
+#define _Counters_h_
+
+// When enabled, the number of rays, BVH node visits, primitive tests and so on are counted, to see where the time goes in a frame,
+// see 'Counters'. When disabled, the COUNTER_ADD macro expands to nothing, so the counting costs nothing. The switch is here rather
+// than in main.cpp, since it must be the same in all files (it can also be set on the compiler command line, e.g., -DUSE_COUNTERS=1).
+#ifndef USE_COUNTERS
+#define USE_COUNTERS 0
+#endif // USE_COUNTERS
+
+#include <stdio.h>
+#include <stdint.h>
+#include <algorithm>
+
+#if USE_COUNTERS
+#include <vector>
+#include <mutex>
+#endif // USE_COUNTERS
+
+enum RayType
+{
+	RT_Primary,
+	RT_Shadow,
+	RT_Reflection,
+	RT_Max,
+};
+
+/**
+ * Counts of the work done while tracing a frame. Each thread has its own counters (see 'getThreadCounters'), which are just plain
+ * integers, so counting does not need any synchronization. 'gatherCounters' sums them up after the frame. Everything but
+ * 'writeJson' is in this header, so that code that only counts (e.g., Bvh.h) does not need Counters.cpp.
+ */
+struct Counters
+{
+	enum
+	{
+		// Rays at this depth, or deeper, are counted in the last bin of the histogram.
+		s_maxDepth = 16,
+	};
+
+	Counters() { clear(); }
+
+	void clear()
+	{
+		std::fill(rays, rays + RT_Max, 0);
+		std::fill(depthHistogram, depthHistogram + s_maxDepth, 0);
+		queries = 0;
+		nodeVisits = 0;
+		primitiveTests = 0;
+		shadeCalls = 0;
+		terminatedRays = 0;
+		cachedPrimaryRays = 0;
+		occluderCacheTests = 0;
+		occluderCacheHits = 0;
+	}
+
+	void add(const Counters &other)
+	{
+		for (int i = 0; i < RT_Max; ++i)
+		{
+			rays[i] += other.rays[i];
+		}
+		for (int i = 0; i < s_maxDepth; ++i)
+		{
+			depthHistogram[i] += other.depthHistogram[i];
+		}
+		queries += other.queries;
+		nodeVisits += other.nodeVisits;
+		primitiveTests += other.primitiveTests;
+		shadeCalls += other.shadeCalls;
+		terminatedRays += other.terminatedRays;
+		cachedPrimaryRays += other.cachedPrimaryRays;
+		occluderCacheTests += other.occluderCacheTests;
+		occluderCacheHits += other.occluderCacheHits;
+	}
+
+	/**
+	 * Writes the counters as a JSON object on one line, 'frame' is included to tell the frames apart.
+	 */
+	void writeJson(FILE *f, int frame) const;
+
+	uint64_t rays[RT_Max];
+	// Rays traced at each recursion depth, the primary rays are at depth 0.
+	uint64_t depthHistogram[s_maxDepth];
+	// Number of calls to 'findClosestIntersection' or 'isRayOccluded', or a packet version of these.
+	uint64_t queries;
+	// Nodes visited in any BVH, note that a packet visiting a node counts as one visit.
+	uint64_t nodeVisits;
+	// Ray/primitive (sphere or triangle) tests, a packet counts one test per active ray.
+	uint64_t primitiveTests;
+	uint64_t shadeCalls;
+	// Reflection rays that were not traced since they would contribute too little to the pixel, see 'continuePath' in main.cpp. Each
+	// also saves the shadow ray at its hit, and any further bounces.
+	uint64_t terminatedRays;
+	// Camera rays that were not traced since their hits were kept from an earlier frame, see 'tracePrimaryRays' in main.cpp.
+	uint64_t cachedPrimaryRays;
+	// Shadow rays tested against the primitive that blocked the last shadow ray on the thread, and how many of them it blocked, which
+	// saves their traversal, see 'isRayOccluded' in main.cpp.
+	uint64_t occluderCacheTests;
+	uint64_t occluderCacheHits;
+};
+
+#if USE_COUNTERS
+
+/**
+ * The counters of all the threads, for 'gatherCounters'. Kept in a function so that there is only one, without a source file.
+ */
+struct CountersRegistry
+{
+	std::mutex mutex;
+	std::vector<Counters*> threadCounters;
+	// The counts of threads that have exited since the last 'gatherCounters'.
+	Counters exitedCounters;
+};
+
+inline CountersRegistry &getCountersRegistry()
+{
+	static CountersRegistry registry;
+	return registry;
+}
+
+/**
+ * The counters of one thread, which register themselves to be included in 'gatherCounters', and add their counts to the total when
+ * the thread exits.
+ */
+struct ThreadCounters : public Counters
+{
+	ThreadCounters()
+	{
+		CountersRegistry &registry = getCountersRegistry();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+		registry.threadCounters.push_back(this);
+	}
+
+	~ThreadCounters()
+	{
+		CountersRegistry &registry = getCountersRegistry();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+		registry.exitedCounters.add(*this);
+		registry.threadCounters.erase(std::find(registry.threadCounters.begin(), registry.threadCounters.end(), this));
+	}
+};
+
+/**
+ * The counters of the calling thread, these are created the first time the thread calls this.
+ */
+inline Counters &getThreadCounters()
+{
+	static thread_local ThreadCounters counters;
+	return counters;
+}
+
+/**
+ * Returns the sum of the counters of all threads (including threads that have exited) and clears them. Must only be called while no
+ * other thread is counting, e.g., between frames.
+ */
+inline Counters gatherCounters()
+{
+	CountersRegistry &registry = getCountersRegistry();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+	Counters result = registry.exitedCounters;
+	registry.exitedCounters.clear();
+	for (Counters *c : registry.threadCounters)
+	{
+		result.add(*c);
+		c->clear();
+	}
+	return result;
+}
+
+#define COUNTER_ADD(_name_, _value_) (getThreadCounters()._name_ += uint64_t(_value_))
+
+#else // !USE_COUNTERS
+
+// The value is not evaluated, so it can be an expression that is only needed for counting.
+#define COUNTER_ADD(_name_, _value_) ((void)0)
+
+#endif // USE_COUNTERS
+
+/**
+ * Counts a ray of the given type that is traced at 'depth'.
+ */
+#define COUNTER_ADD_RAYS(_type_, _depth_, _count_) (COUNTER_ADD(rays[_type_], _count_), COUNTER_ADD(depthHistogram[std::min(int(_depth_), int(Counters::s_maxDepth) - 1)], _count_))
+
+/**
+ * Returns the number of bits set, e.g., to count the active rays in a packet.
+ */
+inline int countBits(uint64_t bits)
+{
+	int count = 0;
+	for (; bits != 0; bits &= bits - 1)
+	{
+		++count;
+	}
+	return count;
+}
+
+#endif // _Counters_h_
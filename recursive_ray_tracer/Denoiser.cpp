@@ -0,0 +1,284 @@
+/****************************************************************************/
+/* Copyright (c) 2016, Ola Olsson */
+/****************************************************************************/
+#include "Denoiser.h"
+#include "Simd.h"
+
+#include <algorithm>
+#include <chrono>
+#include <math.h>
+
+using glm::vec3;
+
+namespace
+{
+	// How different the brightness (the square root of the luminance) of a neighbour can be before its weight drops off, in the first
+	// iteration. This is halved for each iteration, since the noise is smoothed out and the differences left are real.
+	const float g_brightnessSigma = 0.5f;
+	// The same for the difference of the normals (the length of the difference, 0.3 is about 17 degrees), and the albedo.
+	const float g_normalSigma = 0.3f;
+	const float g_albedoSigma = 0.1f;
+	// And for the difference in depth, relative to the depth of the pixel and per pixel of distance, so that slanted surfaces are not
+	// broken up.
+	const float g_depthSigma = 0.02f;
+	// The depth used in the border, which is so far from all the pixels (also the background, which is stored as 1e30) that the border
+	// gets no weight.
+	const float g_borderDepth = -1e30f;
+	// The rows are handed out to the threads in bands of this many.
+	const int g_bandHeight = 16;
+
+	inline float getLuminance(const vec3 &c)
+	{
+		return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+	}
+
+	inline SimdFloat getLuminance(const SimdFloat c[3])
+	{
+		return simdAdd(simdAdd(simdMul(c[0], simdSet(0.2126f)), simdMul(c[1], simdSet(0.7152f))), simdMul(c[2], simdSet(0.0722f)));
+	}
+
+	inline double getSecondsSince(std::chrono::high_resolution_clock::time_point start)
+	{
+		return std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+	}
+}
+
+
+
+Denoiser::Denoiser()
+	: m_width(0)
+	, m_height(0)
+	, m_stride(0)
+	, m_timings()
+{
+}
+
+
+
+void Denoiser::denoise(const std::vector<vec3> &input, float inputScale, const GBuffer &gBuffer, std::vector<vec3> &output, ThreadPool &threadPool)
+{
+	resize(gBuffer.getWidth(), gBuffer.getHeight());
+	const int numBands = (m_height + g_bandHeight - 1) / g_bandHeight;
+
+	// 1. Copy the colour and G-buffer to the padded planes, g_simdWidth pixels at a time, and the last few of each row one by one.
+	// Filter the colours compressed to [0,1) (the Reinhard tone map), so that the odd very bright sample (e.g., a path that found the
+	// light through a mirror) is spread out as a slightly brighter spot rather than a blob. This darkens such spots a bit.
+	auto start = std::chrono::high_resolution_clock::now();
+	threadPool.parallelFor(numBands, [&](int band, int)
+	{
+		const SimdFloat scale = simdSet(inputScale);
+		const SimdFloat one = simdSet(1.0f);
+		const SimdFloat maxDepth = simdSet(1e30f);
+		for (int y = band * g_bandHeight; y < std::min(m_height, (band + 1) * g_bandHeight); ++y)
+		{
+			const size_t row = getIndex(0, y);
+			const int rowPixel = y * m_width;
+			int x = 0;
+			for (; x + g_simdWidth <= m_width; x += g_simdWidth)
+			{
+				const size_t i = row + x;
+				const int pixel = rowPixel + x;
+				SimdFloat colour[3];
+				simdLoadVec3(&input[pixel].x, colour[0], colour[1], colour[2]);
+				for (int c = 0; c < 3; ++c)
+				{
+					colour[c] = simdMax(simdMul(colour[c], scale), simdZero());
+				}
+				const SimdFloat compression = simdDiv(one, simdAdd(one, getLuminance(colour)));
+				for (int c = 0; c < 3; ++c)
+				{
+					colour[c] = simdMul(colour[c], compression);
+					simdStore(m_colour[0][c].data() + i, colour[c]);
+					simdStore(m_albedo[c].data() + i, simdLoad(gBuffer.getAlbedo(c) + pixel));
+					simdStore(m_normal[c].data() + i, simdLoad(gBuffer.getNormal(c) + pixel));
+				}
+				simdStore(m_brightness[0].data() + i, simdSqrt(getLuminance(colour)));
+				simdStore(m_depth.data() + i, simdMin(simdLoad(gBuffer.getDepth() + pixel), maxDepth));
+			}
+			for (; x < m_width; ++x)
+			{
+				const size_t i = row + x;
+				const int pixel = rowPixel + x;
+				const vec3 linear = max(input[pixel] * inputScale, vec3(0.0f));
+				const vec3 colour = linear / (1.0f + getLuminance(linear));
+				for (int c = 0; c < 3; ++c)
+				{
+					m_colour[0][c][i] = colour[c];
+					m_albedo[c][i] = gBuffer.getAlbedo(c)[pixel];
+					m_normal[c][i] = gBuffer.getNormal(c)[pixel];
+				}
+				m_brightness[0][i] = sqrtf(getLuminance(colour));
+				m_depth[i] = std::min(gBuffer.getDepth()[pixel], 1e30f);
+			}
+		}
+	});
+	m_timings.copyIn = getSecondsSince(start);
+
+	// 2. Filter, each iteration must be done before the next starts, since it reads the neighbouring bands.
+	for (int iteration = 0; iteration < s_numIterations; ++iteration)
+	{
+		start = std::chrono::high_resolution_clock::now();
+		threadPool.parallelFor(numBands, [&](int band, int)
+		{
+			filterRows(iteration, iteration & 1, band * g_bandHeight, std::min(m_height, (band + 1) * g_bandHeight));
+		});
+		m_timings.iterations[iteration] = getSecondsSince(start);
+	}
+
+	// 3. Copy the result back, undoing the compression.
+	start = std::chrono::high_resolution_clock::now();
+	const int result = s_numIterations & 1;
+	output.resize(size_t(m_width) * size_t(m_height));
+	threadPool.parallelFor(numBands, [&](int band, int)
+	{
+		const SimdFloat one = simdSet(1.0f);
+		const SimdFloat minDenominator = simdSet(1e-3f);
+		for (int y = band * g_bandHeight; y < std::min(m_height, (band + 1) * g_bandHeight); ++y)
+		{
+			const size_t row = getIndex(0, y);
+			const int rowPixel = y * m_width;
+			int x = 0;
+			for (; x + g_simdWidth <= m_width; x += g_simdWidth)
+			{
+				const size_t i = row + x;
+				SimdFloat colour[3];
+				for (int c = 0; c < 3; ++c)
+				{
+					colour[c] = simdLoad(m_colour[result][c].data() + i);
+				}
+				const SimdFloat expansion = simdDiv(one, simdMax(minDenominator, simdSub(one, getLuminance(colour))));
+				simdStoreVec3(&output[rowPixel + x].x, simdMul(colour[0], expansion), simdMul(colour[1], expansion), simdMul(colour[2], expansion));
+			}
+			for (; x < m_width; ++x)
+			{
+				const size_t i = row + x;
+				const vec3 colour = vec3(m_colour[result][0][i], m_colour[result][1][i], m_colour[result][2][i]);
+				output[rowPixel + x] = colour / std::max(1e-3f, 1.0f - getLuminance(colour));
+			}
+		}
+	});
+	m_timings.copyOut = getSecondsSince(start);
+}
+
+
+
+void Denoiser::resize(int width, int height)
+{
+	if (width == m_width && height == m_height)
+	{
+		return;
+	}
+	m_width = width;
+	m_height = height;
+	// 8 floats fits both SSE and AVX.
+	m_stride = (size_t(width + 2 * s_border) + 7) & ~size_t(7);
+	const size_t size = m_stride * size_t(height + 2 * s_border);
+	for (int c = 0; c < 3; ++c)
+	{
+		m_colour[0][c].assign(size, 0.0f);
+		m_colour[1][c].assign(size, 0.0f);
+		m_albedo[c].assign(size, 0.0f);
+		m_normal[c].assign(size, 0.0f);
+	}
+	m_brightness[0].assign(size, 0.0f);
+	m_brightness[1].assign(size, 0.0f);
+	m_depth.assign(size, g_borderDepth);
+}
+
+
+
+void Denoiser::filterRows(int iteration, int src, int y0, int y1)
+{
+	const int dst = 1 - src;
+	const int step = 1 << iteration;
+
+	// The 3x3 B-spline kernel (1/4, 1/2, 1/4 in each direction) with the taps 'step' pixels apart.
+	ptrdiff_t offsets[9];
+	SimdFloat kernel[9];
+	const float h[3] = { 0.25f, 0.5f, 0.25f };
+	for (int j = 0; j < 3; ++j)
+	{
+		for (int i = 0; i < 3; ++i)
+		{
+			offsets[j * 3 + i] = ptrdiff_t(j - 1) * step * ptrdiff_t(m_stride) + ptrdiff_t(i - 1) * step;
+			kernel[j * 3 + i] = simdSet(h[i] * h[j]);
+		}
+	}
+
+	// The differences are divided by the sigmas, which is done by multiplying with the inverse of their squares.
+	const float brightnessSigma = g_brightnessSigma / float(step);
+	const SimdFloat brightnessScale = simdSet(1.0f / (brightnessSigma * brightnessSigma));
+	const SimdFloat normalScale = simdSet(1.0f / (g_normalSigma * g_normalSigma));
+	const SimdFloat albedoScale = simdSet(1.0f / (g_albedoSigma * g_albedoSigma));
+	const bool compareAlbedo = iteration == 0;
+	const SimdFloat depthSigma = simdSet(g_depthSigma * float(step));
+	const SimdFloat maxExponent = simdSet(80.0f);
+	const SimdFloat one = simdSet(1.0f);
+
+	const float *colour[3] = { m_colour[src][0].data(), m_colour[src][1].data(), m_colour[src][2].data() };
+	const float *brightness = m_brightness[src].data();
+	const float *albedo[3] = { m_albedo[0].data(), m_albedo[1].data(), m_albedo[2].data() };
+	const float *normal[3] = { m_normal[0].data(), m_normal[1].data(), m_normal[2].data() };
+	const float *depth = m_depth.data();
+
+	for (int y = y0; y < y1; ++y)
+	{
+		// The last run of pixels may go into the border, which is harmless since the border has no weight.
+		for (int x = 0; x < m_width; x += g_simdWidth)
+		{
+			const size_t p = getIndex(x, y);
+			const SimdFloat pBrightness = simdLoad(brightness + p);
+			const SimdFloat pAlbedo[3] = { simdLoad(albedo[0] + p), simdLoad(albedo[1] + p), simdLoad(albedo[2] + p) };
+			const SimdFloat pNormal[3] = { simdLoad(normal[0] + p), simdLoad(normal[1] + p), simdLoad(normal[2] + p) };
+			const SimdFloat pDepth = simdLoad(depth + p);
+			const SimdFloat depthScale = simdDiv(one, simdMul(depthSigma, pDepth));
+
+			SimdFloat sum[3] = { simdZero(), simdZero(), simdZero() };
+			SimdFloat weightSum = simdZero();
+			for (int k = 0; k < 9; ++k)
+			{
+				const size_t q = p + offsets[k];
+				SimdFloat d = simdSub(simdLoad(brightness + q), pBrightness);
+				SimdFloat exponent = simdMul(simdMul(d, d), brightnessScale);
+
+				SimdFloat normalDistance = simdZero();
+				for (int c = 0; c < 3; ++c)
+				{
+					SimdFloat dn = simdSub(simdLoad(normal[c] + q), pNormal[c]);
+					normalDistance = simdAdd(normalDistance, simdMul(dn, dn));
+				}
+				exponent = simdAdd(exponent, simdMul(normalDistance, normalScale));
+				if (compareAlbedo)
+				{
+					SimdFloat albedoDistance = simdZero();
+					for (int c = 0; c < 3; ++c)
+					{
+						SimdFloat da = simdSub(simdLoad(albedo[c] + q), pAlbedo[c]);
+						albedoDistance = simdAdd(albedoDistance, simdMul(da, da));
+					}
+					exponent = simdAdd(exponent, simdMul(albedoDistance, albedoScale));
+				}
+				SimdFloat dz = simdMul(simdSub(simdLoad(depth + q), pDepth), depthScale);
+				exponent = simdAdd(exponent, simdMul(dz, dz));
+
+				// Note: the order of the arguments to min makes NaN go to the max, i.e., no weight.
+				const SimdFloat weight = simdMul(kernel[k], simdExpApprox(simdSub(simdZero(), simdMin(exponent, maxExponent))));
+				for (int c = 0; c < 3; ++c)
+				{
+					sum[c] = simdAdd(sum[c], simdMul(weight, simdLoad(colour[c] + q)));
+				}
+				weightSum = simdAdd(weightSum, weight);
+			}
+
+			// The centre tap always has weight, so the sum is never zero.
+			const SimdFloat invWeightSum = simdDiv(one, weightSum);
+			SimdFloat result[3];
+			for (int c = 0; c < 3; ++c)
+			{
+				result[c] = simdMul(sum[c], invWeightSum);
+				simdStore(m_colour[dst][c].data() + p, result[c]);
+			}
+			simdStore(m_brightness[dst].data() + p, simdSqrt(simdMax(getLuminance(result), simdZero())));
+		}
+	}
+}
@@ -0,0 +1,89 @@
+/****************************************************************************/
+/* Copyright (c) 2016, Ola Olsson */
+/****************************************************************************/
+#ifndef _Denoiser_h_
+#define _Denoiser_h_
+
+#include "GBuffer.h"
+#include "ThreadPool.h"
+
+#include <glm/glm.hpp>
+
+#include <vector>
+
+/**
+ * Removes the noise from images traced with few samples per pixel (e.g., path traced with 1-4 samples), using the edge-avoiding
+ * a-trous wavelet filter (Dammertz et al., "Edge-Avoiding A-Trous Wavelet Transform for fast Global Illumination Filtering").
+ *
+ * Each iteration blurs the image with a 3x3 kernel, whose taps are spread twice as far apart as in the last iteration (1, 2, 4, ...
+ * pixels, the holes of 'a trous'), so a few iterations cover a large area for the cost of 9 taps each. To keep the edges, each tap is
+ * weighted by how similar the neighbour is to the pixel, in albedo, normal and depth (from the G-buffer, which has no noise) and in
+ * brightness (which stops the blur where the light changes, e.g., at shadow edges, but is looser at first since the input is noisy).
+ * The albedo is only compared in the first iteration, after which the colours have stopped bleeding over the texture edges, and the
+ * brightness catches what is left.
+ *
+ * The filter works on planes of floats (see GBuffer) padded with a border where the weights are zero, so that SIMD can be used for all
+ * pixels without checking the edges of the image, and each iteration is spread over the threads in bands of rows. It is not real-time
+ * on a CPU: each iteration reads 9 taps of 9 planes for every pixel, which takes tens of ms per iteration at 1080p on one core, see
+ * 'getTimings'.
+ */
+class Denoiser
+{
+public:
+	enum
+	{
+		s_numIterations = 5,
+	};
+
+	/**
+	 * The time taken by each step of the last call to 'denoise', in seconds.
+	 */
+	struct Timings
+	{
+		// Copying the colour and G-buffer into the padded planes.
+		double copyIn;
+		double iterations[s_numIterations];
+		// Copying the result back.
+		double copyOut;
+	};
+
+	Denoiser();
+
+	/**
+	 * Filters 'input' (scaled by 'inputScale', e.g., to average a sum of samples) into 'output', both are linear colours of the size of the
+	 * G-buffer, and may be the same.
+	 */
+	void denoise(const std::vector<glm::vec3> &input, float inputScale, const GBuffer &gBuffer, std::vector<glm::vec3> &output, ThreadPool &threadPool);
+
+	const Timings &getTimings() const { return m_timings; }
+
+protected:
+	// Sets up the planes for the size, and fills the borders.
+	void resize(int width, int height);
+	// Runs one iteration for the rows [y0, y1), reading from set 'src' and writing to the other.
+	void filterRows(int iteration, int src, int y0, int y1);
+
+	inline size_t getIndex(int x, int y) const { return size_t(y + s_border) * m_stride + size_t(x + s_border); }
+
+	enum
+	{
+		// Enough for the taps of the last iteration, which are 2^(s_numIterations - 1) pixels away.
+		s_border = 1 << (s_numIterations - 1),
+	};
+
+	int m_width;
+	int m_height;
+	// Floats per row, including the borders, rounded up to a whole number of SIMD registers (for either width).
+	size_t m_stride;
+	// The colour being filtered, in two sets that the iterations read from and write to in turn, each with the channels and the
+	// brightness used to compare the colours.
+	std::vector<float> m_colour[2][3];
+	std::vector<float> m_brightness[2];
+	// Copies of the G-buffer planes, with the borders.
+	std::vector<float> m_albedo[3];
+	std::vector<float> m_normal[3];
+	std::vector<float> m_depth;
+	Timings m_timings;
+};
+
+#endif // _Denoiser_h_
@@ -0,0 +1,110 @@
+/****************************************************************************/
+/* Copyright (c) 2016, Ola Olsson */
+/****************************************************************************/
+#include "DynamicBvh.h"
+#include "ThreadPool.h"
+
+
+DynamicBvh::DynamicBvh(float rebuildThreshold, bool backgroundRebuild)
+	: m_rebuildThreshold(rebuildThreshold)
+	, m_backgroundRebuild(backgroundRebuild)
+	, m_maxLeafSize(Bvh::s_maxLeafSize)
+	, m_leafGroupSize(1)
+	, m_nodeFormat(Bvh::NF_Float)
+	, m_numRebuilds(0)
+	, m_rebuildDone(false)
+{
+}
+
+
+
+DynamicBvh::~DynamicBvh()
+{
+	joinRebuild();
+}
+
+
+
+void DynamicBvh::build(const std::vector<Aabb> &primitiveAabbs, int maxLeafSize, int leafGroupSize, Bvh::NodeFormat nodeFormat)
+{
+	joinRebuild();
+	m_rebuiltBvh.clear();
+	m_maxLeafSize = maxLeafSize;
+	m_leafGroupSize = leafGroupSize;
+	m_nodeFormat = nodeFormat;
+	m_bvh.build(primitiveAabbs, maxLeafSize, leafGroupSize, nodeFormat);
+}
+
+
+
+bool DynamicBvh::update(const std::vector<Aabb> &primitiveAabbs, ThreadPool *threadPool)
+{
+	if (m_bvh.getNodeFormat() == Bvh::NF_Quantized)
+	{
+		m_bvh.build(primitiveAabbs, m_maxLeafSize, m_leafGroupSize, m_nodeFormat);
+		++m_numRebuilds;
+		return true;
+	}
+
+	// 1. Swap in the rebuilt BVH if it is done, it was built for the bounds some frames ago, so it is refitted like the old one.
+	bool replaced = false;
+	if (m_rebuildDone)
+	{
+		joinRebuild();
+		std::swap(m_bvh, m_rebuiltBvh);
+		m_rebuiltBvh.clear();
+		++m_numRebuilds;
+		replaced = true;
+	}
+
+	if (threadPool)
+	{
+		m_bvh.refit(primitiveAabbs, threadPool->getNumThreads(), [threadPool](int numTasks, const std::function<void(int, int)> &taskFn)
+		{
+			threadPool->parallelFor(numTasks, taskFn);
+		});
+	}
+	else
+	{
+		m_bvh.refit(primitiveAabbs);
+	}
+
+	// 2. Start a rebuild if the tree has degraded too much, unless one is already running.
+	if (m_rebuildThreshold > 0.0f && getSahCostRatio() > m_rebuildThreshold && !isRebuilding())
+	{
+		if (!m_backgroundRebuild)
+		{
+			m_bvh.build(primitiveAabbs, m_maxLeafSize, m_leafGroupSize, m_nodeFormat);
+			++m_numRebuilds;
+			return true;
+		}
+		m_rebuildAabbs = primitiveAabbs;
+		m_rebuildDone = false;
+		m_rebuildThread = std::thread([this]()
+		{
+			m_rebuiltBvh.build(m_rebuildAabbs, m_maxLeafSize, m_leafGroupSize, m_nodeFormat);
+			m_rebuildDone = true;
+		});
+	}
+	return replaced;
+}
+
+
+
+void DynamicBvh::clear()
+{
+	joinRebuild();
+	m_rebuiltBvh.clear();
+	m_bvh.clear();
+}
+
+
+
+void DynamicBvh::joinRebuild()
+{
+	if (m_rebuildThread.joinable())
+	{
+		m_rebuildThread.join();
+	}
+	m_rebuildDone = false;
+}
@@ -0,0 +1,75 @@
+/****************************************************************************/
+/* Copyright (c) 2016, Ola Olsson */
+/****************************************************************************/
+#ifndef _DynamicBvh_h_
+#define _DynamicBvh_h_
+
+#include "Bvh.h"
+
+#include <vector>
+#include <thread>
+#include <atomic>
+
+class ThreadPool;
+
+/**
+ * A BVH over primitives that move, e.g., animated spheres. Building a BVH every frame is too slow for thousands of primitives, so
+ * 'update' refits the BVH to the new primitive bounds instead (see Bvh::refit), which keeps the tree and only grows or shrinks the boxes.
+ * As the primitives move away from where they were when the tree was built, the boxes grow and overlap more, which is tracked using the
+ * SAH cost. When the cost has grown by more than the rebuild threshold (e.g., 1.5 for 50%), a new BVH is built on a background thread,
+ * from a copy of the primitive bounds, while the old one keeps being refitted and used. The new BVH replaces the old one in the first
+ * 'update' after it is done, and is then refitted to the bounds at that time.
+ */
+class DynamicBvh
+{
+public:
+	/**
+	 * A threshold of 0 (or less) never rebuilds, and without 'backgroundRebuild' the rebuild is done directly in 'update'.
+	 */
+	explicit DynamicBvh(float rebuildThreshold = 1.5f, bool backgroundRebuild = true);
+	~DynamicBvh();
+
+	/**
+	 * Builds the BVH at once, as Bvh::build, and waits for (and throws away) any rebuild in progress.
+	 */
+	void build(const std::vector<Aabb> &primitiveAabbs, int maxLeafSize = Bvh::s_maxLeafSize, int leafGroupSize = 1, Bvh::NodeFormat nodeFormat = Bvh::NF_Float);
+
+	/**
+	 * Refits the BVH to the primitive aabbs (in the same order as given to 'build'), using the thread pool if given, and starts a
+	 * rebuild if the quality has degraded too much. The quantized format cannot be refitted, so it is rebuilt every time instead.
+	 * Returns true if the BVH was replaced by a new one, which means that the order of the primitive indices has changed.
+	 */
+	bool update(const std::vector<Aabb> &primitiveAabbs, ThreadPool *threadPool = nullptr);
+
+	void clear();
+
+	const Bvh &getBvh() const { return m_bvh; }
+
+	/**
+	 * The SAH cost relative to that of the BVH when it was built, 1 means it is as good as new.
+	 */
+	float getSahCostRatio() const { return m_bvh.getBuildSahCost() > 0.0f ? m_bvh.getSahCost() / m_bvh.getBuildSahCost() : 1.0f; }
+
+	int getNumRebuilds() const { return m_numRebuilds; }
+	bool isRebuilding() const { return m_rebuildThread.joinable(); }
+
+protected:
+	// Waits for the rebuild thread, if running, the result is left in 'm_rebuiltBvh'.
+	void joinRebuild();
+
+	float m_rebuildThreshold;
+	bool m_backgroundRebuild;
+	int m_maxLeafSize;
+	int m_leafGroupSize;
+	Bvh::NodeFormat m_nodeFormat;
+	int m_numRebuilds;
+
+	Bvh m_bvh;
+	// Only touched by the rebuild thread while it is running, i.e., until 'm_rebuildDone' is set.
+	Bvh m_rebuiltBvh;
+	std::vector<Aabb> m_rebuildAabbs;
+	std::thread m_rebuildThread;
+	std::atomic<bool> m_rebuildDone;
+};
+
+#endif // _DynamicBvh_h_
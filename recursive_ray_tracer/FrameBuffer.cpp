@@ -0,0 +1,234 @@
+/****************************************************************************/
+/* Copyright (c) 2016, Ola Olsson */
+/****************************************************************************/
+#include "FrameBuffer.h"
+#include "Simd.h"
+
+#include <string.h>
+#include <stdio.h>
+
+
+FrameBuffer::FrameBuffer(Format format, bool encodeSrgb)
+	: m_format(format)
+	, m_width(0)
+	, m_height(0)
+	, m_glWidth(0)
+	, m_glHeight(0)
+	, m_texture(0)
+	, m_currentPixelBuffer(0)
+{
+	m_pixelBuffers[0] = 0;
+	m_pixelBuffers[1] = 0;
+
+	// Uses the same 2.2 gamma curve as the other programs, rather than the exact sRGB curve.
+	const float maxValue = m_format == F_Rgb10A2 ? 1023.0f : 255.0f;
+	for (int i = 0; i < s_encodeTableSize; ++i)
+	{
+		float sqrtLinear = float(i) / float(s_encodeTableSize - 1);
+		float linear = sqrtLinear * sqrtLinear;
+		m_encodeTable[i] = uint16_t((encodeSrgb ? powf(linear, 1.0f / 2.2f) : linear) * maxValue + 0.5f);
+	}
+}
+
+
+
+void FrameBuffer::resize(int width, int height)
+{
+	if (width != m_width || height != m_height)
+	{
+		m_width = width;
+		m_height = height;
+		m_pixels.resize(width * height);
+		m_packedPixels.resize(width * height);
+	}
+}
+
+
+
+void FrameBuffer::pack(int x0, int y0, int x1, int y1)
+{
+	pack(m_pixels, x0, y0, x1, y1);
+}
+
+
+
+void FrameBuffer::pack(const std::vector<glm::vec3> &pixels, int x0, int y0, int x1, int y1)
+{
+	// The table indices are calculated using SIMD, treating a run of pixels as an array of floats (r,g,b,r,g,b,...), which is why the
+	// run length is a multiple of the SIMD width. The pixels that do not fill a whole run are done one by one.
+	const int runLength = g_simdWidth * 4;
+	int indices[runLength * 3];
+	const SimdFloat scale = simdSet(float(s_encodeTableSize - 1));
+	const SimdFloat half = simdSet(0.5f);
+	const int shift = m_format == F_Rgb10A2 ? 10 : 8;
+	const uint32_t alpha = m_format == F_Rgb10A2 ? (3U << 30) : (255U << 24);
+
+	for (int y = y0; y < y1; ++y)
+	{
+		const glm::vec3 *src = &pixels[y * m_width];
+		uint32_t *dst = &m_packedPixels[y * m_width];
+		int x = x0;
+		for (; x + runLength <= x1; x += runLength)
+		{
+			const float *values = &src[x].x;
+			for (int i = 0; i < runLength * 3; i += g_simdWidth)
+			{
+				// Note: the order of the arguments to max makes NaN go to 0, as in 'encode'.
+				SimdFloat v = simdMin(simdSet(1.0f), simdMax(simdLoad(values + i), simdZero()));
+				simdStoreInt(indices + i, simdAdd(simdMul(simdSqrt(v), scale), half));
+			}
+			for (int i = 0; i < runLength; ++i)
+			{
+				dst[x + i] = m_encodeTable[indices[i * 3]] | (m_encodeTable[indices[i * 3 + 1]] << shift) | (m_encodeTable[indices[i * 3 + 2]] << (shift * 2)) | alpha;
+			}
+		}
+		for (; x < x1; ++x)
+		{
+			dst[x] = packColour(src[x]);
+		}
+	}
+}
+
+
+
+void FrameBuffer::present()
+{
+	if (m_width == 0 || m_height == 0)
+	{
+		return;
+	}
+	if (m_glWidth != m_width || m_glHeight != m_height)
+	{
+		deleteGlObjects();
+		createGlObjects();
+	}
+	const GLenum type = m_format == F_Rgb10A2 ? GL_UNSIGNED_INT_2_10_10_10_REV : GL_UNSIGNED_INT_8_8_8_8_REV;
+	const size_t size = m_packedPixels.size() * sizeof(uint32_t);
+
+	// 1. Copy the pixels to the PBO not used last frame, which may still be being copied to the texture. Invalidating the buffer
+	//    tells the driver that the old contents is not needed, so it does not have to wait.
+	m_currentPixelBuffer = 1 - m_currentPixelBuffer;
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, m_pixelBuffers[m_currentPixelBuffer]);
+	if (void *dst = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT))
+	{
+		memcpy(dst, &m_packedPixels[0], size);
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+	}
+
+	// 2. With a PBO bound, the last argument is an offset into the buffer, and the call returns without waiting for the copy.
+	glBindTexture(GL_TEXTURE_2D, m_texture);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_width, m_height, GL_RGBA, type, 0);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	// 3. Draw a quad covering the viewport with the texture, using the fixed function pipeline, since there is nothing else to draw.
+	glViewport(0, 0, m_width, m_height);
+	glMatrixMode(GL_PROJECTION);
+	glLoadIdentity();
+	glMatrixMode(GL_MODELVIEW);
+	glLoadIdentity();
+	glDisable(GL_DEPTH_TEST);
+	glEnable(GL_TEXTURE_2D);
+	glBegin(GL_QUADS);
+	glTexCoord2f(0.0f, 0.0f); glVertex2f(-1.0f, -1.0f);
+	glTexCoord2f(1.0f, 0.0f); glVertex2f(1.0f, -1.0f);
+	glTexCoord2f(1.0f, 1.0f); glVertex2f(1.0f, 1.0f);
+	glTexCoord2f(0.0f, 1.0f); glVertex2f(-1.0f, 1.0f);
+	glEnd();
+	glDisable(GL_TEXTURE_2D);
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+
+
+bool FrameBuffer::savePpm(const char *fileName) const
+{
+	FILE *f = fopen(fileName, "wb");
+	if (!f)
+	{
+		return false;
+	}
+	fprintf(f, "P6\n%d %d\n255\n", m_width, m_height);
+	// PPM is stored top row first, while the frame buffer starts at the bottom.
+	std::vector<uint8_t> row(m_width * 3);
+	const int shift = m_format == F_Rgb10A2 ? 10 : 8;
+	const int dropBits = m_format == F_Rgb10A2 ? 2 : 0;
+	for (int y = m_height - 1; y >= 0; --y)
+	{
+		for (int x = 0; x < m_width; ++x)
+		{
+			const uint32_t p = m_packedPixels[y * m_width + x];
+			for (int c = 0; c < 3; ++c)
+			{
+				row[x * 3 + c] = uint8_t(((p >> (shift * c)) & ((1U << shift) - 1)) >> dropBits);
+			}
+		}
+		fwrite(row.data(), 1, row.size(), f);
+	}
+	bool ok = ferror(f) == 0;
+	return fclose(f) == 0 && ok;
+}
+
+
+
+bool FrameBuffer::savePfm(const char *fileName) const
+{
+	FILE *f = fopen(fileName, "wb");
+	if (!f)
+	{
+		return false;
+	}
+	// The negative scale means little endian, and PFM is stored bottom row first, just like the frame buffer.
+	fprintf(f, "PF\n%d %d\n-1.0\n", m_width, m_height);
+	if (!m_pixels.empty())
+	{
+		fwrite(&m_pixels[0], sizeof(glm::vec3), m_pixels.size(), f);
+	}
+	bool ok = ferror(f) == 0;
+	return fclose(f) == 0 && ok;
+}
+
+
+
+void FrameBuffer::createGlObjects()
+{
+	const size_t size = m_packedPixels.size() * sizeof(uint32_t);
+
+	glGenTextures(1, &m_texture);
+	glBindTexture(GL_TEXTURE_2D, m_texture);
+	// The texture is drawn at the size of the window, one texel per pixel, so no filtering is needed.
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexImage2D(GL_TEXTURE_2D, 0, m_format == F_Rgb10A2 ? GL_RGB10_A2 : GL_RGBA8, m_width, m_height, 0, GL_RGBA,
+		m_format == F_Rgb10A2 ? GL_UNSIGNED_INT_2_10_10_10_REV : GL_UNSIGNED_INT_8_8_8_8_REV, nullptr);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	glGenBuffers(2, m_pixelBuffers);
+	for (GLuint pixelBuffer : m_pixelBuffers)
+	{
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pixelBuffer);
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, size, nullptr, GL_STREAM_DRAW);
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	m_glWidth = m_width;
+	m_glHeight = m_height;
+}
+
+
+
+void FrameBuffer::deleteGlObjects()
+{
+	if (m_texture != 0)
+	{
+		glDeleteTextures(1, &m_texture);
+		glDeleteBuffers(2, m_pixelBuffers);
+		m_texture = 0;
+		m_pixelBuffers[0] = 0;
+		m_pixelBuffers[1] = 0;
+	}
+	m_glWidth = 0;
+	m_glHeight = 0;
+}
@@ -0,0 +1,141 @@
+/****************************************************************************/
+/* Copyright (c) 2016, Ola Olsson */
+/****************************************************************************/
+#ifndef _FrameBuffer_h_
+#define _FrameBuffer_h_
+
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <algorithm>
+#include <math.h>
+#include <stdint.h>
+
+/**
+ * The image produced by a ray tracer, and the means to show it in the window. The frame buffer is kept between frames, and the memory
+ * is only reallocated when the size changes, so there is no heap traffic per frame.
+ *
+ * The ray tracer writes linear colours (as floats) to 'getPixels', and these are then converted to sRGB and packed into 32 bits per pixel,
+ * either 8 bits per channel (F_Rgba8) or 10 bits per channel (F_Rgb10A2, less banding in dark gradients), using 'pack'. This should be
+ * done as soon as a part of the image is done (e.g., a tile), while the pixels are still in the cache. The conversion to sRGB can be
+ * turned off, for programs that do not care about colour spaces (yet).
+ *
+ * 'present' uploads the packed pixels to a texture and draws it over the window. This is much faster than using 'glDrawPixels' with
+ * floats, which is converted by the driver on the CPU, one pixel at a time. The upload goes through a pixel buffer object (PBO), which
+ * lets the driver copy the data to the GPU asynchronously, and two PBOs are used in turn so that the next frame does not have to wait
+ * for the copy to finish before writing to the buffer.
+ */
+class FrameBuffer
+{
+public:
+	enum Format
+	{
+		F_Rgba8,
+		F_Rgb10A2,
+	};
+
+	/**
+	 * Note: there is no destructor that deletes the GL objects, since the GL context is usually gone by the time a global frame buffer
+	 * is destroyed, and the objects are deleted with the context anyway.
+	 */
+	explicit FrameBuffer(Format format = F_Rgba8, bool encodeSrgb = true);
+
+	/**
+	 * Sets the size of the image, the contents is undefined after a change of size.
+	 */
+	void resize(int width, int height);
+
+	int getWidth() const { return m_width; }
+	int getHeight() const { return m_height; }
+	Format getFormat() const { return m_format; }
+
+	/**
+	 * The linear colour of the pixels, row by row, starting at the bottom left (as expected by OpenGL).
+	 */
+	std::vector<glm::vec3> &getPixels() { return m_pixels; }
+	const std::vector<glm::vec3> &getPixels() const { return m_pixels; }
+
+	/**
+	 * The packed sRGB colour of the pixels, which are shown by 'present'.
+	 */
+	std::vector<uint32_t> &getPackedPixels() { return m_packedPixels; }
+
+	/**
+	 * Converts the linear colours in the rectangle from (x0,y0) up to, but not including, (x1,y1) to packed sRGB. Different
+	 * rectangles may be packed by different threads at the same time.
+	 */
+	void pack(int x0, int y0, int x1, int y1);
+
+	/**
+	 * The same, but converts the colours of 'pixels' (of the same size as the frame buffer) instead of the linear pixels of the frame
+	 * buffer, e.g., a filtered copy of the image.
+	 */
+	void pack(const std::vector<glm::vec3> &pixels, int x0, int y0, int x1, int y1);
+
+	/**
+	 * Converts a linear colour to sRGB (if enabled) in the packed format, colours outside [0,1] are clamped.
+	 */
+	inline uint32_t packColour(const glm::vec3 &linearColour) const
+	{
+		if (m_format == F_Rgb10A2)
+		{
+			return encode(linearColour.r) | (encode(linearColour.g) << 10) | (encode(linearColour.b) << 20) | (3U << 30);
+		}
+		return encode(linearColour.r) | (encode(linearColour.g) << 8) | (encode(linearColour.b) << 16) | (255U << 24);
+	}
+
+	/**
+	 * Draws the packed pixels over the whole viewport, must be called with the GL context current (and GLEW initialized). The GL objects
+	 * are created on first use, so the frame buffer can be used without a GL context as long as 'present' is not called.
+	 */
+	void present();
+
+	/**
+	 * Saves the packed pixels as a binary PPM image (8 bits per channel), which most image viewers and tools can read. Returns false
+	 * if the file could not be written.
+	 */
+	bool savePpm(const char *fileName) const;
+
+	/**
+	 * Saves the linear pixels as a PFM image (32-bit float per channel), e.g., for comparing images or further processing. Returns false
+	 * if the file could not be written.
+	 */
+	bool savePfm(const char *fileName) const;
+
+protected:
+	enum
+	{
+		// The table used to convert to sRGB is indexed by the square root of the linear value, since this is roughly proportional to the
+		// sRGB value, which makes the steps between the entries about even in the output, 4096 entries is enough for 10 bits.
+		s_encodeTableSize = 4096,
+	};
+
+	// Converts one channel to an 8 or 10 bit integer.
+	inline uint32_t encode(float linearValue) const
+	{
+		// Note: the order of the arguments to max makes NaN go to 0.
+		float v = std::min(1.0f, std::max(0.0f, linearValue));
+		return m_encodeTable[int(sqrtf(v) * float(s_encodeTableSize - 1) + 0.5f)];
+	}
+
+	void createGlObjects();
+	void deleteGlObjects();
+
+	Format m_format;
+	int m_width;
+	int m_height;
+	std::vector<glm::vec3> m_pixels;
+	std::vector<uint32_t> m_packedPixels;
+	uint16_t m_encodeTable[s_encodeTableSize];
+
+	// The GL objects, the texture and buffers are (re-)allocated when the size changes.
+	int m_glWidth;
+	int m_glHeight;
+	GLuint m_texture;
+	GLuint m_pixelBuffers[2];
+	int m_currentPixelBuffer;
+};
+
+#endif // _FrameBuffer_h_
@@ -0,0 +1,91 @@
+/****************************************************************************/
+/* Copyright (c) 2016, Ola Olsson */
+/****************************************************************************/
+#ifndef _GBuffer_h_
+#define _GBuffer_h_
+
+#include "Object.h"
+
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <stdint.h>
+
+/**
+ * What the camera rays hit first, for each pixel: the diffuse colour (albedo), normal and distance, and an id of the surface. These are
+ * stored from the hit info while tracing the image (see 'renderTile' in main.cpp), and used to find the edges in the image, e.g., by the
+ * Denoiser. Each value is kept in a plane of its own (i.e., all the red albedos, then all the green, and so on), so that the pixels of a
+ * row can be loaded straight into SIMD registers. Different pixels may be stored by different threads at the same time.
+ */
+class GBuffer
+{
+public:
+	GBuffer() : m_width(0), m_height(0) { }
+
+	/**
+	 * Sets the size of the buffer, the contents is undefined after a change of size.
+	 */
+	void resize(int width, int height)
+	{
+		m_width = width;
+		m_height = height;
+		const size_t size = size_t(width) * size_t(height);
+		for (int c = 0; c < 3; ++c)
+		{
+			m_albedo[c].resize(size);
+			m_normal[c].resize(size);
+		}
+		m_depth.resize(size);
+		m_surfaceIds.resize(size);
+	}
+
+	/**
+	 * Stores the hit for the pixel, a miss is stored with zero albedo and normal, and the miss time as the depth.
+	 */
+	inline void store(int pixel, const HitInfo &hit)
+	{
+		const bool valid = hit.valid();
+		const glm::vec3 albedo = valid ? hit.material->diffuseReflectance : glm::vec3(0.0f);
+		const glm::vec3 normal = valid ? hit.normal : glm::vec3(0.0f);
+		for (int c = 0; c < 3; ++c)
+		{
+			m_albedo[c][pixel] = albedo[c];
+			m_normal[c][pixel] = normal[c];
+		}
+		m_depth[pixel] = valid ? hit.time : HitInfo::s_missTime;
+		m_surfaceIds[pixel] = getSurfaceId(hit);
+	}
+
+	/**
+	 * Returns a number that identifies the surface hit, i.e., the object and material, or 0 for a miss. The spheres in a SphereSet are
+	 * one object, so spheres with the same material get the same id.
+	 */
+	static inline uint32_t getSurfaceId(const HitInfo &hit)
+	{
+		if (!hit.valid())
+		{
+			return 0;
+		}
+		uint64_t h = uint64_t(uintptr_t(hit.object)) * 0x9E3779B97F4A7C15ULL ^ uint64_t(uintptr_t(hit.material));
+		return uint32_t(h ^ (h >> 32)) | 1U;
+	}
+
+	int getWidth() const { return m_width; }
+	int getHeight() const { return m_height; }
+
+	// The planes, row by row like the frame buffer, 'channel' is 0, 1 or 2 for x/r, y/g and z/b.
+	const float *getAlbedo(int channel) const { return m_albedo[channel].data(); }
+	const float *getNormal(int channel) const { return m_normal[channel].data(); }
+	const float *getDepth() const { return m_depth.data(); }
+	const uint32_t *getSurfaceIds() const { return m_surfaceIds.data(); }
+
+protected:
+	int m_width;
+	int m_height;
+	std::vector<float> m_albedo[3];
+	std::vector<float> m_normal[3];
+	std::vector<float> m_depth;
+	std::vector<uint32_t> m_surfaceIds;
+};
+
+#endif // _GBuffer_h_
@@ -0,0 +1,131 @@
+/****************************************************************************/
+/* Copyright (c) 2016, Ola Olsson */
+/****************************************************************************/
+#include "Instance.h"
+
+using glm::vec3;
+using glm::vec4;
+using glm::mat3;
+
+
+Instance::Instance(Object *object, const glm::mat4 &transform)
+	: m_object(object)
+	, m_transform(transform)
+	, m_invTransform(glm::inverse(transform))
+{
+	m_normalTransform = glm::transpose(mat3(m_invTransform));
+
+	// The box around the transformed corners of the object box, which is a bit loose when rotated, but that is what the BVH needs.
+	const Aabb objectAabb = object->getAabb();
+	m_aabb = make_inverse_extreme_aabb();
+	for (int i = 0; i < 8; ++i)
+	{
+		vec3 corner((i & 1) ? objectAabb.max.x : objectAabb.min.x, (i & 2) ? objectAabb.max.y : objectAabb.min.y, (i & 4) ? objectAabb.max.z : objectAabb.min.z);
+		m_aabb = combine(m_aabb, vec3(m_transform * vec4(corner, 1.0f)));
+	}
+}
+
+
+
+HitInfo Instance::intersect(const Ray &ray)
+{
+	float scale = 1.0f;
+	HitInfo hit = m_object->intersect(toObjectSpace(ray, scale));
+	if (hit.valid())
+	{
+		toWorldSpace(hit, scale);
+	}
+	return hit;
+}
+
+
+
+bool Instance::occludes(const Ray &ray, float maxDistance)
+{
+	float scale = 1.0f;
+	Ray objectRay = toObjectSpace(ray, scale);
+	return m_object->occludes(objectRay, maxDistance * scale);
+}
+
+
+
+bool Instance::findOccluder(const Ray &ray, float maxDistance, uint32_t &primitive)
+{
+	float scale = 1.0f;
+	Ray objectRay = toObjectSpace(ray, scale);
+	return m_object->findOccluder(objectRay, maxDistance * scale, primitive);
+}
+
+
+
+bool Instance::occludesPrimitive(const Ray &ray, float maxDistance, uint32_t primitive)
+{
+	float scale = 1.0f;
+	Ray objectRay = toObjectSpace(ray, scale);
+	return m_object->occludesPrimitive(objectRay, maxDistance * scale, primitive);
+}
+
+
+
+void Instance::intersectPacket(RayPacket &packet, PacketMask activeMask, HitInfo *hits)
+{
+	// 1. Transform the whole packet to the space of the object, so the object can use its own packet traversal. The inactive rays are
+	//    transformed too, since they are still loaded by the SIMD code. The frustum planes go through the transformed origin, and the
+	//    plane normals transform with the transpose (since the rays are transformed by the inverse).
+	RayPacket objectPacket;
+	float scales[RayPacket::s_size];
+	for (int i = 0; i < RayPacket::s_size; ++i)
+	{
+		Ray objectRay = toObjectSpace(makeRay(packet.getOrigin(i), packet.getDirection(i)), scales[i]);
+		objectPacket.setRay(i, objectRay.origin, objectRay.direction, packet.tMax[i] * scales[i]);
+	}
+	if (packet.hasFrustum)
+	{
+		const mat3 planeTransform = glm::transpose(mat3(m_transform));
+		objectPacket.hasFrustum = true;
+		objectPacket.frustumOrigin = vec3(m_invTransform * vec4(packet.frustumOrigin, 1.0f));
+		for (int i = 0; i < 4; ++i)
+		{
+			objectPacket.frustumNormals[i] = planeTransform * packet.frustumNormals[i];
+		}
+	}
+
+	// 2. Trace, and copy back the hits that are still the closest after scaling the times back.
+	HitInfo objectHits[RayPacket::s_size];
+	m_object->intersectPacket(objectPacket, activeMask, objectHits);
+	for (int i = 0; i < RayPacket::s_size; ++i)
+	{
+		if (((activeMask >> i) & 1) && objectHits[i].valid() && objectHits[i].time / scales[i] < packet.tMax[i])
+		{
+			hits[i] = objectHits[i];
+			toWorldSpace(hits[i], scales[i]);
+			packet.tMax[i] = hits[i].time;
+		}
+	}
+}
+
+
+
+Aabb Instance::getAabb() const
+{
+	return m_aabb;
+}
+
+
+
+Ray Instance::toObjectSpace(const Ray &ray, float &scale) const
+{
+	vec3 direction = mat3(m_invTransform) * ray.direction;
+	scale = length(direction);
+	return makeRay(vec3(m_invTransform * vec4(ray.origin, 1.0f)), direction / scale);
+}
+
+
+
+void Instance::toWorldSpace(HitInfo &hit, float scale)
+{
+	hit.time /= scale;
+	hit.position = vec3(m_transform * vec4(hit.position, 1.0f));
+	hit.normal = normalize(m_normalTransform * hit.normal);
+	hit.object = this;
+}
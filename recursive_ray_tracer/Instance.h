@@ -0,0 +1,57 @@
+/****************************************************************************/
+/* Copyright (c) 2016, Ola Olsson */
+/****************************************************************************/
+#ifndef _Instance_h_
+#define _Instance_h_
+
+#include "Object.h"
+
+#include <glm/glm.hpp>
+
+/**
+ * A transformed copy of another object, e.g., one of many columns or plants placed around a scene, which all share the same
+ * TriangleMesh and its BVH. The instance only stores the transform, so the memory used does not depend on the size of the object.
+ * Together with the object BVH (over all the objects, including the instances) this makes a two-level acceleration structure: the
+ * top level BVH finds the instances that the ray may hit, and the ray is then transformed into the space of the shared object and
+ * traced through its BVH (the bottom level).
+ *
+ * The shared object is not owned by the instance, and must not change (or be deleted) while it is used, since the box of the instance
+ * is calculated when it is created.
+ */
+class Instance : public Object
+{
+public:
+	/**
+	 * 'transform' takes the object from its own space to the world, it can be any invertible affine transform, e.g., rotation,
+	 * scaling (also non-uniform) and translation.
+	 */
+	Instance(Object *object, const glm::mat4 &transform);
+
+	virtual HitInfo intersect(const Ray &ray) override;
+	virtual bool occludes(const Ray &ray, float maxDistance) override;
+	virtual bool findOccluder(const Ray &ray, float maxDistance, uint32_t &primitive) override;
+	virtual bool occludesPrimitive(const Ray &ray, float maxDistance, uint32_t primitive) override;
+	virtual void intersectPacket(RayPacket &packet, PacketMask activeMask, HitInfo *hits) override;
+	virtual Aabb getAabb() const override;
+
+	Object *getObject() const { return m_object; }
+	const glm::mat4 &getTransform() const { return m_transform; }
+
+protected:
+	/**
+	 * Returns the ray in the space of the object. The direction is normalized there, since not all objects handle other lengths (e.g.,
+	 * Sphere in main.cpp), so a time along the world ray is 'scale' times that along the object space ray.
+	 */
+	Ray toObjectSpace(const Ray &ray, float &scale) const;
+	// Transforms a hit found with the object space ray back to the world.
+	void toWorldSpace(HitInfo &hit, float scale);
+
+	Object *m_object;
+	glm::mat4 m_transform;
+	glm::mat4 m_invTransform;
+	// The inverse transpose, which keeps the normals perpendicular to the surface also with non-uniform scaling.
+	glm::mat3 m_normalTransform;
+	Aabb m_aabb;
+};
+
+#endif // _Instance_h_
@@ -0,0 +1,153 @@
+/****************************************************************************/
+/* Copyright (c) 2016, Ola Olsson */
+/****************************************************************************/
+#ifndef _Object_h_
+#define _Object_h_
+
+#include "../rasterizer_with_obj_loader/Aabb.h"
+#include "RayPacket.h"
+
+#include <glm/glm.hpp>
+
+#include <limits>
+
+// Forward declaraion so we can use the name 
+class Object;
+
+/**
+ * Structure representing a parametric ray with an origin and a direction.
+ */
+struct Ray
+{
+	glm::vec3 origin;
+	glm::vec3 direction;
+};
+
+/**
+ * Helper to make a ray.
+ */
+inline Ray makeRay(const glm::vec3 &origin, const glm::vec3 &direction)
+{
+	Ray r;
+	r.origin = origin;
+	r.direction = direction;
+	return r;
+}
+
+/**
+ * The parameters used by 'shade' to calculate the light reflected from a surface.
+ * This is sensibly replaced with a more comprehensive material class, or some such that takes care of the shading calculation!
+ */
+struct Material
+{
+	glm::vec3 diffuseReflectance; // How strongis diffuse reflectance, RGB spectral value in range 0-1
+	float shininess; // How shiny is the object, determines the size of the specular highlight, larger value gives smaller spot
+	glm::vec3 baseSpecularReflectance; // This is the R0 value used in the fresnel calculation, represents the reflectance of an object when viewed at 90 degrees
+	float reflectivity; // Hacky parameter to control mirror reflection strength, _should_ be implied by the shininess, i.e., a low shininess should imply low mirror reflection... not clear how
+	                    // this is usually well defined in properly physically based models.
+};
+
+/**
+ * Structure information about a hit point. By default initialized to represent not having hit anything.
+ * We chose to repreesnt this using the maximum number floats can representation.
+ * This struct could be extended with more information about the hit point, for example texture coordinates. Since an object might have
+ * several materials (e.g., a triangle mesh) the material is stored in the hit info rather than looked up through the object.
+ */
+struct HitInfo
+{
+	static constexpr float s_missTime = std::numeric_limits<float>::max();
+
+	HitInfo() : time(s_missTime), object(nullptr), material(nullptr) { }
+
+	/**
+	 * Returns true if the info represents a valid hit.
+	 */
+	inline bool valid() const
+	{
+		return object != nullptr && time < s_missTime;
+	}
+
+	glm::vec3 position;
+	glm::vec3 normal;
+
+	float time;
+	Object *object;
+	const Material *material;
+};
+
+
+/**
+ * Base class for objects that can be traced.
+*  As an excercise, why not add a plane?
+ */
+class Object
+{
+public:
+
+	/**
+	 * intersect is a pure virtual function, it must be overridden in all derived classes. Derive to implent different object types
+	 * (see Sphere in main.cpp, or TriangleMesh). The ray direction should not be expected to be normalized, and the time value calculated should be scaled
+	 * by the length (this follows naturally from most intersection routines). The hit info must also point out the material at the hit point.
+	 */
+	virtual HitInfo intersect(const Ray &ray) = 0;
+
+	/**
+	 * Occlusion query, returns true if the ray hits the object closer than 'maxDistance'. This is used for shadow rays, where we do
+	 * not need to know where the hit is, so derived classes should override it to skip calculating position, normal and so on.
+	 * The default implementation falls back to the full 'intersect'.
+	 */
+	virtual bool occludes(const Ray &ray, float maxDistance)
+	{
+		return intersect(ray).time < maxDistance;
+	}
+
+	/**
+	 * Like 'occludes', but also sets 'primitive' to the primitive (e.g., the sphere or triangle) that blocked the ray, which can then be
+	 * tested on its own with 'occludesPrimitive'. The shadow rays of neighbouring pixels are usually blocked by the same primitive, so
+	 * testing it first often saves the traversal, see 'isRayOccluded' in main.cpp. The default implementation treats the whole object as
+	 * one primitive.
+	 */
+	virtual bool findOccluder(const Ray &ray, float maxDistance, uint32_t &primitive)
+	{
+		primitive = 0;
+		return occludes(ray, maxDistance);
+	}
+
+	/**
+	 * Occlusion query against one primitive, as found by 'findOccluder'.
+	 */
+	virtual bool occludesPrimitive(const Ray &ray, float maxDistance, uint32_t /*primitive*/)
+	{
+		return occludes(ray, maxDistance);
+	}
+
+	/**
+	 * Packet version of 'intersect', for each ray in 'activeMask' that hits the object closer than 'packet.tMax[i]', the time is updated
+	 * and the hit info is stored in 'hits[i]'. The default implementation intersects the rays one at a time, derived classes should
+	 * override it to make use of the coherence of the rays, e.g., by traversing their BVH with the whole packet.
+	 */
+	virtual void intersectPacket(RayPacket &packet, PacketMask activeMask, HitInfo *hits)
+	{
+		for (int i = 0; i < RayPacket::s_size; ++i)
+		{
+			if ((activeMask >> i) & 1)
+			{
+				HitInfo hit = intersect(makeRay(packet.getOrigin(i), packet.getDirection(i)));
+				if (hit.time < packet.tMax[i])
+				{
+					packet.tMax[i] = hit.time;
+					hits[i] = hit;
+				}
+			}
+		}
+	}
+
+	/**
+	 * Returns the axis aligned bounding box of the object, this is used to build the BVH, so it should be as tight as possible.
+	 */
+	virtual Aabb getAabb() const = 0;
+
+	virtual ~Object() { }
+};
+
+#endif // _Object_h_
@@ -0,0 +1,161 @@
+/****************************************************************************/
+/* Copyright (c) 2016, Ola Olsson */
+/****************************************************************************/
+#ifndef _RayPacket_h_
+#define _RayPacket_h_
+
+#include "Simd.h"
+#include "../rasterizer_with_obj_loader/Aabb.h"
+
+#include <glm/glm.hpp>
+
+#include <stdint.h>
+
+// One bit per ray in a packet, set for the rays that are active, e.g., the rays that hit a BVH node.
+typedef uint64_t PacketMask;
+
+/**
+ * A packet of rays traced together, e.g., the primary rays for an 8x8 pixel block. Since neighbouring primary rays tend to
+ * hit the same BVH nodes and primitives, the cost of fetching a node or primitive can be shared by all the rays in the packet,
+ * and the rays are tested in SIMD lanes. The ray data is stored as a Structure of Arrays so that 4 or 8 rays can be loaded into
+ * a SIMD register at once. Which rays are in play is tracked using a 'PacketMask'.
+ *
+ * If all rays share the same origin (as is the case for the pin-hole camera), a frustum bounding the rays can be built, which
+ * makes it possible to cull BVH nodes with a single test for the whole packet.
+ */
+struct RayPacket
+{
+	enum
+	{
+		// Width and height of the block of pixels, the mask has one bit per ray so at most 8x8 is supported (4x4 also works).
+		s_side = 8,
+		s_size = s_side * s_side,
+		s_numSimdGroups = s_size / g_simdWidth,
+	};
+	static_assert(s_size <= 64 && s_size % g_simdWidth == 0, "The packet must fit the mask, and be a whole number of SIMD groups");
+
+	float originX[s_size];
+	float originY[s_size];
+	float originZ[s_size];
+	float directionX[s_size];
+	float directionY[s_size];
+	float directionZ[s_size];
+	float invDirectionX[s_size];
+	float invDirectionY[s_size];
+	float invDirectionZ[s_size];
+	// Closest hit found so far for each ray, updated as the packet is traced.
+	float tMax[s_size];
+
+	// Inward facing normals of the four side planes of the frustum, which all pass through 'frustumOrigin'.
+	bool hasFrustum;
+	glm::vec3 frustumOrigin;
+	glm::vec3 frustumNormals[4];
+
+	// Packets start out without a frustum, e.g., for reflection rays, which have no common origin.
+	RayPacket() : hasFrustum(false) {}
+
+	inline void setRay(int i, const glm::vec3 &origin, const glm::vec3 &direction, float maxTime)
+	{
+		originX[i] = origin.x;
+		originY[i] = origin.y;
+		originZ[i] = origin.z;
+		directionX[i] = direction.x;
+		directionY[i] = direction.y;
+		directionZ[i] = direction.z;
+		invDirectionX[i] = 1.0f / direction.x;
+		invDirectionY[i] = 1.0f / direction.y;
+		invDirectionZ[i] = 1.0f / direction.z;
+		tMax[i] = maxTime;
+	}
+
+	inline glm::vec3 getOrigin(int i) const { return glm::vec3(originX[i], originY[i], originZ[i]); }
+	inline glm::vec3 getDirection(int i) const { return glm::vec3(directionX[i], directionY[i], directionZ[i]); }
+
+	/**
+	 * Builds the frustum from the rays in the four corners of the block, i.e., rays 0, s_side - 1, s_size - 1 and s_size - s_side.
+	 * All rays must have the same origin, and be inside the corner rays, which is true for a pin-hole camera. Inactive rays must
+	 * also be set up, since the rays outside the image are still needed to get the corners right.
+	 */
+	inline void buildFrustum()
+	{
+		const int corners[4] = { 0, s_side - 1, s_size - 1, s_size - s_side };
+		const glm::vec3 centre = getDirection(s_size / 2 + s_side / 2);
+		frustumOrigin = getOrigin(0);
+		for (int i = 0; i < 4; ++i)
+		{
+			glm::vec3 n = cross(getDirection(corners[i]), getDirection(corners[(i + 1) % 4]));
+			// Flip to make sure the normal faces into the frustum, whichever way the corners are wound.
+			frustumNormals[i] = dot(n, centre) < 0.0f ? -n : n;
+		}
+		hasFrustum = true;
+	}
+};
+
+
+/**
+ * Returns true if the box is entirely outside the packet frustum, i.e., if it is entirely on the outside of any of the planes.
+ * This is conservative, a box outside the frustum may not be culled, but then it is caught by the per ray tests.
+ */
+inline bool frustumCullsAabb(const RayPacket &packet, const Aabb &aabb)
+{
+	if (!packet.hasFrustum)
+	{
+		return false;
+	}
+	for (int i = 0; i < 4; ++i)
+	{
+		const glm::vec3 &n = packet.frustumNormals[i];
+		// The corner of the box furthest along the normal.
+		glm::vec3 p = glm::vec3(n.x > 0.0f ? aabb.max.x : aabb.min.x, n.y > 0.0f ? aabb.max.y : aabb.min.y, n.z > 0.0f ? aabb.max.z : aabb.min.z);
+		if (dot(n, p - packet.frustumOrigin) < 0.0f)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+
+/**
+ * Slab test (see 'intersectRayAabb' in Bvh.h) of the rays in the SIMD group 'group' against the box. Returns the lane bits of the rays
+ * that enter the box before their current closest hit.
+ */
+inline int intersectRayPacketAabb(const RayPacket &packet, int group, const Aabb &aabb)
+{
+	const int o = group * g_simdWidth;
+	SimdFloat t0x = simdMul(simdSub(simdSet(aabb.min.x), simdLoad(packet.originX + o)), simdLoad(packet.invDirectionX + o));
+	SimdFloat t1x = simdMul(simdSub(simdSet(aabb.max.x), simdLoad(packet.originX + o)), simdLoad(packet.invDirectionX + o));
+	SimdFloat t0y = simdMul(simdSub(simdSet(aabb.min.y), simdLoad(packet.originY + o)), simdLoad(packet.invDirectionY + o));
+	SimdFloat t1y = simdMul(simdSub(simdSet(aabb.max.y), simdLoad(packet.originY + o)), simdLoad(packet.invDirectionY + o));
+	SimdFloat t0z = simdMul(simdSub(simdSet(aabb.min.z), simdLoad(packet.originZ + o)), simdLoad(packet.invDirectionZ + o));
+	SimdFloat t1z = simdMul(simdSub(simdSet(aabb.max.z), simdLoad(packet.originZ + o)), simdLoad(packet.invDirectionZ + o));
+
+	SimdFloat tEnter = simdMax(simdMax(simdMin(t0x, t1x), simdMin(t0y, t1y)), simdMax(simdMin(t0z, t1z), simdZero()));
+	SimdFloat tExit = simdMin(simdMin(simdMax(t0x, t1x), simdMax(t0y, t1y)), simdMin(simdMax(t0z, t1z), simdLoad(packet.tMax + o)));
+	return simdMoveMask(simdCmpLe(tEnter, tExit));
+}
+
+
+/**
+ * Returns the rays in 'activeMask' that may hit the box. First the whole packet is culled against the frustum, and then the rays are
+ * tested a SIMD group at a time, skipping groups without any active rays.
+ */
+inline PacketMask intersectRayPacketAabb(const RayPacket &packet, PacketMask activeMask, const Aabb &aabb)
+{
+	if (frustumCullsAabb(packet, aabb))
+	{
+		return 0;
+	}
+	PacketMask hitMask = 0;
+	for (int g = 0; g < RayPacket::s_numSimdGroups; ++g)
+	{
+		const int groupBits = int(activeMask >> (g * g_simdWidth)) & g_simdLaneBits;
+		if (groupBits != 0)
+		{
+			hitMask |= PacketMask(intersectRayPacketAabb(packet, g, aabb) & groupBits) << (g * g_simdWidth);
+		}
+	}
+	return hitMask;
+}
+
+#endif // _RayPacket_h_
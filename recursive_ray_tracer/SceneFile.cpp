@@ -0,0 +1,551 @@
+/****************************************************************************/
+/* Copyright (c) 2016, Ola Olsson */
+/****************************************************************************/
+#include "SceneFile.h"
+#include "SphereSet.h"
+#include "TriangleMesh.h"
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else // !_WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif // _WIN32
+
+#include <stdio.h>
+#include <string.h>
+#include <fstream>
+#include <sstream>
+#include <map>
+
+using glm::vec3;
+
+namespace
+{
+	const char g_magic[8] = "RTSCENE";
+	const uint32_t g_version = 1;
+	// Every array starts on a cache line (the mapping itself starts on a page).
+	const uint64_t g_arrayAlignment = 64;
+	// The sphere arrays are padded for the widest SIMD supported (AVX), so that a file works with both SSE and AVX builds.
+	const size_t g_spherePadding = 8;
+	static_assert(g_spherePadding >= SphereSet::s_simdWidth, "The padding must cover a SIMD load");
+
+	enum ObjectType
+	{
+		OT_SphereSet,
+		OT_TriangleMesh,
+	};
+
+	struct FileHeader
+	{
+		char magic[8];
+		uint32_t version;
+		// The sizes of the structures stored as they are, which must match those of the build reading the file.
+		uint32_t materialSize;
+		uint32_t triangleSize;
+		uint32_t nodeSize;
+		uint32_t quantizedNodeSize;
+		uint32_t wideNodeSize;
+		uint32_t numObjects;
+		SceneSettings settings;
+		uint64_t fileSize;
+	};
+
+	struct FileObject
+	{
+		uint32_t type;
+		uint32_t nodeFormat;
+		Aabb rootAabb;
+		float sahCost;
+		uint64_t numPrimitives;
+		uint64_t numNodes;
+		uint64_t numMaterials;
+		uint64_t nodesOffset;
+		uint64_t primitiveIndicesOffset;
+		uint64_t materialsOffset;
+		// OT_SphereSet: centre x, y, z, radius and material ids, OT_TriangleMesh: triangles, normals and material indices.
+		uint64_t arrayOffsets[5];
+	};
+
+	uint64_t alignOffset(uint64_t offset)
+	{
+		return (offset + g_arrayAlignment - 1) & ~(g_arrayAlignment - 1);
+	}
+
+	/**
+	 * An array to be written, at 'offset' from the start of the file.
+	 */
+	struct FileArray
+	{
+		const void *data;
+		uint64_t size;
+		uint64_t offset;
+	};
+
+	/**
+	 * Adds an array after the previous one (which ends at 'fileSize'), starting on a new cache line unless it continues the previous
+	 * array (e.g., padding), and returns where it goes.
+	 */
+	uint64_t addArray(std::vector<FileArray> &arrays, uint64_t &fileSize, const void *data, uint64_t size, bool align = true)
+	{
+		fileSize = align ? alignOffset(fileSize) : fileSize;
+		FileArray a = { data, size, fileSize };
+		arrays.push_back(a);
+		fileSize += size;
+		return a.offset;
+	}
+
+	/**
+	 * Returns a pointer to the array at 'offset' in the mapped file, or null if it does not fit in the file or is not aligned.
+	 */
+	template <typename T>
+	const T *getArray(const uint8_t *fileData, uint64_t fileSize, uint64_t offset, uint64_t count)
+	{
+		if (offset % g_arrayAlignment != 0 || offset > fileSize || count > (fileSize - offset) / sizeof(T))
+		{
+			return nullptr;
+		}
+		return reinterpret_cast<const T*>(fileData + offset);
+	}
+
+	/**
+	 * Maps the whole file read-only, returns null if it could not be opened or is empty.
+	 */
+	const uint8_t *mapFile(const std::string &fileName, size_t &size)
+	{
+		size = 0;
+#ifdef _WIN32
+		HANDLE file = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+		{
+			return nullptr;
+		}
+		LARGE_INTEGER fileSize;
+		const uint8_t *data = nullptr;
+		if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0)
+		{
+			// The view stays valid after the handles are closed.
+			HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			if (mapping)
+			{
+				data = static_cast<const uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+				CloseHandle(mapping);
+				size = data ? size_t(fileSize.QuadPart) : 0;
+			}
+		}
+		CloseHandle(file);
+		return data;
+#else // !_WIN32
+		int file = open(fileName.c_str(), O_RDONLY);
+		if (file < 0)
+		{
+			return nullptr;
+		}
+		struct stat fileStat;
+		const uint8_t *data = nullptr;
+		if (fstat(file, &fileStat) == 0 && fileStat.st_size > 0)
+		{
+			// The mapping stays valid after the file is closed.
+			void *mapping = mmap(nullptr, size_t(fileStat.st_size), PROT_READ, MAP_PRIVATE, file, 0);
+			if (mapping != MAP_FAILED)
+			{
+				data = static_cast<const uint8_t*>(mapping);
+				size = size_t(fileStat.st_size);
+			}
+		}
+		::close(file);
+		return data;
+#endif // _WIN32
+	}
+
+	void unmapFile(const uint8_t *data, size_t size)
+	{
+#ifdef _WIN32
+		UnmapViewOfFile(data);
+#else // !_WIN32
+		munmap(const_cast<uint8_t*>(data), size);
+#endif // _WIN32
+	}
+
+	bool readVec3(std::istringstream &line, vec3 &v)
+	{
+		return bool(line >> v.x >> v.y >> v.z);
+	}
+};
+
+
+
+SceneFile::SceneFile()
+	: m_mappedData(nullptr)
+	, m_mappedSize(0)
+{
+}
+
+
+
+SceneFile::~SceneFile()
+{
+	close();
+}
+
+
+
+bool SceneFile::load(const std::string &fileName, Bvh::NodeFormat nodeFormat, SceneSettings &settings, std::vector<Object*> &objects)
+{
+	close();
+
+	// The binary form is recognized by the magic string at the start.
+	char magic[sizeof(g_magic)] = {};
+	std::ifstream file(fileName, std::ios::binary);
+	if (!file)
+	{
+		fprintf(stderr, "Failed to open scene file '%s'\n", fileName.c_str());
+		return false;
+	}
+	file.read(magic, sizeof(magic));
+	file.close();
+
+	if (memcmp(magic, g_magic, sizeof(g_magic)) == 0)
+	{
+		return loadBinary(fileName, settings, objects);
+	}
+	return loadText(fileName, nodeFormat, settings, objects);
+}
+
+
+
+bool SceneFile::save(const std::string &fileName, const std::vector<Object*> &objects, const SceneSettings &settings)
+{
+	// 1. Lay out the file: the header and object table, and then the arrays of each object.
+	std::vector<Object*> storedObjects;
+	for (auto o : objects)
+	{
+		if (dynamic_cast<SphereSet*>(o) || dynamic_cast<TriangleMesh*>(o))
+		{
+			storedObjects.push_back(o);
+		}
+		else
+		{
+			fprintf(stderr, "Warning: skipping an object which cannot be stored in a scene file\n");
+		}
+	}
+
+	std::vector<FileObject> fileObjects(storedObjects.size(), FileObject());
+	std::vector<FileArray> arrays;
+	uint64_t fileSize = sizeof(FileHeader) + fileObjects.size() * sizeof(FileObject);
+	// Zeros for the sphere padding, the padding in memory may be smaller.
+	const std::vector<uint8_t> zeros(g_spherePadding * sizeof(float), 0);
+	for (size_t i = 0; i < storedObjects.size(); ++i)
+	{
+		FileObject &fo = fileObjects[i];
+		const Bvh *bvh = nullptr;
+		if (SphereSet *sphereSet = dynamic_cast<SphereSet*>(storedObjects[i]))
+		{
+			const SphereSet::Data data = sphereSet->getData();
+			const void *arrayData[5] = { data.centreX, data.centreY, data.centreZ, data.radius, data.materialIds };
+			static_assert(sizeof(float) == sizeof(uint32_t), "The material ids are padded like the floats");
+			for (int a = 0; a < 5; ++a)
+			{
+				fo.arrayOffsets[a] = addArray(arrays, fileSize, arrayData[a], data.numSpheres * sizeof(float));
+				addArray(arrays, fileSize, zeros.data(), zeros.size(), false);
+			}
+			fo.type = OT_SphereSet;
+			fo.numPrimitives = data.numSpheres;
+			fo.numMaterials = data.numMaterials;
+			fo.materialsOffset = addArray(arrays, fileSize, data.materials, data.numMaterials * sizeof(Material));
+			bvh = &sphereSet->getBvh();
+		}
+		else if (TriangleMesh *mesh = dynamic_cast<TriangleMesh*>(storedObjects[i]))
+		{
+			const TriangleMesh::Data &data = mesh->getData();
+			fo.type = OT_TriangleMesh;
+			fo.numPrimitives = data.numTriangles;
+			fo.arrayOffsets[0] = addArray(arrays, fileSize, data.triangles, data.numTriangles * sizeof(TriangleMesh::Triangle));
+			fo.arrayOffsets[1] = addArray(arrays, fileSize, data.normals, data.numTriangles * 3 * sizeof(vec3));
+			fo.arrayOffsets[2] = addArray(arrays, fileSize, data.materialIndices, data.numTriangles * sizeof(uint32_t));
+			fo.numMaterials = data.numMaterials;
+			fo.materialsOffset = addArray(arrays, fileSize, data.materials, data.numMaterials * sizeof(Material));
+			bvh = &mesh->getBvh();
+		}
+		const Bvh::Data bvhData = bvh->getData();
+		fo.nodeFormat = uint32_t(bvhData.nodeFormat);
+		fo.rootAabb = bvhData.rootAabb;
+		fo.sahCost = bvhData.sahCost;
+		fo.numNodes = bvhData.numNodes;
+		fo.nodesOffset = addArray(arrays, fileSize, bvhData.nodes, bvhData.numNodes * Bvh::getNodeSize(bvhData.nodeFormat));
+		fo.primitiveIndicesOffset = addArray(arrays, fileSize, bvhData.primitiveIndices, bvhData.numPrimitives * sizeof(uint32_t));
+	}
+
+	FileHeader header = {};
+	memcpy(header.magic, g_magic, sizeof(g_magic));
+	header.version = g_version;
+	header.materialSize = uint32_t(sizeof(Material));
+	header.triangleSize = uint32_t(sizeof(TriangleMesh::Triangle));
+	header.nodeSize = uint32_t(sizeof(BvhNode));
+	header.quantizedNodeSize = uint32_t(sizeof(BvhQuantizedNode));
+	header.wideNodeSize = uint32_t(sizeof(BvhWideNode));
+	header.numObjects = uint32_t(fileObjects.size());
+	header.settings = settings;
+	header.fileSize = fileSize;
+
+	// 2. Write it all, with zeros in the gaps between the arrays.
+	FILE *f = fopen(fileName.c_str(), "wb");
+	if (!f)
+	{
+		fprintf(stderr, "Failed to open '%s' for writing\n", fileName.c_str());
+		return false;
+	}
+	bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+	ok = ok && (fileObjects.empty() || fwrite(fileObjects.data(), sizeof(FileObject), fileObjects.size(), f) == fileObjects.size());
+	uint64_t position = sizeof(FileHeader) + fileObjects.size() * sizeof(FileObject);
+	const uint8_t gap[g_arrayAlignment] = {};
+	for (const FileArray &a : arrays)
+	{
+		ok = ok && (a.offset == position || fwrite(gap, 1, size_t(a.offset - position), f) == size_t(a.offset - position));
+		ok = ok && (a.size == 0 || fwrite(a.data, size_t(a.size), 1, f) == 1);
+		position = a.offset + a.size;
+	}
+	ok = fclose(f) == 0 && ok;
+	if (!ok)
+	{
+		fprintf(stderr, "Failed to write scene file '%s'\n", fileName.c_str());
+	}
+	return ok;
+}
+
+
+
+void SceneFile::close()
+{
+	if (m_mappedData)
+	{
+		unmapFile(m_mappedData, m_mappedSize);
+		m_mappedData = nullptr;
+		m_mappedSize = 0;
+	}
+}
+
+
+
+bool SceneFile::loadText(const std::string &fileName, Bvh::NodeFormat nodeFormat, SceneSettings &settings, std::vector<Object*> &objects)
+{
+	std::ifstream file(fileName);
+	if (!file)
+	{
+		fprintf(stderr, "Failed to open scene file '%s'\n", fileName.c_str());
+		return false;
+	}
+	// Models are found relative to the scene file.
+	const size_t slash = fileName.find_last_of("/\\");
+	const std::string basePath = slash == std::string::npos ? std::string() : fileName.substr(0, slash + 1);
+
+	SphereSet *spheres = new SphereSet;
+	std::map<std::string, uint32_t> materialIds;
+	std::vector<Object*> newObjects;
+	std::string lineText;
+	bool ok = true;
+	for (int lineNumber = 1; ok && std::getline(file, lineText); ++lineNumber)
+	{
+		std::istringstream line(lineText.substr(0, lineText.find('#')));
+		std::string item;
+		if (!(line >> item))
+		{
+			continue;
+		}
+		if (item == "camera")
+		{
+			ok = readVec3(line, settings.viewPosition) && readVec3(line, settings.viewTarget);
+			float fov;
+			if (line >> fov)
+			{
+				settings.fov = fov;
+			}
+		}
+		else if (item == "light")
+		{
+			ok = readVec3(line, settings.lightPosition) && readVec3(line, settings.lightColour);
+		}
+		else if (item == "material")
+		{
+			std::string name;
+			Material m;
+			ok = (line >> name) && readVec3(line, m.diffuseReflectance) && readVec3(line, m.baseSpecularReflectance) && (line >> m.shininess >> m.reflectivity);
+			if (ok)
+			{
+				materialIds[name] = spheres->addMaterial(m);
+			}
+		}
+		else if (item == "sphere")
+		{
+			vec3 centre;
+			float radius;
+			std::string materialName;
+			ok = readVec3(line, centre) && (line >> radius >> materialName);
+			if (ok && materialIds.find(materialName) == materialIds.end())
+			{
+				fprintf(stderr, "%s:%d: Unknown material '%s'\n", fileName.c_str(), lineNumber, materialName.c_str());
+				ok = false;
+				break;
+			}
+			if (ok)
+			{
+				spheres->addSphere(centre, radius, materialIds[materialName]);
+			}
+		}
+		else if (item == "model")
+		{
+			std::string modelFileName;
+			float reflectivity = 0.0f;
+			ok = bool(line >> modelFileName);
+			line >> reflectivity;
+			if (ok)
+			{
+				if (modelFileName[0] != '/' && modelFileName.find(':') == std::string::npos)
+				{
+					modelFileName = basePath + modelFileName;
+				}
+				OBJModel model;
+				if (!model.load(modelFileName))
+				{
+					fprintf(stderr, "%s:%d: Failed to load model '%s'\n", fileName.c_str(), lineNumber, modelFileName.c_str());
+					ok = false;
+					break;
+				}
+				newObjects.push_back(makeTriangleMesh(model, reflectivity, nodeFormat));
+			}
+		}
+		else
+		{
+			fprintf(stderr, "%s:%d: Unknown item '%s'\n", fileName.c_str(), lineNumber, item.c_str());
+			ok = false;
+			break;
+		}
+		if (!ok)
+		{
+			fprintf(stderr, "%s:%d: Missing or invalid values for '%s'\n", fileName.c_str(), lineNumber, item.c_str());
+		}
+	}
+
+	if (ok && spheres->getNumSpheres() > 0)
+	{
+		spheres->build(nodeFormat);
+		newObjects.push_back(spheres);
+	}
+	else
+	{
+		delete spheres;
+	}
+	if (!ok)
+	{
+		for (auto o : newObjects)
+		{
+			delete o;
+		}
+		return false;
+	}
+	objects.insert(objects.end(), newObjects.begin(), newObjects.end());
+	return true;
+}
+
+
+
+bool SceneFile::loadBinary(const std::string &fileName, SceneSettings &settings, std::vector<Object*> &objects)
+{
+	size_t size = 0;
+	const uint8_t *data = mapFile(fileName, size);
+	if (!data)
+	{
+		fprintf(stderr, "Failed to map scene file '%s'\n", fileName.c_str());
+		return false;
+	}
+
+	// 1. Check that the file is complete and was written by a build with the same structures.
+	const FileHeader *header = size >= sizeof(FileHeader) ? reinterpret_cast<const FileHeader*>(data) : nullptr;
+	if (!header || header->version != g_version || header->fileSize != size
+		|| header->materialSize != sizeof(Material) || header->triangleSize != sizeof(TriangleMesh::Triangle) || header->nodeSize != sizeof(BvhNode)
+		|| header->quantizedNodeSize != sizeof(BvhQuantizedNode) || header->wideNodeSize != sizeof(BvhWideNode)
+		|| header->numObjects > (size - sizeof(FileHeader)) / sizeof(FileObject))
+	{
+		fprintf(stderr, "Scene file '%s' is truncated, or was written by another version\n", fileName.c_str());
+		unmapFile(data, size);
+		return false;
+	}
+
+	// 2. Make the objects, which use the arrays in place.
+	const FileObject *fileObjects = reinterpret_cast<const FileObject*>(data + sizeof(FileHeader));
+	std::vector<Object*> newObjects;
+	bool ok = true;
+	for (uint32_t i = 0; ok && i < header->numObjects; ++i)
+	{
+		const FileObject &fo = fileObjects[i];
+		Bvh::Data bvhData;
+		bvhData.nodeFormat = Bvh::NodeFormat(fo.nodeFormat);
+		bvhData.rootAabb = fo.rootAabb;
+		bvhData.sahCost = fo.sahCost;
+		bvhData.nodes = fo.nodeFormat <= Bvh::NF_Wide ? getArray<uint8_t>(data, size, fo.nodesOffset, fo.numNodes * Bvh::getNodeSize(bvhData.nodeFormat)) : nullptr;
+		bvhData.numNodes = size_t(fo.numNodes);
+		bvhData.primitiveIndices = getArray<uint32_t>(data, size, fo.primitiveIndicesOffset, fo.numPrimitives);
+		bvhData.numPrimitives = size_t(fo.numPrimitives);
+		ok = bvhData.nodes && bvhData.primitiveIndices;
+
+		const Material *materials = getArray<Material>(data, size, fo.materialsOffset, fo.numMaterials);
+		if (ok && materials && fo.type == OT_SphereSet)
+		{
+			SphereSet::Data sphereData;
+			sphereData.numSpheres = size_t(fo.numPrimitives);
+			sphereData.centreX = getArray<float>(data, size, fo.arrayOffsets[0], fo.numPrimitives + g_spherePadding);
+			sphereData.centreY = getArray<float>(data, size, fo.arrayOffsets[1], fo.numPrimitives + g_spherePadding);
+			sphereData.centreZ = getArray<float>(data, size, fo.arrayOffsets[2], fo.numPrimitives + g_spherePadding);
+			sphereData.radius = getArray<float>(data, size, fo.arrayOffsets[3], fo.numPrimitives + g_spherePadding);
+			sphereData.materialIds = getArray<uint32_t>(data, size, fo.arrayOffsets[4], fo.numPrimitives + g_spherePadding);
+			sphereData.materials = materials;
+			sphereData.numMaterials = size_t(fo.numMaterials);
+			ok = sphereData.centreX && sphereData.centreY && sphereData.centreZ && sphereData.radius && sphereData.materialIds;
+			if (ok)
+			{
+				SphereSet *sphereSet = new SphereSet;
+				sphereSet->useData(sphereData, bvhData);
+				newObjects.push_back(sphereSet);
+			}
+		}
+		else if (ok && materials && fo.type == OT_TriangleMesh)
+		{
+			TriangleMesh::Data meshData;
+			meshData.numTriangles = size_t(fo.numPrimitives);
+			meshData.triangles = getArray<TriangleMesh::Triangle>(data, size, fo.arrayOffsets[0], fo.numPrimitives);
+			meshData.normals = getArray<vec3>(data, size, fo.arrayOffsets[1], fo.numPrimitives * 3);
+			meshData.materialIndices = getArray<uint32_t>(data, size, fo.arrayOffsets[2], fo.numPrimitives);
+			meshData.materials = materials;
+			meshData.numMaterials = size_t(fo.numMaterials);
+			ok = meshData.triangles && meshData.normals && meshData.materialIndices;
+			if (ok)
+			{
+				newObjects.push_back(new TriangleMesh(meshData, bvhData));
+			}
+		}
+		else
+		{
+			ok = false;
+		}
+	}
+	if (!ok)
+	{
+		fprintf(stderr, "Scene file '%s' is corrupt\n", fileName.c_str());
+		for (auto o : newObjects)
+		{
+			delete o;
+		}
+		unmapFile(data, size);
+		return false;
+	}
+
+	m_mappedData = data;
+	m_mappedSize = size;
+	settings = header->settings;
+	objects.insert(objects.end(), newObjects.begin(), newObjects.end());
+	return true;
+}
@@ -0,0 +1,79 @@
+/****************************************************************************/
+/* Copyright (c) 2016, Ola Olsson */
+/****************************************************************************/
+#ifndef _SceneFile_h_
+#define _SceneFile_h_
+
+#include "Object.h"
+#include "Bvh.h"
+
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <string>
+#include <stdint.h>
+
+/**
+ * The camera and light of a scene, the ray tracer has a single point light.
+ */
+struct SceneSettings
+{
+	glm::vec3 viewPosition;
+	glm::vec3 viewTarget;
+	float fov;
+	glm::vec3 lightPosition;
+	glm::vec3 lightColour;
+};
+
+/**
+ * Loads scenes from files, instead of setting them up in code. There are two forms of the file:
+ *
+ * The text form is for writing scenes by hand, with one item per line ('#' starts a comment):
+ *   camera <position xyz> <target xyz> [fov]
+ *   light <position xyz> <colour rgb>
+ *   material <name> <diffuse rgb> <specular rgb> <shininess> <reflectivity>
+ *   sphere <centre xyz> <radius> <material name>
+ *   model <file.obj> [reflectivity]
+ * The spheres are put in a SphereSet, and each model is loaded as a TriangleMesh (the path is relative to the scene file). As there is
+ * only one light, the last one is used. Loading this form means parsing and building the BVHs, which takes a while for large scenes.
+ *
+ * The binary form is written by 'save' from the objects of a scene that is already built, and stores the arrays the objects trace,
+ * including their BVHs, exactly as they are in memory. 'load' memory maps the file and the objects use the arrays in place, so there is
+ * nothing to parse, copy or build, and the pages are only read from disk as the rays touch them. The file starts with a header and a
+ * table of objects, followed by the arrays, each starting on a cache line. The layout depends on the compiler, so a file is checked
+ * against the structure sizes of the build loading it, but otherwise the contents are trusted.
+ */
+class SceneFile
+{
+public:
+	SceneFile();
+	~SceneFile();
+
+	/**
+	 * Loads either form of file, adding the objects (which must be deleted before the scene file is closed) to the list and updating the
+	 * settings given in the file. 'nodeFormat' is used for the BVHs built for the text form. Prints what went wrong and returns false
+	 * if the file could not be loaded.
+	 */
+	bool load(const std::string &fileName, Bvh::NodeFormat nodeFormat, SceneSettings &settings, std::vector<Object*> &objects);
+
+	/**
+	 * Writes the binary form. Only SphereSet and TriangleMesh objects can be stored, other objects are skipped with a warning.
+	 */
+	static bool save(const std::string &fileName, const std::vector<Object*> &objects, const SceneSettings &settings);
+
+	/**
+	 * Unmaps the binary file, if one is loaded. The objects using it must be deleted first.
+	 */
+	void close();
+
+	bool isMapped() const { return m_mappedData != nullptr; }
+
+protected:
+	bool loadText(const std::string &fileName, Bvh::NodeFormat nodeFormat, SceneSettings &settings, std::vector<Object*> &objects);
+	bool loadBinary(const std::string &fileName, SceneSettings &settings, std::vector<Object*> &objects);
+
+	const uint8_t *m_mappedData;
+	size_t m_mappedSize;
+};
+
+#endif // _SceneFile_h_
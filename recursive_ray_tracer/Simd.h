@@ -0,0 +1,224 @@
+/****************************************************************************/
+/* Copyright (c) 2016, Ola Olsson */
+/****************************************************************************/
+#ifndef _Simd_h_
+#define _Simd_h_
+
+/**
+ * Thin wrappers around the SSE or AVX intrinsics, so that the SIMD code can be written once for either width. SSE2 is
+ * always available on x64, AVX is used when the compiler targets it (/arch:AVX in Visual Studio, -mavx in gcc/clang).
+ * A 'SimdFloat' holds 'g_simdWidth' floats, and comparisons return masks where each lane is either all ones or all zeros.
+ */
+#ifdef __AVX__
+#include <immintrin.h>
+#else // !__AVX__
+#include <emmintrin.h>
+#endif // __AVX__
+
+/**
+ * Loads 4 vec3s (12 floats, x0 y0 z0 x1 y1 ...) and splits them into the x, y and z of each, used by 'simdLoadVec3' for either width.
+ */
+inline void loadVec3x4(const float *p, __m128 &x, __m128 &y, __m128 &z)
+{
+	const __m128 a = _mm_loadu_ps(p);
+	const __m128 b = _mm_loadu_ps(p + 4);
+	const __m128 c = _mm_loadu_ps(p + 8);
+	x = _mm_shuffle_ps(a, _mm_shuffle_ps(b, c, _MM_SHUFFLE(1, 1, 2, 2)), _MM_SHUFFLE(2, 0, 3, 0));
+	y = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(0, 0, 1, 1)), _mm_shuffle_ps(b, c, _MM_SHUFFLE(2, 2, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0));
+	z = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(1, 1, 2, 2)), _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 3, 0, 0)), _MM_SHUFFLE(2, 0, 2, 0));
+}
+
+/**
+ * The inverse of 'loadVec3x4', interleaves the x, y and z of 4 vec3s and stores them.
+ */
+inline void storeVec3x4(float *p, __m128 x, __m128 y, __m128 z)
+{
+	_mm_storeu_ps(p, _mm_shuffle_ps(_mm_shuffle_ps(x, y, _MM_SHUFFLE(0, 0, 0, 0)), _mm_shuffle_ps(z, x, _MM_SHUFFLE(1, 1, 0, 0)), _MM_SHUFFLE(2, 0, 2, 0)));
+	_mm_storeu_ps(p + 4, _mm_shuffle_ps(_mm_shuffle_ps(y, z, _MM_SHUFFLE(1, 1, 1, 1)), _mm_shuffle_ps(x, y, _MM_SHUFFLE(2, 2, 2, 2)), _MM_SHUFFLE(2, 0, 2, 0)));
+	_mm_storeu_ps(p + 8, _mm_shuffle_ps(_mm_shuffle_ps(z, x, _MM_SHUFFLE(3, 3, 2, 2)), _mm_shuffle_ps(y, z, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0)));
+}
+
+#ifdef __AVX__
+
+const int g_simdWidth = 8;
+typedef __m256 SimdFloat;
+
+inline SimdFloat simdSet(float v) { return _mm256_set1_ps(v); }
+inline SimdFloat simdZero() { return _mm256_setzero_ps(); }
+inline SimdFloat simdLaneIndex() { return _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f); }
+inline SimdFloat simdLoad(const float *p) { return _mm256_loadu_ps(p); }
+inline void simdStore(float *p, SimdFloat a) { _mm256_storeu_ps(p, a); }
+
+inline SimdFloat simdAdd(SimdFloat a, SimdFloat b) { return _mm256_add_ps(a, b); }
+inline SimdFloat simdSub(SimdFloat a, SimdFloat b) { return _mm256_sub_ps(a, b); }
+inline SimdFloat simdMul(SimdFloat a, SimdFloat b) { return _mm256_mul_ps(a, b); }
+inline SimdFloat simdDiv(SimdFloat a, SimdFloat b) { return _mm256_div_ps(a, b); }
+inline SimdFloat simdMin(SimdFloat a, SimdFloat b) { return _mm256_min_ps(a, b); }
+inline SimdFloat simdMax(SimdFloat a, SimdFloat b) { return _mm256_max_ps(a, b); }
+inline SimdFloat simdSqrt(SimdFloat a) { return _mm256_sqrt_ps(a); }
+
+inline SimdFloat simdCmpLt(SimdFloat a, SimdFloat b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+inline SimdFloat simdCmpLe(SimdFloat a, SimdFloat b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+inline SimdFloat simdCmpGt(SimdFloat a, SimdFloat b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+inline SimdFloat simdCmpGe(SimdFloat a, SimdFloat b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+
+inline SimdFloat simdAnd(SimdFloat a, SimdFloat b) { return _mm256_and_ps(a, b); }
+inline SimdFloat simdOr(SimdFloat a, SimdFloat b) { return _mm256_or_ps(a, b); }
+// Note: the argument order is not the same as the intrinsic, this returns 'a & ~b'.
+inline SimdFloat simdAndNot(SimdFloat a, SimdFloat b) { return _mm256_andnot_ps(b, a); }
+// Returns 'a' for lanes where the mask is set and 'b' for the others.
+inline SimdFloat simdSelect(SimdFloat mask, SimdFloat a, SimdFloat b) { return _mm256_blendv_ps(b, a, mask); }
+// Returns one bit per lane, set where the mask lane is set.
+inline int simdMoveMask(SimdFloat mask) { return _mm256_movemask_ps(mask); }
+// Converts to integers, rounding towards zero, and stores them (unaligned).
+inline void simdStoreInt(int *p, SimdFloat a) { _mm256_storeu_si256((__m256i *)p, _mm256_cvttps_epi32(a)); }
+// Reinterprets the bits of the integer lanes (converted from 'a', rounding to nearest) as floats, see 'simdExpApprox'.
+inline SimdFloat simdIntBitsToFloat(SimdFloat a) { return _mm256_castsi256_ps(_mm256_cvtps_epi32(a)); }
+// The inverse, the bits of each lane read as an integer, converted to float.
+inline SimdFloat simdFloatBitsToInt(SimdFloat a) { return _mm256_cvtepi32_ps(_mm256_castps_si256(a)); }
+// Sets all lanes to the given bits, e.g., a mask for a part of the floats.
+inline SimdFloat simdSetBits(int bits) { return _mm256_castsi256_ps(_mm256_set1_epi32(bits)); }
+// The inverse of 'simdMoveMask', sets the lanes for which the bit is set. AVX (without AVX2) has no 256-bit integer compare, so do it in two halves.
+inline SimdFloat simdMaskFromBits(int bits)
+{
+	const __m128i laneBitsLo = _mm_setr_epi32(1, 2, 4, 8);
+	const __m128i laneBitsHi = _mm_setr_epi32(16, 32, 64, 128);
+	__m128i b = _mm_set1_epi32(bits);
+	__m128 lo = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(b, laneBitsLo), laneBitsLo));
+	__m128 hi = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(b, laneBitsHi), laneBitsHi));
+	return _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1);
+}
+// Loads g_simdWidth vec3s (e.g., a run of pixels of an image of glm::vec3) as the x, y and z of each.
+inline void simdLoadVec3(const float *p, SimdFloat &x, SimdFloat &y, SimdFloat &z)
+{
+	__m128 x0, y0, z0, x1, y1, z1;
+	loadVec3x4(p, x0, y0, z0);
+	loadVec3x4(p + 12, x1, y1, z1);
+	x = _mm256_insertf128_ps(_mm256_castps128_ps256(x0), x1, 1);
+	y = _mm256_insertf128_ps(_mm256_castps128_ps256(y0), y1, 1);
+	z = _mm256_insertf128_ps(_mm256_castps128_ps256(z0), z1, 1);
+}
+// The inverse of 'simdLoadVec3'.
+inline void simdStoreVec3(float *p, SimdFloat x, SimdFloat y, SimdFloat z)
+{
+	storeVec3x4(p, _mm256_castps256_ps128(x), _mm256_castps256_ps128(y), _mm256_castps256_ps128(z));
+	storeVec3x4(p + 12, _mm256_extractf128_ps(x, 1), _mm256_extractf128_ps(y, 1), _mm256_extractf128_ps(z, 1));
+}
+
+#else // !__AVX__
+
+const int g_simdWidth = 4;
+typedef __m128 SimdFloat;
+
+inline SimdFloat simdSet(float v) { return _mm_set1_ps(v); }
+inline SimdFloat simdZero() { return _mm_setzero_ps(); }
+inline SimdFloat simdLaneIndex() { return _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f); }
+inline SimdFloat simdLoad(const float *p) { return _mm_loadu_ps(p); }
+inline void simdStore(float *p, SimdFloat a) { _mm_storeu_ps(p, a); }
+
+inline SimdFloat simdAdd(SimdFloat a, SimdFloat b) { return _mm_add_ps(a, b); }
+inline SimdFloat simdSub(SimdFloat a, SimdFloat b) { return _mm_sub_ps(a, b); }
+inline SimdFloat simdMul(SimdFloat a, SimdFloat b) { return _mm_mul_ps(a, b); }
+inline SimdFloat simdDiv(SimdFloat a, SimdFloat b) { return _mm_div_ps(a, b); }
+inline SimdFloat simdMin(SimdFloat a, SimdFloat b) { return _mm_min_ps(a, b); }
+inline SimdFloat simdMax(SimdFloat a, SimdFloat b) { return _mm_max_ps(a, b); }
+inline SimdFloat simdSqrt(SimdFloat a) { return _mm_sqrt_ps(a); }
+
+inline SimdFloat simdCmpLt(SimdFloat a, SimdFloat b) { return _mm_cmplt_ps(a, b); }
+inline SimdFloat simdCmpLe(SimdFloat a, SimdFloat b) { return _mm_cmple_ps(a, b); }
+inline SimdFloat simdCmpGt(SimdFloat a, SimdFloat b) { return _mm_cmpgt_ps(a, b); }
+inline SimdFloat simdCmpGe(SimdFloat a, SimdFloat b) { return _mm_cmpge_ps(a, b); }
+
+inline SimdFloat simdAnd(SimdFloat a, SimdFloat b) { return _mm_and_ps(a, b); }
+inline SimdFloat simdOr(SimdFloat a, SimdFloat b) { return _mm_or_ps(a, b); }
+// Note: the argument order is not the same as the intrinsic, this returns 'a & ~b'.
+inline SimdFloat simdAndNot(SimdFloat a, SimdFloat b) { return _mm_andnot_ps(b, a); }
+// Returns 'a' for lanes where the mask is set and 'b' for the others (SSE2 has no blend instruction).
+inline SimdFloat simdSelect(SimdFloat mask, SimdFloat a, SimdFloat b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); }
+// Returns one bit per lane, set where the mask lane is set.
+inline int simdMoveMask(SimdFloat mask) { return _mm_movemask_ps(mask); }
+// Converts to integers, rounding towards zero, and stores them (unaligned).
+inline void simdStoreInt(int *p, SimdFloat a) { _mm_storeu_si128((__m128i *)p, _mm_cvttps_epi32(a)); }
+// Reinterprets the bits of the integer lanes (converted from 'a', rounding to nearest) as floats, see 'simdExpApprox'.
+inline SimdFloat simdIntBitsToFloat(SimdFloat a) { return _mm_castsi128_ps(_mm_cvtps_epi32(a)); }
+// The inverse, the bits of each lane read as an integer, converted to float.
+inline SimdFloat simdFloatBitsToInt(SimdFloat a) { return _mm_cvtepi32_ps(_mm_castps_si128(a)); }
+// Sets all lanes to the given bits, e.g., a mask for a part of the floats.
+inline SimdFloat simdSetBits(int bits) { return _mm_castsi128_ps(_mm_set1_epi32(bits)); }
+// The inverse of 'simdMoveMask', sets the lanes for which the bit is set.
+inline SimdFloat simdMaskFromBits(int bits)
+{
+	const __m128i laneBits = _mm_setr_epi32(1, 2, 4, 8);
+	return _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(bits), laneBits), laneBits));
+}
+// Loads g_simdWidth vec3s (e.g., a run of pixels of an image of glm::vec3) as the x, y and z of each.
+inline void simdLoadVec3(const float *p, SimdFloat &x, SimdFloat &y, SimdFloat &z) { loadVec3x4(p, x, y, z); }
+// The inverse of 'simdLoadVec3'.
+inline void simdStoreVec3(float *p, SimdFloat x, SimdFloat y, SimdFloat z) { storeVec3x4(p, x, y, z); }
+
+#endif // __AVX__
+
+// Bit mask with one bit set for each SIMD lane.
+const int g_simdLaneBits = (1 << g_simdWidth) - 1;
+
+/**
+ * A rough exp(x), for x in [-87, 0], within about 4%, which is fine for weights. Builds the float bits directly, the exponent field
+ * gets the integer part of x / ln(2) and the mantissa the fraction, which is a straight line between the powers of two (Schraudolph,
+ * "A Fast, Compact Approximation of the Exponential Function").
+ */
+inline SimdFloat simdExpApprox(SimdFloat x)
+{
+	return simdIntBitsToFloat(simdAdd(simdMul(x, simdSet(12102203.0f)), simdSet(1065353216.0f)));
+}
+
+/**
+ * Returns the fraction of the mantissa of x, i.e., m - 1 where x = m * 2^e and m is in [1, 2).
+ */
+inline SimdFloat simdMantissaFraction(SimdFloat x)
+{
+	return simdSub(simdOr(simdAnd(x, simdSetBits(0x007FFFFF)), simdSet(1.0f)), simdSet(1.0f));
+}
+
+/**
+ * log2(x) for x > 0 (0 gives -127), within about 2e-5. The float bits read as an integer are the exponent plus the fraction of the
+ * mantissa, a straight line between the powers of two (like 'simdExpApprox' the other way around). The fraction f is then corrected
+ * by f * (1 - f) * p(f), where p is a polynomial fitted to log2(1 + f) - f, which is zero at both ends.
+ */
+inline SimdFloat simdLog2(SimdFloat x)
+{
+	const SimdFloat f = simdMantissaFraction(x);
+	SimdFloat p = simdSet(0.026273051f);
+	p = simdAdd(simdMul(p, f), simdSet(-0.098387616f));
+	p = simdAdd(simdMul(p, f), simdSet(0.18486223f));
+	p = simdAdd(simdMul(p, f), simdSet(-0.27672833f));
+	p = simdAdd(simdMul(p, f), simdSet(0.44265944f));
+	const SimdFloat linear = simdSub(simdMul(simdFloatBitsToInt(x), simdSet(1.0f / 8388608.0f)), simdSet(127.0f));
+	return simdAdd(linear, simdMul(simdMul(f, simdSub(simdSet(1.0f), f)), p));
+}
+
+/**
+ * 2^x, within about 2e-5 (relative), x is clamped to [-126, 127]. Like 'simdExpApprox', but with the straight line between the powers
+ * of two corrected by 1 + f * (1 - f) * p(f), where f is the fraction and p a polynomial fitted to 2^f / (1 + f).
+ */
+inline SimdFloat simdExp2(SimdFloat x)
+{
+	x = simdMin(simdMax(x, simdSet(-126.0f)), simdSet(127.0f));
+	const SimdFloat linear = simdIntBitsToFloat(simdMul(simdAdd(x, simdSet(127.0f)), simdSet(8388608.0f)));
+	const SimdFloat f = simdMantissaFraction(linear);
+	SimdFloat p = simdSet(-0.039234799f);
+	p = simdAdd(simdMul(p, f), simdSet(0.13542081f));
+	p = simdAdd(simdMul(p, f), simdSet(-0.21934276f));
+	p = simdAdd(simdMul(p, f), simdSet(0.23675408f));
+	p = simdAdd(simdMul(p, f), simdSet(-0.30678937f));
+	return simdMul(linear, simdAdd(simdSet(1.0f), simdMul(simdMul(f, simdSub(simdSet(1.0f), f)), p)));
+}
+
+/**
+ * x^y for x >= 0, as 2^(y log2(x)), so the error grows with y, e.g., about 0.1% for y = 50.
+ */
+inline SimdFloat simdPow(SimdFloat x, SimdFloat y)
+{
+	return simdExp2(simdMul(y, simdLog2(x)));
+}
+
+#endif // _Simd_h_
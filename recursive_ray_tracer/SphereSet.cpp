@@ -0,0 +1,376 @@
+/****************************************************************************/
+/* Copyright (c) 2016, Ola Olsson */
+/****************************************************************************/
+#include "SphereSet.h"
+
+#include "Simd.h"
+
+#include <float.h>
+#include <assert.h>
+
+using glm::vec3;
+
+namespace
+{
+	/**
+	 * The ray origin and direction, with each component broadcast to all SIMD lanes.
+	 */
+	struct SimdRay
+	{
+		SimdFloat ox, oy, oz;
+		SimdFloat dx, dy, dz;
+	};
+
+	inline SimdRay makeSimdRay(const Ray &ray)
+	{
+		SimdRay r;
+		r.ox = simdSet(ray.origin.x);
+		r.oy = simdSet(ray.origin.y);
+		r.oz = simdSet(ray.origin.z);
+		r.dx = simdSet(ray.direction.x);
+		r.dy = simdSet(ray.direction.y);
+		r.dz = simdSet(ray.direction.z);
+		return r;
+	}
+
+	/**
+	 * SIMD version of 'intersectRaySphere' (see main.cpp), for 4 (SSE) or 8 (AVX) ray/sphere pairs at once, given the vector from the
+	 * sphere to the ray origin 'm', the ray direction 'd' and the radius. Returns a mask of the lanes that hit, and the times in 't'.
+	 */
+	inline SimdFloat intersectRaySphereSimd(SimdFloat mx, SimdFloat my, SimdFloat mz, SimdFloat dx, SimdFloat dy, SimdFloat dz, SimdFloat r, SimdFloat &t)
+	{
+		const SimdFloat zero = simdZero();
+
+		SimdFloat b = simdAdd(simdAdd(simdMul(mx, dx), simdMul(my, dy)), simdMul(mz, dz));
+		SimdFloat c = simdSub(simdAdd(simdAdd(simdMul(mx, mx), simdMul(my, my)), simdMul(mz, mz)), simdMul(r, r));
+		SimdFloat discr = simdSub(simdMul(b, b), c);
+
+		// The same early outs as the scalar version become masks: origin outside and pointing away, or negative discriminant.
+		SimdFloat away = simdAnd(simdCmpGt(c, zero), simdCmpGt(b, zero));
+		SimdFloat hit = simdAndNot(simdCmpGe(discr, zero), away);
+
+		// Lanes with a negative discriminant get NaN here, but they are already masked out.
+		t = simdMax(zero, simdSub(simdSub(zero, b), simdSqrt(discr)));
+		return hit;
+	}
+
+	/**
+	 * Tests one ray against the spheres starting at the given pointers, of which the first 'numValid' are used. Returns a bit mask with
+	 * a bit set for each sphere hit before 'tMax', the hit times are stored in 'tOut'.
+	 */
+	inline int intersectRaySpheres(const SimdRay &ray, const float *centreX, const float *centreY, const float *centreZ, const float *radius, uint32_t numValid, float tMax, float *tOut)
+	{
+		// vector from sphere to ray
+		SimdFloat mx = simdSub(ray.ox, simdLoad(centreX));
+		SimdFloat my = simdSub(ray.oy, simdLoad(centreY));
+		SimdFloat mz = simdSub(ray.oz, simdLoad(centreZ));
+
+		SimdFloat t;
+		SimdFloat hit = intersectRaySphereSimd(mx, my, mz, ray.dx, ray.dy, ray.dz, simdLoad(radius), t);
+		hit = simdAnd(hit, simdCmpLt(t, simdSet(tMax)));
+		hit = simdAnd(hit, simdCmpLt(simdLaneIndex(), simdSet(float(numValid))));
+
+		simdStore(tOut, t);
+		return simdMoveMask(hit);
+	}
+
+	/**
+	 * Tests the rays in one SIMD group of the packet against one sphere, only the lanes in 'laneMask' are used. The closest hit times
+	 * in the packet are updated and the lane bits for the rays that got a new closest hit are returned.
+	 */
+	inline int intersectRayPacketSphere(RayPacket &packet, int group, SimdFloat laneMask, const vec3 &centre, float radius)
+	{
+		const int o = group * g_simdWidth;
+		SimdFloat mx = simdSub(simdLoad(packet.originX + o), simdSet(centre.x));
+		SimdFloat my = simdSub(simdLoad(packet.originY + o), simdSet(centre.y));
+		SimdFloat mz = simdSub(simdLoad(packet.originZ + o), simdSet(centre.z));
+		SimdFloat tMax = simdLoad(packet.tMax + o);
+
+		SimdFloat t;
+		SimdFloat hit = intersectRaySphereSimd(mx, my, mz, simdLoad(packet.directionX + o), simdLoad(packet.directionY + o), simdLoad(packet.directionZ + o), simdSet(radius), t);
+		hit = simdAnd(simdAnd(hit, laneMask), simdCmpLt(t, tMax));
+
+		simdStore(packet.tMax + o, simdSelect(hit, t, tMax));
+		return simdMoveMask(hit);
+	}
+};
+
+
+
+uint32_t SphereSet::addMaterial(const Material &material)
+{
+	assert(!m_usesExternalData);
+	m_materials.push_back(material);
+	m_data.materials = m_materials.data();
+	m_data.numMaterials = m_materials.size();
+	return uint32_t(m_materials.size() - 1);
+}
+
+
+
+void SphereSet::addSphere(const vec3 &centre, float radius, uint32_t materialId)
+{
+	assert(materialId < m_materials.size());
+	assert(!m_usesExternalData);
+	removePadding();
+
+	m_centreX.push_back(centre.x);
+	m_centreY.push_back(centre.y);
+	m_centreZ.push_back(centre.z);
+	m_radius.push_back(radius);
+	m_materialIds.push_back(materialId);
+	++m_numSpheres;
+
+	// The BVH no longer matches.
+	m_bvh.clear();
+}
+
+
+
+void SphereSet::build(Bvh::NodeFormat nodeFormat)
+{
+	removePadding();
+
+	// 1. Build the BVH with leaves of at most one SIMD width, since these cost the same to test as a single sphere.
+	std::vector<Aabb> aabbs(m_numSpheres);
+	for (size_t i = 0; i < m_numSpheres; ++i)
+	{
+		aabbs[i] = make_aabb(vec3(m_centreX[i], m_centreY[i], m_centreZ[i]), m_radius[i]);
+	}
+	m_bvh.build(aabbs, s_simdWidth, s_simdWidth, nodeFormat);
+
+	// 2. Store the spheres in the order they are referenced by the BVH leaves.
+	const uint32_t *order = m_bvh.getPrimitiveIndices();
+	std::vector<float> centreX(m_numSpheres + s_simdWidth, 0.0f);
+	std::vector<float> centreY(m_numSpheres + s_simdWidth, 0.0f);
+	std::vector<float> centreZ(m_numSpheres + s_simdWidth, 0.0f);
+	std::vector<float> radius(m_numSpheres + s_simdWidth, 0.0f);
+	std::vector<uint32_t> materialIds(m_numSpheres + s_simdWidth, 0);
+	for (size_t i = 0; i < m_numSpheres; ++i)
+	{
+		const size_t src = order[i];
+		centreX[i] = m_centreX[src];
+		centreY[i] = m_centreY[src];
+		centreZ[i] = m_centreZ[src];
+		radius[i] = m_radius[src];
+		materialIds[i] = m_materialIds[src];
+	}
+	m_centreX.swap(centreX);
+	m_centreY.swap(centreY);
+	m_centreZ.swap(centreZ);
+	m_radius.swap(radius);
+	m_materialIds.swap(materialIds);
+	m_padded = true;
+
+	m_bvh.resetPrimitiveOrder();
+
+	m_data.numSpheres = m_numSpheres;
+	m_data.centreX = m_centreX.data();
+	m_data.centreY = m_centreY.data();
+	m_data.centreZ = m_centreZ.data();
+	m_data.radius = m_radius.data();
+	m_data.materialIds = m_materialIds.data();
+	m_data.materials = m_materials.data();
+	m_data.numMaterials = m_materials.size();
+}
+
+
+
+void SphereSet::useData(const Data &data, const Bvh::Data &bvhData)
+{
+	assert(bvhData.numPrimitives == data.numSpheres);
+	m_centreX.clear();
+	m_centreY.clear();
+	m_centreZ.clear();
+	m_radius.clear();
+	m_materialIds.clear();
+	m_materials.clear();
+	m_numSpheres = data.numSpheres;
+	m_padded = false;
+	m_bvh.useData(bvhData);
+	m_data = data;
+	m_usesExternalData = true;
+}
+
+
+
+HitInfo SphereSet::intersect(const Ray &ray)
+{
+	assert(m_bvh.getNumPrimitives() == m_numSpheres);
+
+	HitInfo hit;
+	uint32_t bestSphere = 0;
+
+	const SimdRay simdRay = makeSimdRay(ray);
+	BvhRay bvhRay = makeBvhRay(ray.origin, ray.direction);
+	float tMax = hit.time;
+	m_bvh.traverseLeaves(bvhRay, tMax, [&](uint32_t firstSphere, uint32_t count, float &closestTime) -> bool
+	{
+		for (uint32_t i = firstSphere; i < firstSphere + count; i += s_simdWidth)
+		{
+			COUNTER_ADD(primitiveTests, std::min(uint32_t(s_simdWidth), firstSphere + count - i));
+			float t[s_simdWidth];
+			int hitMask = intersectRaySpheres(simdRay, m_data.centreX + i, m_data.centreY + i, m_data.centreZ + i, m_data.radius + i, firstSphere + count - i, closestTime, t);
+			// Usually at most one lane hits, so just loop over the set bits to find the closest.
+			for (int lane = 0; hitMask != 0; ++lane, hitMask >>= 1)
+			{
+				if ((hitMask & 1) && t[lane] < closestTime)
+				{
+					closestTime = t[lane];
+					bestSphere = i + lane;
+				}
+			}
+		}
+		return false;
+	});
+
+	if (tMax < hit.time)
+	{
+		// Only calculate the hit attributes for the closest hit.
+		vec3 centre = vec3(m_data.centreX[bestSphere], m_data.centreY[bestSphere], m_data.centreZ[bestSphere]);
+		hit.object = this;
+		hit.material = &m_data.materials[m_data.materialIds[bestSphere]];
+		hit.time = tMax;
+		hit.position = ray.origin + ray.direction * tMax;
+		hit.normal = normalize(hit.position - centre);
+	}
+	return hit;
+}
+
+
+
+bool SphereSet::occludes(const Ray &ray, float maxDistance)
+{
+	uint32_t sphere;
+	return findOccluder(ray, maxDistance, sphere);
+}
+
+
+
+bool SphereSet::findOccluder(const Ray &ray, float maxDistance, uint32_t &primitive)
+{
+	assert(m_bvh.getNumPrimitives() == m_numSpheres);
+
+	const SimdRay simdRay = makeSimdRay(ray);
+	BvhRay bvhRay = makeBvhRay(ray.origin, ray.direction);
+	return m_bvh.traverseLeavesAny(bvhRay, maxDistance, [&](uint32_t firstSphere, uint32_t count) -> bool
+	{
+		for (uint32_t i = firstSphere; i < firstSphere + count; i += s_simdWidth)
+		{
+			COUNTER_ADD(primitiveTests, std::min(uint32_t(s_simdWidth), firstSphere + count - i));
+			float t[s_simdWidth];
+			int hitMask = intersectRaySpheres(simdRay, m_data.centreX + i, m_data.centreY + i, m_data.centreZ + i, m_data.radius + i, firstSphere + count - i, maxDistance, t);
+			if (hitMask != 0)
+			{
+				// Any of the spheres hit will do, take the first.
+				primitive = i;
+				for (; (hitMask & 1) == 0; hitMask >>= 1)
+				{
+					++primitive;
+				}
+				return true;
+			}
+		}
+		return false;
+	});
+}
+
+
+
+bool SphereSet::occludesPrimitive(const Ray &ray, float maxDistance, uint32_t primitive)
+{
+	if (primitive >= m_numSpheres)
+	{
+		return false;
+	}
+	COUNTER_ADD(primitiveTests, 1);
+	// The same test as 'intersectRaySphereSimd', for one sphere.
+	const vec3 m = ray.origin - vec3(m_data.centreX[primitive], m_data.centreY[primitive], m_data.centreZ[primitive]);
+	const float b = dot(m, ray.direction);
+	const float c = dot(m, m) - m_data.radius[primitive] * m_data.radius[primitive];
+	const float discr = b * b - c;
+	if (discr < 0.0f || (c > 0.0f && b > 0.0f))
+	{
+		return false;
+	}
+	return std::max(0.0f, -b - sqrtf(discr)) < maxDistance;
+}
+
+
+
+void SphereSet::intersectPacket(RayPacket &packet, PacketMask activeMask, HitInfo *hits)
+{
+	assert(m_bvh.getNumPrimitives() == m_numSpheres);
+
+	// Sphere with the closest hit for each ray, if it hit anything in this set.
+	uint32_t bestSphere[RayPacket::s_size];
+	PacketMask hitMask = 0;
+
+	m_bvh.traversePacket(packet, activeMask, [&](uint32_t firstSphere, uint32_t count, PacketMask mask)
+	{
+		for (uint32_t i = firstSphere; i < firstSphere + count; ++i)
+		{
+			const vec3 centre = vec3(m_data.centreX[i], m_data.centreY[i], m_data.centreZ[i]);
+			for (int g = 0; g < RayPacket::s_numSimdGroups; ++g)
+			{
+				const int groupBits = int(mask >> (g * g_simdWidth)) & g_simdLaneBits;
+				if (groupBits == 0)
+				{
+					continue;
+				}
+				COUNTER_ADD(primitiveTests, countBits(groupBits));
+				const int o = g * g_simdWidth;
+				int closerBits = intersectRayPacketSphere(packet, g, simdMaskFromBits(groupBits), centre, m_data.radius[i]);
+				for (int lane = 0; closerBits != 0; ++lane, closerBits >>= 1)
+				{
+					if (closerBits & 1)
+					{
+						bestSphere[o + lane] = i;
+						hitMask |= PacketMask(1) << (o + lane);
+					}
+				}
+			}
+		}
+	});
+
+	// Only calculate the hit attributes for the rays where this set had the closest hit.
+	for (int lane = 0; lane < RayPacket::s_size; ++lane)
+	{
+		if ((hitMask >> lane) & 1)
+		{
+			const uint32_t s = bestSphere[lane];
+			HitInfo &hit = hits[lane];
+			hit.object = this;
+			hit.material = &m_data.materials[m_data.materialIds[s]];
+			hit.time = packet.tMax[lane];
+			hit.position = packet.getOrigin(lane) + packet.getDirection(lane) * hit.time;
+			hit.normal = normalize(hit.position - vec3(m_data.centreX[s], m_data.centreY[s], m_data.centreZ[s]));
+		}
+	}
+}
+
+
+
+Aabb SphereSet::getAabb() const
+{
+	if (m_bvh.empty())
+	{
+		return make_inverse_extreme_aabb();
+	}
+	return m_bvh.getAabb();
+}
+
+
+
+void SphereSet::removePadding()
+{
+	if (m_padded)
+	{
+		m_centreX.resize(m_numSpheres);
+		m_centreY.resize(m_numSpheres);
+		m_centreZ.resize(m_numSpheres);
+		m_radius.resize(m_numSpheres);
+		m_materialIds.resize(m_numSpheres);
+		m_padded = false;
+	}
+}
@@ -0,0 +1,107 @@
+/****************************************************************************/
+/* Copyright (c) 2016, Ola Olsson */
+/****************************************************************************/
+#ifndef _SphereSet_h_
+#define _SphereSet_h_
+
+#include "Object.h"
+#include "Bvh.h"
+#include "Simd.h"
+
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <stdint.h>
+
+/**
+ * A set of spheres stored as a Structure of Arrays (SoA), i.e., one contiguous array for each of the centre x, y and z, the radius
+ * and the material id. This layout lets us load the same component of several spheres into one SIMD register and test 4 (SSE)
+ * or 8 (AVX) spheres against a ray with each instruction. Compare with the 'Sphere' object in main.cpp which stores one sphere
+ * per object (Array of Structures) and tests one sphere per virtual function call.
+ *
+ * The set builds its own BVH, where the leaves are sized for the SIMD width, and the arrays are reordered so that the spheres in a
+ * leaf are next to each other. Usage: add the materials & spheres, then call 'build' before tracing any rays.
+ */
+class SphereSet : public Object
+{
+public:
+	enum
+	{
+		s_simdWidth = g_simdWidth,
+	};
+
+	/**
+	 * Adds a material, the returned id is used to refer to it when adding spheres.
+	 */
+	uint32_t addMaterial(const Material &material);
+
+	/**
+	 * Adds a sphere, the set must be (re-)built before it is used.
+	 */
+	void addSphere(const glm::vec3 &centre, float radius, uint32_t materialId);
+
+	/**
+	 * Builds the BVH and reorders the sphere data to match, 'nodeFormat' selects how the BVH nodes are stored, see Bvh::build.
+	 */
+	void build(Bvh::NodeFormat nodeFormat = Bvh::NF_Float);
+
+	/**
+	 * The arrays used for tracing, in the order of the BVH leaves, as stored in a scene file (see SceneFile.h). The sphere arrays have
+	 * at least s_simdWidth spheres of padding after the 'numSpheres' spheres.
+	 */
+	struct Data
+	{
+		size_t numSpheres;
+		const float *centreX;
+		const float *centreY;
+		const float *centreZ;
+		const float *radius;
+		const uint32_t *materialIds;
+		const Material *materials;
+		size_t numMaterials;
+	};
+
+	/**
+	 * Returns the arrays of a built set, which are valid until the set is changed.
+	 */
+	Data getData() const { return m_data; }
+
+	/**
+	 * Uses spheres and a BVH stored elsewhere in place, e.g., in a memory mapped scene file, instead of building the set. Nothing is
+	 * copied, so the data must stay valid and unchanged as long as the set is used, and no spheres can be added.
+	 */
+	void useData(const Data &data, const Bvh::Data &bvhData);
+
+	virtual HitInfo intersect(const Ray &ray) override;
+	virtual bool occludes(const Ray &ray, float maxDistance) override;
+	virtual bool findOccluder(const Ray &ray, float maxDistance, uint32_t &primitive) override;
+	virtual bool occludesPrimitive(const Ray &ray, float maxDistance, uint32_t primitive) override;
+	virtual void intersectPacket(RayPacket &packet, PacketMask activeMask, HitInfo *hits) override;
+	virtual Aabb getAabb() const override;
+
+	size_t getNumSpheres() const { return m_numSpheres; }
+	const Bvh &getBvh() const { return m_bvh; }
+
+protected:
+	// Removes the padding added by 'build', so that new spheres are added at the end.
+	void removePadding();
+
+	// The arrays are padded with s_simdWidth spheres at the end, so that a SIMD load starting at any sphere never reads
+	// outside the arrays. The lanes past the end of the leaf are masked out.
+	std::vector<float> m_centreX;
+	std::vector<float> m_centreY;
+	std::vector<float> m_centreZ;
+	std::vector<float> m_radius;
+	std::vector<uint32_t> m_materialIds;
+	size_t m_numSpheres = 0;
+	bool m_padded = false;
+
+	std::vector<Material> m_materials;
+	Bvh m_bvh;
+
+	// What is traced, points to the arrays above after 'build', or the data given to 'useData'.
+	Data m_data = {};
+	bool m_usesExternalData = false;
+};
+
+#endif // _SphereSet_h_
@@ -0,0 +1,154 @@
+/****************************************************************************/
+/* Copyright (c) 2016, Ola Olsson */
+/****************************************************************************/
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <assert.h>
+
+
+ThreadPool::ThreadPool(int numThreads)
+	: m_batch(0)
+	, m_numBusy(0)
+	, m_quit(false)
+	, m_taskFn(nullptr)
+	, m_numSteals(0)
+{
+	if (numThreads <= 0)
+	{
+		// May return 0 if it cannot be determined.
+		numThreads = std::max(1, int(std::thread::hardware_concurrency()));
+	}
+
+	for (int i = 0; i < numThreads; ++i)
+	{
+		m_queues.emplace_back(new TaskRange);
+		m_queues.back()->begin = 0;
+		m_queues.back()->end = 0;
+	}
+	// Thread 0 is whoever calls 'parallelFor'.
+	for (int i = 1; i < numThreads; ++i)
+	{
+		m_threads.emplace_back(&ThreadPool::workerMain, this, i);
+	}
+}
+
+
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_quit = true;
+	}
+	m_startCondition.notify_all();
+	for (std::thread &t : m_threads)
+	{
+		t.join();
+	}
+}
+
+
+
+void ThreadPool::parallelFor(int numTasks, const std::function<void(int, int)> &taskFn)
+{
+	const int numThreads = getNumThreads();
+
+	// 1. Hand out a contiguous range to each thread, since neighbouring tasks (e.g., tiles) are likely to touch the same data.
+	for (int i = 0; i < numThreads; ++i)
+	{
+		std::lock_guard<std::mutex> lock(m_queues[i]->mutex);
+		m_queues[i]->begin = int(int64_t(numTasks) * i / numThreads);
+		m_queues[i]->end = int(int64_t(numTasks) * (i + 1) / numThreads);
+	}
+	m_numSteals = 0;
+
+	// 2. Wake the workers and pitch in.
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_taskFn = &taskFn;
+		m_numBusy = numThreads - 1;
+		++m_batch;
+	}
+	m_startCondition.notify_all();
+
+	runTasks(0);
+
+	// 3. Wait for the workers to finish their last tasks.
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_doneCondition.wait(lock, [this]() { return m_numBusy == 0; });
+	m_taskFn = nullptr;
+}
+
+
+
+void ThreadPool::workerMain(int threadIndex)
+{
+	uint64_t lastBatch = 0;
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_startCondition.wait(lock, [&]() { return m_quit || m_batch != lastBatch; });
+			if (m_quit)
+			{
+				return;
+			}
+			lastBatch = m_batch;
+		}
+
+		runTasks(threadIndex);
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			--m_numBusy;
+		}
+		m_doneCondition.notify_one();
+	}
+}
+
+
+
+void ThreadPool::runTasks(int threadIndex)
+{
+	int task = 0;
+	while (popTask(threadIndex, task) || stealTask(threadIndex, task))
+	{
+		(*m_taskFn)(task, threadIndex);
+	}
+}
+
+
+
+bool ThreadPool::popTask(int threadIndex, int &task)
+{
+	TaskRange &q = *m_queues[threadIndex];
+	std::lock_guard<std::mutex> lock(q.mutex);
+	if (q.begin < q.end)
+	{
+		task = q.begin++;
+		return true;
+	}
+	return false;
+}
+
+
+
+bool ThreadPool::stealTask(int threadIndex, int &task)
+{
+	// Try the other threads in turn, starting with the next one so that the thieves do not all go for the same victim.
+	const int numThreads = getNumThreads();
+	for (int i = 1; i < numThreads; ++i)
+	{
+		TaskRange &q = *m_queues[(threadIndex + i) % numThreads];
+		std::lock_guard<std::mutex> lock(q.mutex);
+		if (q.begin < q.end)
+		{
+			// Take from the back, away from where the owner is working.
+			task = --q.end;
+			++m_numSteals;
+			return true;
+		}
+	}
+	return false;
+}
@@ -0,0 +1,78 @@
+/****************************************************************************/
+/* Copyright (c) 2016, Ola Olsson */
+/****************************************************************************/
+#ifndef _ThreadPool_h_
+#define _ThreadPool_h_
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+
+/**
+ * A pool of worker threads that runs a batch of independent tasks (e.g., the tiles of an image) using work stealing. Each thread
+ * starts out with its own contiguous range of tasks, which it works through from the front. When a thread runs out, it steals tasks
+ * from the back of the other threads' ranges. This means the load is balanced even if the tasks have very different cost (e.g.,
+ * tiles covering reflective objects), while the threads mostly work on neighbouring tasks without touching any shared state.
+ *
+ * The threads are created once and then wait for work, so there is no cost for starting threads for every batch.
+ */
+class ThreadPool
+{
+public:
+	/**
+	 * Creates a pool with 'numThreads' threads in total, including the thread calling 'parallelFor'. If 'numThreads' is 0 (or less)
+	 * it uses one thread per hardware thread.
+	 */
+	explicit ThreadPool(int numThreads = 0);
+	~ThreadPool();
+
+	/**
+	 * Calls 'taskFn(taskIndex, threadIndex)' for each task index in [0, numTasks), spread over the threads, and returns when all tasks
+	 * are done. The calling thread also runs tasks, as thread 0. The thread index can be used to index per-thread data.
+	 */
+	void parallelFor(int numTasks, const std::function<void(int, int)> &taskFn);
+
+	int getNumThreads() const { return int(m_queues.size()); }
+
+	/**
+	 * Returns the number of tasks that were stolen during the last 'parallelFor', useful to see how unbalanced the work was.
+	 */
+	int getNumSteals() const { return m_numSteals; }
+
+protected:
+	/**
+	 * The tasks of one thread, the owner takes tasks from the front ('begin') and thieves from the back ('end').
+	 */
+	struct TaskRange
+	{
+		std::mutex mutex;
+		int begin;
+		int end;
+	};
+
+	void workerMain(int threadIndex);
+	// Runs tasks until there are none left in any of the queues.
+	void runTasks(int threadIndex);
+	bool popTask(int threadIndex, int &task);
+	bool stealTask(int threadIndex, int &task);
+
+	std::vector<std::unique_ptr<TaskRange>> m_queues;
+	std::vector<std::thread> m_threads;
+
+	std::mutex m_mutex;
+	std::condition_variable m_startCondition;
+	std::condition_variable m_doneCondition;
+	// Incremented for each 'parallelFor', so the workers can tell that there is a new batch.
+	uint64_t m_batch;
+	int m_numBusy;
+	bool m_quit;
+	const std::function<void(int, int)> *m_taskFn;
+	std::atomic<int> m_numSteals;
+};
+
+#endif // _ThreadPool_h_
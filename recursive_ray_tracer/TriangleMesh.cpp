@@ -0,0 +1,314 @@
+/****************************************************************************/
+/* Copyright (c) 2016, Ola Olsson */
+/****************************************************************************/
+#include "TriangleMesh.h"
+#include "Simd.h"
+
+#include <map>
+#include <assert.h>
+
+using glm::vec3;
+
+namespace
+{
+	/**
+	 * SIMD version of 'intersectRayTriangle', tests the rays in one SIMD group of the packet against one triangle, only the lanes in
+	 * 'laneMask' are used. Returns the mask of the lanes hit closer than 'packet.tMax', and the hit time and barycentrics in 't', 'u' & 'v'.
+	 */
+	inline SimdFloat intersectRayPacketTriangle(const RayPacket &packet, int group, SimdFloat laneMask, const vec3 &v0, const vec3 &e1, const vec3 &e2, SimdFloat &t, SimdFloat &u, SimdFloat &v)
+	{
+		const int o = group * g_simdWidth;
+		const SimdFloat zero = simdZero();
+		const SimdFloat one = simdSet(1.0f);
+		const SimdFloat dx = simdLoad(packet.directionX + o);
+		const SimdFloat dy = simdLoad(packet.directionY + o);
+		const SimdFloat dz = simdLoad(packet.directionZ + o);
+		const SimdFloat e1x = simdSet(e1.x), e1y = simdSet(e1.y), e1z = simdSet(e1.z);
+		const SimdFloat e2x = simdSet(e2.x), e2y = simdSet(e2.y), e2z = simdSet(e2.z);
+
+		// p = cross(rayD, e2)
+		SimdFloat px = simdSub(simdMul(dy, e2z), simdMul(dz, e2y));
+		SimdFloat py = simdSub(simdMul(dz, e2x), simdMul(dx, e2z));
+		SimdFloat pz = simdSub(simdMul(dx, e2y), simdMul(dy, e2x));
+		SimdFloat det = simdAdd(simdAdd(simdMul(e1x, px), simdMul(e1y, py)), simdMul(e1z, pz));
+		SimdFloat hit = simdAnd(laneMask, simdOr(simdCmpGt(det, simdSet(1e-12f)), simdCmpLt(det, simdSet(-1e-12f))));
+		SimdFloat invDet = simdDiv(one, det);
+
+		// s = rayO - v0
+		SimdFloat sx = simdSub(simdLoad(packet.originX + o), simdSet(v0.x));
+		SimdFloat sy = simdSub(simdLoad(packet.originY + o), simdSet(v0.y));
+		SimdFloat sz = simdSub(simdLoad(packet.originZ + o), simdSet(v0.z));
+		u = simdMul(simdAdd(simdAdd(simdMul(sx, px), simdMul(sy, py)), simdMul(sz, pz)), invDet);
+
+		// q = cross(s, e1)
+		SimdFloat qx = simdSub(simdMul(sy, e1z), simdMul(sz, e1y));
+		SimdFloat qy = simdSub(simdMul(sz, e1x), simdMul(sx, e1z));
+		SimdFloat qz = simdSub(simdMul(sx, e1y), simdMul(sy, e1x));
+		v = simdMul(simdAdd(simdAdd(simdMul(dx, qx), simdMul(dy, qy)), simdMul(dz, qz)), invDet);
+		t = simdMul(simdAdd(simdAdd(simdMul(e2x, qx), simdMul(e2y, qy)), simdMul(e2z, qz)), invDet);
+
+		hit = simdAnd(hit, simdAnd(simdCmpGe(u, zero), simdCmpGe(v, zero)));
+		hit = simdAnd(hit, simdCmpLe(simdAdd(u, v), one));
+		hit = simdAnd(hit, simdAnd(simdCmpGt(t, zero), simdCmpLt(t, simdLoad(packet.tMax + o))));
+		return hit;
+	}
+};
+
+
+
+TriangleMesh::TriangleMesh(const std::vector<vec3> &positions, const std::vector<vec3> &normals, const std::vector<OBJModel::Chunk> &chunks, float reflectivity, Bvh::NodeFormat nodeFormat)
+{
+	assert(positions.size() % 3 == 0);
+	const size_t numTris = positions.size() / 3;
+	const bool hasNormals = normals.size() == positions.size();
+
+	// 1. Convert the materials, several chunks may share the same material.
+	std::vector<uint32_t> materialIndices(numTris, 0);
+	std::map<const OBJModel::Material*, uint32_t> materialMap;
+	for (const OBJModel::Chunk &chunk : chunks)
+	{
+		if (materialMap.find(chunk.material) == materialMap.end())
+		{
+			Material m;
+			m.diffuseReflectance = chunk.material->color.diffuse;
+			m.shininess = chunk.material->specularExponent;
+			m.baseSpecularReflectance = chunk.material->color.specular;
+			m.reflectivity = reflectivity;
+			materialMap[chunk.material] = uint32_t(m_materials.size());
+			m_materials.push_back(m);
+		}
+		uint32_t materialIndex = materialMap[chunk.material];
+		for (uint32_t i = chunk.offset / 3; i < (chunk.offset + chunk.count) / 3; ++i)
+		{
+			materialIndices[i] = materialIndex;
+		}
+	}
+	// Triangles not in any chunk get a plain grey material.
+	if (m_materials.empty())
+	{
+		Material m = { vec3(0.5f), 0.0f, vec3(0.0f), reflectivity };
+		m_materials.push_back(m);
+	}
+
+	// 2. Build the BVH over the triangle bounds.
+	std::vector<Aabb> aabbs(numTris);
+	for (size_t i = 0; i < numTris; ++i)
+	{
+		aabbs[i] = make_aabb(&positions[i * 3], 3);
+	}
+	m_bvh.build(aabbs, Bvh::s_maxLeafSize, 1, nodeFormat);
+
+	// 3. Store the triangles in the order they are referenced by the BVH leaves.
+	const uint32_t *order = m_bvh.getPrimitiveIndices();
+	m_triangles.resize(numTris);
+	m_normals.resize(numTris * 3);
+	m_materialIndices.resize(numTris);
+	for (size_t i = 0; i < numTris; ++i)
+	{
+		const size_t src = order[i];
+		const vec3 *p = &positions[src * 3];
+		m_triangles[i].v0 = p[0];
+		m_triangles[i].e1 = p[1] - p[0];
+		m_triangles[i].e2 = p[2] - p[0];
+
+		for (int j = 0; j < 3; ++j)
+		{
+			m_normals[i * 3 + j] = hasNormals ? normals[src * 3 + j] : normalize(cross(m_triangles[i].e1, m_triangles[i].e2));
+		}
+		m_materialIndices[i] = materialIndices[src];
+	}
+	m_bvh.resetPrimitiveOrder();
+
+	m_data.numTriangles = numTris;
+	m_data.triangles = m_triangles.data();
+	m_data.normals = m_normals.data();
+	m_data.materialIndices = m_materialIndices.data();
+	m_data.materials = m_materials.data();
+	m_data.numMaterials = m_materials.size();
+}
+
+
+
+TriangleMesh::TriangleMesh(const Data &data, const Bvh::Data &bvhData)
+	: m_data(data)
+{
+	assert(bvhData.numPrimitives == data.numTriangles);
+	m_bvh.useData(bvhData);
+}
+
+
+
+HitInfo TriangleMesh::intersect(const Ray &ray)
+{
+	HitInfo hit;
+
+	uint32_t bestTri = 0;
+	float bestU = 0.0f;
+	float bestV = 0.0f;
+
+	BvhRay bvhRay = makeBvhRay(ray.origin, ray.direction);
+	float tMax = hit.time;
+	m_bvh.traverse(bvhRay, tMax, [&](uint32_t triIndex, float &closestTime) -> bool
+	{
+		COUNTER_ADD(primitiveTests, 1);
+		const Triangle &tri = m_data.triangles[triIndex];
+		float t, u, v;
+		if (intersectRayTriangle(ray.origin, ray.direction, tri.v0, tri.e1, tri.e2, closestTime, t, u, v))
+		{
+			closestTime = t;
+			bestTri = triIndex;
+			bestU = u;
+			bestV = v;
+		}
+		return false;
+	});
+
+	if (tMax < hit.time)
+	{
+		// Only calculate the hit attributes for the closest hit.
+		hit.object = this;
+		hit.material = &m_data.materials[m_data.materialIndices[bestTri]];
+		hit.time = tMax;
+		hit.position = ray.origin + ray.direction * tMax;
+
+		const vec3 *n = &m_data.normals[bestTri * 3];
+		hit.normal = normalize(n[0] * (1.0f - bestU - bestV) + n[1] * bestU + n[2] * bestV);
+
+		// The triangles are two-sided, flip the normal to face the ray if it hit the back (use the geometric normal
+		// to decide since interpolated normals may be quite different).
+		const Triangle &tri = m_data.triangles[bestTri];
+		if (dot(cross(tri.e1, tri.e2), ray.direction) > 0.0f)
+		{
+			hit.normal = -hit.normal;
+		}
+	}
+	return hit;
+}
+
+
+
+bool TriangleMesh::occludes(const Ray &ray, float maxDistance)
+{
+	uint32_t triIndex;
+	return findOccluder(ray, maxDistance, triIndex);
+}
+
+
+
+bool TriangleMesh::findOccluder(const Ray &ray, float maxDistance, uint32_t &primitive)
+{
+	BvhRay bvhRay = makeBvhRay(ray.origin, ray.direction);
+	return m_bvh.traverseAny(bvhRay, maxDistance, [&](uint32_t triIndex) -> bool
+	{
+		COUNTER_ADD(primitiveTests, 1);
+		const Triangle &tri = m_data.triangles[triIndex];
+		float t, u, v;
+		primitive = triIndex;
+		return intersectRayTriangle(ray.origin, ray.direction, tri.v0, tri.e1, tri.e2, maxDistance, t, u, v);
+	});
+}
+
+
+
+bool TriangleMesh::occludesPrimitive(const Ray &ray, float maxDistance, uint32_t primitive)
+{
+	if (primitive >= m_data.numTriangles)
+	{
+		return false;
+	}
+	COUNTER_ADD(primitiveTests, 1);
+	const Triangle &tri = m_data.triangles[primitive];
+	float t, u, v;
+	return intersectRayTriangle(ray.origin, ray.direction, tri.v0, tri.e1, tri.e2, maxDistance, t, u, v);
+}
+
+
+
+void TriangleMesh::intersectPacket(RayPacket &packet, PacketMask activeMask, HitInfo *hits)
+{
+	uint32_t bestTri[RayPacket::s_size];
+	float bestU[RayPacket::s_size];
+	float bestV[RayPacket::s_size];
+	PacketMask hitMask = 0;
+
+	m_bvh.traversePacket(packet, activeMask, [&](uint32_t firstTri, uint32_t count, PacketMask mask)
+	{
+		for (uint32_t i = firstTri; i < firstTri + count; ++i)
+		{
+			const Triangle &tri = m_data.triangles[i];
+			for (int g = 0; g < RayPacket::s_numSimdGroups; ++g)
+			{
+				const int groupBits = int(mask >> (g * g_simdWidth)) & g_simdLaneBits;
+				if (groupBits == 0)
+				{
+					continue;
+				}
+				COUNTER_ADD(primitiveTests, countBits(groupBits));
+				const int o = g * g_simdWidth;
+				SimdFloat t, u, v;
+				SimdFloat hit = intersectRayPacketTriangle(packet, g, simdMaskFromBits(groupBits), tri.v0, tri.e1, tri.e2, t, u, v);
+				int closerBits = simdMoveMask(hit);
+				if (closerBits == 0)
+				{
+					continue;
+				}
+				simdStore(packet.tMax + o, simdSelect(hit, t, simdLoad(packet.tMax + o)));
+				float uLanes[g_simdWidth];
+				float vLanes[g_simdWidth];
+				simdStore(uLanes, u);
+				simdStore(vLanes, v);
+				for (int lane = 0; closerBits != 0; ++lane, closerBits >>= 1)
+				{
+					if (closerBits & 1)
+					{
+						bestTri[o + lane] = i;
+						bestU[o + lane] = uLanes[lane];
+						bestV[o + lane] = vLanes[lane];
+						hitMask |= PacketMask(1) << (o + lane);
+					}
+				}
+			}
+		}
+	});
+
+	// Only calculate the hit attributes for the rays where this mesh had the closest hit, as in 'intersect'.
+	for (int lane = 0; lane < RayPacket::s_size; ++lane)
+	{
+		if ((hitMask >> lane) & 1)
+		{
+			const uint32_t triIndex = bestTri[lane];
+			const vec3 rayD = packet.getDirection(lane);
+			HitInfo &hit = hits[lane];
+			hit.object = this;
+			hit.material = &m_data.materials[m_data.materialIndices[triIndex]];
+			hit.time = packet.tMax[lane];
+			hit.position = packet.getOrigin(lane) + rayD * hit.time;
+
+			const vec3 *n = &m_data.normals[triIndex * 3];
+			hit.normal = normalize(n[0] * (1.0f - bestU[lane] - bestV[lane]) + n[1] * bestU[lane] + n[2] * bestV[lane]);
+			const Triangle &tri = m_data.triangles[triIndex];
+			if (dot(cross(tri.e1, tri.e2), rayD) > 0.0f)
+			{
+				hit.normal = -hit.normal;
+			}
+		}
+	}
+}
+
+
+
+Aabb TriangleMesh::getAabb() const
+{
+	if (m_bvh.empty())
+	{
+		return make_inverse_extreme_aabb();
+	}
+	return m_bvh.getAabb();
+}
+
+
+
+TriangleMesh *makeTriangleMesh(const OBJModel &model, float reflectivity, Bvh::NodeFormat nodeFormat)
+{
+	return new TriangleMesh(model.m_positions, model.m_normals, model.m_chunks, reflectivity, nodeFormat);
+}
@@ -0,0 +1,122 @@
+/****************************************************************************/
+/* Copyright (c) 2016, Ola Olsson */
+/****************************************************************************/
+#ifndef _TriangleMesh_h_
+#define _TriangleMesh_h_
+
+#include "Object.h"
+#include "Bvh.h"
+
+// Note: the ray tracer is built with OBJ_MODEL_NO_GL defined, so the OBJ model can be loaded without a GL context.
+#include "../rasterizer_with_obj_loader/OBJModel.h"
+
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <stdint.h>
+#include <math.h>
+
+/**
+ * Moller-Trumbore ray/triangle intersection, the triangle is given as one vertex and the two edges from it.
+ * Returns true if the ray hits the triangle in the interval (0, tMax), 'u' and 'v' are the barycentric
+ * coordinates of the hit point (i.e., the weights of the second and third vertex).
+ */
+inline bool intersectRayTriangle(const glm::vec3 &rayO, const glm::vec3 &rayD, const glm::vec3 &v0, const glm::vec3 &e1, const glm::vec3 &e2, float tMax, float &t, float &u, float &v)
+{
+	glm::vec3 p = cross(rayD, e2);
+	float det = dot(e1, p);
+	// Ray parallel to the triangle plane (this test also works for back facing triangles, which we want to hit too).
+	if (fabsf(det) < 1e-12f)
+	{
+		return false;
+	}
+	float invDet = 1.0f / det;
+
+	glm::vec3 s = rayO - v0;
+	u = dot(s, p) * invDet;
+	if (u < 0.0f || u > 1.0f)
+	{
+		return false;
+	}
+	glm::vec3 q = cross(s, e1);
+	v = dot(rayD, q) * invDet;
+	if (v < 0.0f || u + v > 1.0f)
+	{
+		return false;
+	}
+	t = dot(e2, q) * invDet;
+	return t > 0.0f && t < tMax;
+}
+
+
+/**
+ * Triangle mesh object, built from the non-indexed triangle data loaded by OBJModel (every three consecutive positions form a triangle).
+ * The mesh builds its own BVH over the triangles, so the scene BVH only sees one object. The triangle data is reordered to match the
+ * order of the BVH leaves, so the triangles in a leaf are next to each other in memory.
+ */
+class TriangleMesh : public Object
+{
+public:
+	/**
+	 * 'positions' and 'normals' (3 per triangle) are as stored in OBJModel::m_positions/m_normals, and the chunks define what material
+	 * is used for each range of triangles. 'reflectivity' is used for all materials since OBJ materials have no such thing.
+	 * 'nodeFormat' selects how the BVH nodes are stored, see Bvh::build.
+	 */
+	TriangleMesh(const std::vector<glm::vec3> &positions, const std::vector<glm::vec3> &normals, const std::vector<OBJModel::Chunk> &chunks, float reflectivity = 0.0f, Bvh::NodeFormat nodeFormat = Bvh::NF_Float);
+
+	// Precalculated data used for the intersection test, this is all that is touched during traversal.
+	struct Triangle
+	{
+		glm::vec3 v0;
+		glm::vec3 e1;
+		glm::vec3 e2;
+	};
+
+	/**
+	 * The arrays used for tracing, in the order of the BVH leaves, as stored in a scene file (see SceneFile.h).
+	 * There are three normals per triangle.
+	 */
+	struct Data
+	{
+		size_t numTriangles;
+		const Triangle *triangles;
+		const glm::vec3 *normals;
+		const uint32_t *materialIndices;
+		const Material *materials;
+		size_t numMaterials;
+	};
+
+	/**
+	 * Uses triangles and a BVH stored elsewhere in place, e.g., in a memory mapped scene file. Nothing is copied, so the data must
+	 * stay valid and unchanged as long as the mesh is used.
+	 */
+	TriangleMesh(const Data &data, const Bvh::Data &bvhData);
+
+	virtual HitInfo intersect(const Ray &ray) override;
+	virtual bool occludes(const Ray &ray, float maxDistance) override;
+	virtual bool findOccluder(const Ray &ray, float maxDistance, uint32_t &primitive) override;
+	virtual bool occludesPrimitive(const Ray &ray, float maxDistance, uint32_t primitive) override;
+	virtual void intersectPacket(RayPacket &packet, PacketMask activeMask, HitInfo *hits) override;
+	virtual Aabb getAabb() const override;
+
+	size_t getNumTriangles() const { return m_data.numTriangles; }
+	const Bvh &getBvh() const { return m_bvh; }
+	const Data &getData() const { return m_data; }
+
+protected:
+	std::vector<Triangle> m_triangles;
+	// Vertex normals, three per triangle, only accessed to calculate the normal for the closest hit.
+	std::vector<glm::vec3> m_normals;
+	std::vector<uint32_t> m_materialIndices;
+	std::vector<Material> m_materials;
+	Bvh m_bvh;
+	// What is traced, points to the arrays above, or the data given to the constructor.
+	Data m_data;
+};
+
+/**
+ * Helper function to make a triangle mesh from a loaded model.
+ */
+TriangleMesh *makeTriangleMesh(const OBJModel &model, float reflectivity = 0.0f, Bvh::NodeFormat nodeFormat = Bvh::NF_Float);
+
+#endif // _TriangleMesh_h_
@@ -1,16 +1,74 @@
 /****************************************************************************/
 /* Copyright (c) 2016, Ola Olsson */
 /****************************************************************************/
+#include <GL/glew.h>
 #include <GL/freeglut.h>
 
 #include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "Object.h"
+#include "Bvh.h"
+#include "DynamicBvh.h"
+#include "TriangleMesh.h"
+#include "SphereSet.h"
+#include "Instance.h"
+#include "SceneFile.h"
+#include "GBuffer.h"
+#include "Denoiser.h"
+#include "ThreadPool.h"
+#include "FrameBuffer.h"
+#include "Counters.h"
+#include "Simd.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <vector>
 #include <algorithm>
 #include <functional>
+#include <assert.h>
+#include <chrono>
+#include <string>
+#include <fstream>
+#include <random>
+#include <atomic>
 
 #define SIMPLE_SHADING 1
+// When enabled, the spheres in the scene are packed into one SphereSet, which tests several spheres at once using SIMD,
+// instead of being traced as individual Sphere objects. Disable to compare the performance.
+#define USE_SPHERE_SET 1
+// When enabled, the primary rays are traced in packets of RayPacket::s_side x RayPacket::s_side pixels, see 'generatePinHolePrimaryPacket'.
+#define USE_RAY_PACKETS 1
+// When enabled, the reflection rays are not traced recursively from 'shade', instead all the rays for one bounce are gathered in a
+// queue, sorted to make neighbouring rays coherent, and traced and shaded in bulk, one bounce at a time, see 'renderWavefront'.
+// This pays off for large scenes (e.g., an OBJ model), for the default scene everything fits in the cache anyway.
+#define USE_WAVEFRONT 0
+// When enabled, the window shows a coarse image straight away, which is then refined over the following frames, first to full
+// resolution and then with more samples per pixel, see 'renderProgressive'. Each frame only renders for about 'g_progressiveFrameTime',
+// so the window stays responsive however expensive the full image is. When disabled, each frame renders the whole image.
+#define USE_PROGRESSIVE 1
+// When enabled, the BVHs are built with quantized 16 byte nodes (see BvhQuantizedNode) instead of 32 byte float nodes, which halves
+// the memory used by the nodes, at the cost of decoding the child boxes during traversal. This pays off for huge scenes.
+#define USE_QUANTIZED_BVH 0
+// When enabled, the BVHs are collapsed into nodes with eight children (see BvhWideNode), which are tested against a ray all at once using
+// AVX (or SSE), instead of two at a time. Takes precedence over USE_QUANTIZED_BVH.
+#define USE_WIDE_BVH 0
+// When enabled, reflection rays whose path weight has dropped below 'g_minPathWeight' are not all dropped, but survive with a probability
+// proportional to the weight and are then weighted up to make up for those that were dropped (Russian roulette). This keeps the expected
+// colour right, at the price of some noise, whereas just dropping the rays loses a little light. See 'continuePath'.
+#define USE_RUSSIAN_ROULETTE 0
+// When enabled, the first hits of the camera rays are kept between frames, and used instead of tracing the camera rays again as long as
+// the camera and the scene are unchanged, e.g., when only the light is changed between frames, see 'useFirstHitCache'.
+#define USE_FIRST_HIT_CACHE 1
+// When enabled, each thread remembers the primitive that blocked its last shadow ray, and tests it before traversing the BVHs for the
+// next, see 'isRayOccluded'. The hits are counted as 'occluderCacheHits' (see Counters.h).
+#define USE_OCCLUDER_CACHE 1
+// When enabled, the hits of the camera rays of each tile (and with USE_WAVEFRONT, of each bounce) are shaded together, evaluating the
+// shading model for g_simdWidth hits at a time (8 with AVX), instead of calling 'shadeLocal' for each, see 'shadeBatch'. This pays off
+// for the full model (the pow in the specular, a frame takes about 30% less time), with SIMPLE_SHADING the model is only a few
+// multiplies, and gathering the hits costs more than it saves (about 8%), so it is only enabled for the full model.
+#define USE_BATCHED_SHADING (!SIMPLE_SHADING)
 
 // We're using the 2 & 3 dimensional vectors of GLM so alias these type names to 'vec2' and 'vec3'.
 // The type of the elements of these types is 'float' i.e., single precision (32-bit) floating point numbers.
@@ -29,12 +87,50 @@ static vec3 g_viewTarget = { 0.0f, 0.0f, 0.0f };
 static vec3 g_viewUp = { 0.0f, 1.0f, 0.0f };
 
 const int g_maxDepth = 8;
+// Reflection rays are only traced while the product of the reflection weights along the path from the camera (the path weight, or
+// throughput) is at least this in some channel, since anything less is lost in the 8 bits of the output anyway. The sRGB curve is
+// steep near black (a step is about 1/3300 in linear), so the limit is lower than 1/256. Pure mirrors keep the weight up, so
+// 'g_maxDepth' is still needed.
+const float g_minPathWeight = 1.0f / 4096.0f;
 
 static float g_fov = 45.0f;
 
+// The image is split into square tiles of this size (in pixels), which are rendered in parallel by the thread pool, should be a multiple of RayPacket::s_side.
+static int g_tileSize = 32;
+// Number of threads used for rendering, 0 means one per hardware thread. Both can be set on the command line, see 'main'.
+static int g_numThreads = 0;
+
+// Time (in seconds) the progressive renderer spends on each frame before showing what it has got.
+static double g_progressiveFrameTime = 0.05;
+// The progressive renderer starts out tracing every 'g_progressiveStartStep':th pixel in each direction (i.e., 1/16 of the pixels),
+// halves the step until it reaches full resolution and then adds samples until each pixel has 'g_progressiveMaxSamples'.
+const int g_progressiveStartStep = 4;
+const int g_progressiveMaxSamples = 16;
+// When set (using '-pathtrace'), the image is path traced instead (see 'tracePath'), which is far slower, but finds the light bouncing
+// between the objects rather than using the ambient light. The noise goes away as the samples are averaged, so the progressive renderer
+// keeps going until each pixel has 'g_pathTracingMaxSamples'.
+static bool g_pathTracing = false;
+const int g_pathTracingMaxSamples = 1024;
+// When set (using '-denoise'), the image is filtered to remove the noise (see 'denoiseImage'), which lets the path tracer get away with
+// a few samples per pixel. The filter is guided by the first hits, which are stored in 'g_gBuffer' while tracing. Note that this is not
+// real-time, it takes about 200 ms for a 1920x1080 frame on one core (the time of each step is printed for saved frames).
+static bool g_denoise = false;
+// When set (using '-reproject'), frames with one sample per pixel reuse the colours of the last frame where the same surface is seen,
+// see 'renderImageReprojected'. The depths may differ by this fraction, and the normals by about 18 degrees, and each pixel is shaded
+// again at least every 'g_reprojectionRefreshPeriod' frames.
+static bool g_reproject = false;
+const float g_reprojectionDepthTolerance = 0.02f;
+const float g_reprojectionMinCosNormal = 0.95f;
+const int g_reprojectionRefreshPeriod = 8;
+// Adaptive antialiasing (see 'renderImageAdaptive') refines the pixels that differ from a neighbour by more than this, see 'getContrast'.
+const float g_adaptiveContrast = 0.02f;
+
 static vec3 g_ambientLight = { 0.1f, 0.1f, 0.1f };
 static vec3 g_lightPosition = { -100.0f, 100.0f, 20.0f };
 static vec3 g_lightColour = { 0.9f, 0.9f, 0.9f };
+// The path tracer treats the light as a sphere, which covers this angle (in radians) as seen from the view target, see 'SphereLight'.
+// The point light has hard shadows, these get softer with a larger light.
+const float g_lightAngularRadius = 0.02f;
 
 // Tiny offset used to get reflection and shadow rays a starting point outside of the object that was just hit 
 // since floating point arithmetic is of limited precision, this kind of thing is usually needed.
@@ -48,11 +144,36 @@ inline float degreesToRadians(float degs)
 	return degs * g_pi / 180.0f;
 }
 
-// Forward declaraion so we can use the name 
-class Object;
-
 // Scene object list (initialized in main)
 std::vector<Object*> g_objects;
+// Bounding volume hierarchy over the objects in 'g_objects', must be rebuilt using 'buildObjectBvh' whenever the list of objects changes.
+// When the objects move it is refitted instead (see 'animateScene'), and rebuilt in the background when the SAH cost has grown by 20%,
+// which is when the rendering starts to get noticeably slower.
+DynamicBvh g_objectBvh(1.2f);
+const Bvh::NodeFormat g_bvhNodeFormat = USE_WIDE_BVH ? Bvh::NF_Wide : (USE_QUANTIZED_BVH ? Bvh::NF_Quantized : Bvh::NF_Float);
+// Keeps the binary scene file mapped while its objects are in 'g_objects', see 'makeSceneFromFile'.
+SceneFile g_sceneFile;
+// Objects shared by the instances in 'g_objects' (see 'makeInstancedScene'), these are not in the object BVH, only the instances are.
+std::vector<Object*> g_instancedObjects;
+// Threads used to render the tiles, created in main.
+ThreadPool *g_threadPool = nullptr;
+// When set (using '-animate'), the spheres move back and forth, see 'animateScene'.
+static bool g_animate = false;
+// The spheres move at most this far from where they were placed, large spheres (e.g., the floor) stay put.
+const float g_animationAmplitude = 2.0f;
+const float g_animationMaxRadius = 10.0f;
+// Radians per second.
+const float g_animationSpeed = 1.0f;
+// Reused by 'animateScene' every frame.
+static std::vector<Aabb> g_objectAabbs;
+// Increased whenever the objects are set up or moved, so that what is kept from earlier frames (see 'useFirstHitCache') can tell
+// whether it is still valid.
+static uint32_t g_sceneVersion = 0;
+// The image shown in the window, kept between frames. Use FrameBuffer::F_Rgb10A2 for less banding (on a 10-bit display).
+FrameBuffer g_frameBuffer(FrameBuffer::F_Rgba8);
+// The first hits of the camera rays and the filter used when denoising (see 'g_denoise'), kept between frames.
+GBuffer g_gBuffer;
+Denoiser g_denoiser;
 
 // Data types:
 
@@ -69,6 +190,12 @@ struct Camera
 	vec3 position;
 	float fovY;
 	float aspectRatio;
+	// tan(fovY / 2), i.e., half the height of the image plane at distance 1.
+	float tanHalfFovY;
+	// Size of a pixel in the normalized [-1,1] image plane coordinates, and the position of the sample within the pixel (in pixels).
+	// These are changed to trace a subsampled image, or to take several samples per pixel, see 'makeSampleCamera'.
+	vec2 pixelSize;
+	vec2 sampleOffset;
 };
 
 /**
@@ -89,81 +216,35 @@ Camera makeCamera(int screenWidth, int screenHeight, const vec3 &cameraPos, cons
 	camera.up = cross(camera.dir, camera.left);
 	camera.aspectRatio = float(camera.width) / float(camera.height);
 	camera.fovY = verticalFOV;
+	camera.tanHalfFovY = tanf(degreesToRadians(camera.fovY / 2.0f));
+	camera.pixelSize = 2.0f / vec2(float(camera.width), float(camera.height));
+	camera.sampleOffset = vec2(0.0f);
 
 	return camera;
 }
 
 /**
- * Structure representing a parametric ray with an origin and a direction.
- */
-struct Ray
-{
-	vec3 origin;
-	vec3 direction;
-};
-
-/**
- * Helper to make a ray.
+ * Returns a camera for tracing every 'step':th pixel of the image seen by 'camera' in each direction, i.e., with 1/step^2 of the pixels,
+ * and with the sample placed at 'sampleOffset' within the (full resolution) pixel. The pixel (x,y) of the returned camera corresponds to
+ * the pixel (x * step, y * step) of the original.
  */
-Ray makeRay(vec3 origin, vec3 direction)
+Camera makeSampleCamera(const Camera &camera, int step, vec2 sampleOffset)
 {
-	Ray r;
-	r.origin = origin;
-	r.direction = direction;
-	return r;
+	Camera c = camera;
+	c.width = (camera.width + step - 1) / step;
+	c.height = (camera.height + step - 1) / step;
+	c.pixelSize = camera.pixelSize * float(step);
+	c.sampleOffset = sampleOffset / float(step);
+	return c;
 }
 
 /**
- * Structure information about a hit point. By default initialized to represent not having hit anything.
- * We chose to repreesnt this using the maximum number floats can representation.
- * This struct could be extended with more information about the hit point, for example the normal is usuall very useful, and instead of the object
- * maybe representing the material (an object might have several materials) is more useful, or maybe just a function object that returns the shading?
- */
-struct HitInfo
-{
-	static constexpr float s_missTime = std::numeric_limits<float>::max();
-
-	HitInfo() : time(s_missTime), object(nullptr) { }
-
-	/**
-	 * Returns true if the info represents a valid hit.
-	 */
-	inline bool valid() const
-	{
-		return object != nullptr && time < s_missTime;
-	}
-
-	vec3 position;
-	vec3 normal;
-
-	float time;
-	Object *object;
-};
-
-
-/**
- * Base class for objects that can be traced.
-*  As an excercise, why not add a plane?
+ * Returns true if the cameras see the same image, i.e., if an image rendered with one can be used with the other.
  */
-class Object
+bool isSameView(const Camera &a, const Camera &b)
 {
-public:
-
-	/**
-	 * intersect is a pure virtual function, it must be overridden in all derived classes. Derive to implent different object types
-	 * (see Sphere below). The ray direction should not be expected to be normalized, and the time value calculated should be scaled
-	 * by the length (this follows naturally from most intersection routines).
-	 */
-	virtual HitInfo intersect(const Ray &ray) = 0;
-
-	// This is sensibly replaced with a more comprehensive material class, or some such that takes care of the shading calculation!
-	vec3 diffuseReflectance; // How strongis diffuse reflectance, RGB spectral value in range 0-1
-	float shininess; // How shiny is the object, determines the size of the specular highlight, larger value gives smaller spot
-	vec3 baseSpecularReflectance; // This is the R0 value used in the fresnel calculation, represents the reflectance of an object when viewed at 90 degrees
-	float reflectivity; // Hacky parameter to control mirror reflection strength, _should_ be implied by the shininess, i.e., a low shininess should imply low mirror reflection... not clear how
-	                    // this is usually well defined in properly physically based models.
-};
-
+	return a.width == b.width && a.height == b.height && a.position == b.position && a.dir == b.dir && a.up == b.up && a.fovY == b.fovY;
+}
 
 // 5. Routine that calculates the intersection of a ray (parametric 3D line), (origin, direction) and a sphere (centre, radius)
 //    if an intersection is found, hitDistance contains the distance to the hit point.
@@ -212,10 +293,12 @@ public:
 		// Initially a miss!
 		HitInfo hit;
 		float t = 0.0f;
+		COUNTER_ADD(primitiveTests, 1);
 
 		if (intersectRaySphere(ray.origin, ray.direction, position, radius, t))
 		{
 			hit.object = this;
+			hit.material = &material;
 			hit.time = t;
 
 			// This implementation must provide the position and normal. This data is useful to compute the shading.
@@ -227,9 +310,30 @@ public:
 		return hit;
 	}
 
+	/**
+	 * Only needs the hit time, which the intersection routine gives us directly.
+	 */
+	virtual bool occludes(const Ray &ray, float maxDistance) override
+	{
+		float t = 0.0f;
+		COUNTER_ADD(primitiveTests, 1);
+		return intersectRaySphere(ray.origin, ray.direction, position, radius, t) && t < maxDistance;
+	}
+
+	virtual Aabb getAabb() const override
+	{
+		return make_aabb(position, radius);
+	}
+
 	// Data for representing a sphere.
 	vec3 position;
 	float radius;
+	Material material;
+
+	// The sphere moves along 'motion' around 'basePosition' when animated, with the phase offset so that they do not all move together.
+	vec3 basePosition;
+	vec3 motion;
+	float phase;
 };
 
 /**
@@ -241,9 +345,14 @@ Sphere *makeSphere(const vec3 &position, float radius, const vec3 &colour, const
 	Sphere *sphere = new Sphere;
 
 	sphere->position = position;
+	sphere->basePosition = position;
+	sphere->motion = vec3(0.0f);
+	sphere->phase = 0.0f;
 	sphere->radius = radius;
-	sphere->diffuseReflectance = colour;
-	sphere->reflectivity = reflectivity;
+	sphere->material.diffuseReflectance = colour;
+	sphere->material.shininess = 0.0f;
+	sphere->material.baseSpecularReflectance = vec3(0.0f);
+	sphere->material.reflectivity = reflectivity;
 
 	return sphere;
 }
@@ -253,14 +362,46 @@ Sphere *makeSphere(const vec3 &position, float radius, const vec3 &colour, const
 	Sphere *sphere = new Sphere;
 
 	sphere->position = position;
+	sphere->basePosition = position;
+	sphere->motion = vec3(0.0f);
+	sphere->phase = 0.0f;
 	sphere->radius = radius;
-	sphere->diffuseReflectance = colour;
-	sphere->shininess = shininess;
-	sphere->baseSpecularReflectance = baseSpecularReflectance;
-	sphere->reflectivity = reflectivity;
+	sphere->material.diffuseReflectance = colour;
+	sphere->material.shininess = shininess;
+	sphere->material.baseSpecularReflectance = baseSpecularReflectance;
+	sphere->material.reflectivity = reflectivity;
 
 	return sphere;
 }
+/**
+ * Replaces all the Sphere objects in the list with a single SphereSet containing the same spheres and materials.
+ */
+void packSpheres(std::vector<Object*> &objects)
+{
+	SphereSet *sphereSet = new SphereSet;
+	std::vector<Object*> remaining;
+	for (auto o : objects)
+	{
+		if (Sphere *sphere = dynamic_cast<Sphere*>(o))
+		{
+			sphereSet->addSphere(sphere->position, sphere->radius, sphereSet->addMaterial(sphere->material));
+			delete sphere;
+		}
+		else
+		{
+			remaining.push_back(o);
+		}
+	}
+	if (sphereSet->getNumSpheres() == 0)
+	{
+		delete sphereSet;
+		return;
+	}
+	sphereSet->build(g_bvhNodeFormat);
+	remaining.push_back(sphereSet);
+	objects.swap(remaining);
+}
+
 /**
  * Generates a ray through the pixel (x,y). The ray has unit length and origin at the camera position.
  * Uses the pin-hole camera model, to change the model we could just generate a different distribution.
@@ -269,19 +410,59 @@ Ray generatePinHolePrimaryRay(int x, int y, const Camera &c)
 {
 	Ray r;
 
-	vec2 pixelNormCoord = vec2(float(x) / float(c.width), float(y) / float(c.height)) * 2.0f - 1.0f;
+	vec2 pixelNormCoord = (vec2(float(x), float(y)) + c.sampleOffset) * c.pixelSize - 1.0f;
 
 	r.origin = c.position;
 
 	r.direction = normalize(c.dir +
-		tanf(degreesToRadians(c.fovY / 2.0f)) * c.up * pixelNormCoord.y +
-		tanf(degreesToRadians(c.fovY / 2.0f)) * c.aspectRatio * c.left* pixelNormCoord.x);
+		c.tanHalfFovY * c.up * pixelNormCoord.y +
+		c.tanHalfFovY * c.aspectRatio * c.left* pixelNormCoord.x);
 
 	return r;
 }
 
+/**
+ * Generates the primary rays for the block of pixels with the lower left corner at (x0,y0), using the same camera model as
+ * 'generatePinHolePrimaryRay'. Returns the mask of the rays that are inside the image, the others are still set up since they
+ * are needed to build the packet frustum.
+ */
+PacketMask generatePinHolePrimaryPacket(int x0, int y0, const Camera &c, RayPacket &packet)
+{
+	PacketMask activeMask = 0;
+	for (int j = 0; j < RayPacket::s_side; ++j)
+	{
+		for (int i = 0; i < RayPacket::s_side; ++i)
+		{
+			const int lane = j * RayPacket::s_side + i;
+			Ray r = generatePinHolePrimaryRay(x0 + i, y0 + j, c);
+			packet.setRay(lane, r.origin, r.direction, HitInfo::s_missTime);
+			if (x0 + i < c.width && y0 + j < c.height)
+			{
+				activeMask |= PacketMask(1) << lane;
+			}
+		}
+	}
+	packet.buildFrustum();
+	return activeMask;
+}
+
 // Forward declaration, needed in C/C++
-vec3 shade(const Ray &ray, const HitInfo &hit, int depth);
+vec3 shade(const Ray &ray, const HitInfo &hit, int depth, const vec3 &pathWeight);
+
+/**
+ * (Re-)builds the BVH over the objects. This must be called whenever objects are added, removed or moved, since the
+ * BVH stores the bounding boxes and refers to the objects by their index in the list.
+ */
+void buildObjectBvh(DynamicBvh &bvh, const std::vector<Object*> &objects)
+{
+	std::vector<Aabb> aabbs;
+	aabbs.reserve(objects.size());
+	for (auto o : objects)
+	{
+		aabbs.push_back(o->getAabb());
+	}
+	bvh.build(aabbs, Bvh::s_maxLeafSize, 1, g_bvhNodeFormat);
+}
 
 /**
  * Finds the closest (smallest time value) intersection with the objects. 
@@ -290,39 +471,75 @@ vec3 shade(const Ray &ray, const HitInfo &hit, int depth);
  */
 HitInfo findClosestIntersection(const Ray &ray, const std::vector<Object*> &objects)
 {
+	const Bvh &objectBvh = g_objectBvh.getBvh();
+	assert(objectBvh.getNumPrimitives() == objects.size());
+	COUNTER_ADD(queries, 1);
+
 	// A hit info is intialized to float max time.
 	HitInfo best;
 
-	// This uses a linear search which is fine for a small handful of objects, to support a large scene
-	// an acceleration structure such as a Bounding Volume Hierarchy (BVH) should be used.
-	for (auto o : objects)
+	// The BVH lets us skip all objects whose bounding boxes are not hit by the ray, and visits the closest first so that
+	// most objects behind the nearest hit can be skipped too. The lambda is called for each object in the leaves reached.
+	BvhRay bvhRay = makeBvhRay(ray.origin, ray.direction);
+	float tMax = best.time;
+	objectBvh.traverse(bvhRay, tMax, [&](uint32_t objectIndex, float &closestTime) -> bool
 	{
-		HitInfo h = o->intersect(ray);
+		HitInfo h = objects[objectIndex]->intersect(ray);
 
 		// Check if new hit time is better
 		if (h.time < best.time)
 		{
 			best = h;
+			closestTime = h.time;
 		}
-	}
+		return false;
+	});
 	return best;
 }
 
 
 
+/**
+ * Packet version of 'findClosestIntersection', finds the closest intersection for each ray in 'activeMask' and stores it in 'hits',
+ * which must have room for one hit info per ray in the packet. The packet 'tMax' must be initialized to the maximum distance.
+ */
+void findClosestIntersections(RayPacket &packet, PacketMask activeMask, HitInfo *hits, const std::vector<Object*> &objects)
+{
+	const Bvh &objectBvh = g_objectBvh.getBvh();
+	assert(objectBvh.getNumPrimitives() == objects.size());
+	COUNTER_ADD(queries, 1);
+
+	for (int i = 0; i < RayPacket::s_size; ++i)
+	{
+		hits[i] = HitInfo();
+	}
+	// The objects update the closest hit times in the packet, which lets the traversal skip nodes behind the hits found so far.
+	objectBvh.traversePacket(packet, activeMask, [&](uint32_t firstObject, uint32_t count, PacketMask mask)
+	{
+		for (uint32_t i = firstObject; i < firstObject + count; ++i)
+		{
+			objects[objectBvh.getPrimitiveIndices()[i]]->intersectPacket(packet, mask, hits);
+		}
+	});
+}
+
+
+
 /**
  * Traces a ray through the scene (here represented by a list of objects), returns information about the intersection point.
- * In a recursive ray tracer this information would include the shading at the intersection point.
+ * In a recursive ray tracer this information would include the shading at the intersection point. 'pathWeight' is how much the
+ * colour found ends up contributing to the pixel, see 'continuePath'.
  */
-vec3 trace(const Ray &ray, const std::vector<Object*> &objects, int depth = 0)
+vec3 trace(const Ray &ray, const std::vector<Object*> &objects, int depth = 0, const vec3 &pathWeight = vec3(1.0f))
 {
+	COUNTER_ADD_RAYS(depth == 0 ? RT_Primary : RT_Reflection, depth, 1);
 	HitInfo hit = findClosestIntersection(ray, objects);
 
 	// If a hit point was found...
 	if (hit.valid())
 	{
 		//...call 'shade' to calculte the colour.
-		return shade(ray, hit, depth);
+		return shade(ray, hit, depth, pathWeight);
 	}
 	// Otherwise we just return the background colour.
 	return g_backGroundColour;
@@ -330,6 +547,16 @@ vec3 trace(const Ray &ray, const std::vector<Object*> &objects, int depth = 0)
 
 
 
+/**
+ * The object (the index in the object list) and primitive that last blocked a shadow ray, see 'isRayOccluded'.
+ */
+struct OccluderCache
+{
+	uint32_t sceneVersion;
+	uint32_t objectIndex;
+	uint32_t primitive;
+};
+
 /**
  * Returns true if anything is in the way of the ray over the distance specified ('maxDistance'), and false otherwise.
  * Having a 'maxDistance' lets us make sure that we don't get intersections for things behind the light source. Since 
@@ -338,26 +565,75 @@ vec3 trace(const Ray &ray, const std::vector<Object*> &objects, int depth = 0)
  */
 bool isRayOccluded(const Ray &ray, const std::vector<Object*> &objects, float maxDistance)
 {
-	for (auto o : objects)
+	const Bvh &objectBvh = g_objectBvh.getBvh();
+	assert(objectBvh.getNumPrimitives() == objects.size());
+	COUNTER_ADD(queries, 1);
+	COUNTER_ADD(rays[RT_Shadow], 1);
+
+#if USE_OCCLUDER_CACHE
+	// The primitive that blocked the last shadow ray traced by this thread is tested first, since the shadow rays of neighbouring pixels
+	// (which are traced one after the other, as each tile is rendered by one thread) are usually blocked by the same primitive. If it
+	// blocks this ray too, there is no need to traverse the BVHs at all. The cache is dropped when the scene changes.
+	static thread_local OccluderCache cache = { 0, ~0U, 0 };
+	if (cache.sceneVersion == g_sceneVersion && cache.objectIndex < objects.size())
 	{
-		HitInfo h = o->intersect(ray);
-
-		if (h.time < maxDistance)
+		COUNTER_ADD(occluderCacheTests, 1);
+		if (objects[cache.objectIndex]->occludesPrimitive(ray, maxDistance, cache.primitive))
 		{
+			COUNTER_ADD(occluderCacheHits, 1);
 			return true;
 		}
 	}
+#endif // USE_OCCLUDER_CACHE
 
-	return false;
+	// The any-hit traversal visits the children front to back (the one the ray enters first), and stops as soon as the lambda returns true.
+	BvhRay bvhRay = makeBvhRay(ray.origin, ray.direction);
+	return objectBvh.traverseAny(bvhRay, maxDistance, [&](uint32_t objectIndex) -> bool
+	{
+#if USE_OCCLUDER_CACHE
+		uint32_t primitive;
+		if (objects[objectIndex]->findOccluder(ray, maxDistance, primitive))
+		{
+			cache.sceneVersion = g_sceneVersion;
+			cache.objectIndex = objectIndex;
+			cache.primitive = primitive;
+			return true;
+		}
+		return false;
+#else // !USE_OCCLUDER_CACHE
+		return objects[objectIndex]->occludes(ray, maxDistance);
+#endif // USE_OCCLUDER_CACHE
+	});
+}
+
+/**
+ * Calculate fresnel term approximation according to schlick's approximation:
+ * Note: takes cos(angle) instead of angle, as this is what we get from the dot product.
+ * 'r0' is the base specular reflectance.
+ */
+inline vec3 F_schlick(const float cosAngle, vec3 r0)
+{
+	return r0 + (1.0f - r0) * powf(1.0f - cosAngle, 5.0f);
+}
+
+
+inline vec3 fSpec(vec3 inDir, vec3 outDir, vec3 normal, float shininess, vec3 r0)
+{
+	vec3 halfVector = normalize(inDir + outDir);
+	return  ((shininess + 2.0f) / (2.0f)) * powf(dot(normal, halfVector), shininess)
+		* F_schlick(std::max(0.0f, dot(inDir, halfVector)), r0);
 }
 
 #if SIMPLE_SHADING
 
 /**
-* This funciton is called to calculate shading for the hit point.
+* This funciton is called to calculate shading for the hit point. It calculates the light reflected towards the viewer from the
+* light source, and sets up the mirror reflection ray and its weight (which is zero if there is to be no reflection). Tracing the
+* reflection ray is left to the caller, see 'shade'.
 */
-vec3 shade(const Ray &ray, const HitInfo &hit, int depth)
+vec3 shadeLocal(const Ray &ray, const HitInfo &hit, int depth, Ray &reflectionRay, vec3 &reflectionWeight)
 {
+	COUNTER_ADD(shadeCalls, 1);
 	// Things missing in this simple light model (experiment with adding them!): 
 	//   1. Fresnel reflection (angle based reflectivity) 
 	//   2. Physical light model, e.g., proper units for light intensity, fall-off for distance.
@@ -396,21 +672,20 @@ vec3 shade(const Ray &ray, const HitInfo &hit, int depth)
 
 	// The light (both ambient and possible diffuse) is modulated by the material diffuse colour to produce the final 
 	// reflected diffuse light.
-	vec3 resultColour = hit.object->diffuseReflectance * light;
+	vec3 resultColour = hit.material->diffuseReflectance * light;
 
-	// If we're not too deep (application specified constant, could be replaced with weight based limit
-	// since as we get deeper the contribution to the pixel colour diminishes, unless pure mirrors).
-	if (depth < g_maxDepth && hit.object->reflectivity > 0.0f)
+	// If we're not too deep (application specified constant, the weight based limit is applied by the caller, see 'continuePath').
+	reflectionWeight = vec3(0.0f);
+	if (depth < g_maxDepth && hit.material->reflectivity > 0.0f)
 	{
 		// Construct reflection ray.
-		Ray reflectionRay;
 		// reflect the ray direction around the normal
 		reflectionRay.direction = glm::reflect(ray.direction, hit.normal);
 		// starting point of reflection ray. We offset the starting point slightly in the normal direction
 		// to avoid self-intersection. Note that we don't offset in the reflection direction since it may be nearly tangential.
 		// Which would then fail to move the starting point outside of the hit object.
 		reflectionRay.origin = hit.position + hit.normal * g_rayEpsilon;
-		resultColour += trace(reflectionRay, g_objects, depth + 1) * hit.object->reflectivity;
+		reflectionWeight = vec3(hit.material->reflectivity);
 	}
 
 	return resultColour;
@@ -418,27 +693,13 @@ vec3 shade(const Ray &ray, const HitInfo &hit, int depth)
 
 #else // !SIMPLE_SHADING
 /**
- * Calculate fresnel term approximation according to schlick's approximation:
- * Note: takes cos(angle) instead of angle, as this is what we get from the dot product.
- * 'r0' is the base specular reflectance.
- */
-inline vec3 F_schlick(const float cosAngle, vec3 r0)
-{
-	return r0 + (1.0f - r0) * powf(1.0f - cosAngle, 5.0f);
-}
-
-
-inline vec3 fSpec(vec3 inDir, vec3 outDir, vec3 normal, float shininess, vec3 r0)
-{
-	vec3 halfVector = normalize(inDir + outDir);
-	return  ((shininess + 2.0f) / (2.0f)) * powf(dot(normal, halfVector), shininess)
-		* F_schlick(std::max(0.0f, dot(inDir, halfVector)), r0);
-}
-/**
- * This funciton is called to calculate shading for the hit point.
+ * This funciton is called to calculate shading for the hit point. It calculates the light reflected towards the viewer from the
+ * light source, and sets up the mirror reflection ray and its weight (which is zero if there is to be no reflection). Tracing the
+ * reflection ray is left to the caller, see 'shade'.
  */
-vec3 shade(const Ray &ray, const HitInfo &hit, int depth)
+vec3 shadeLocal(const Ray &ray, const HitInfo &hit, int depth, Ray &reflectionRay, vec3 &reflectionWeight)
 {
+	COUNTER_ADD(shadeCalls, 1);
 	// 1. construct direction to the light (unit length vector)
 	vec3 lightDir = normalize(g_lightPosition - hit.position);
 	
@@ -455,14 +716,14 @@ vec3 shade(const Ray &ray, const HitInfo &hit, int depth)
 	
 	// 5. Ambient light is a huge hack and is there to replace all the global illumination effects of indirect light bouncing around the scene.
 	// If we did not use this term, any surface not facing the light would be pitch black.
-	vec3 resultColour = g_ambientLight * hit.object->diffuseReflectance;
+	vec3 resultColour = g_ambientLight * hit.material->diffuseReflectance;
 
 	// 6. Specular reflectance: normalized blinn-phong with schlick fresnel:
-	vec3 f_specular = fSpec(lightDir, viewDir, hit.normal, hit.object->shininess, hit.object->baseSpecularReflectance);
+	vec3 f_specular = fSpec(lightDir, viewDir, hit.normal, hit.material->shininess, hit.material->baseSpecularReflectance);
 	//return f_specular * incommingLight;
 
 	// 7. Diffuse reflectance: lambertian BRDF, with removed constant (/pi)
-	vec3 f_diffuse = hit.object->diffuseReflectance;
+	vec3 f_diffuse = hit.material->diffuseReflectance;
 	//return f_diffuse * incommingLight + f_specular * incommingLight;
 	//return resultColour + f_diffuse * incommingLight + f_specular * incommingLight;
 
@@ -488,24 +749,23 @@ vec3 shade(const Ray &ray, const HitInfo &hit, int depth)
 	// 10. Use fresnel again to calculate the strength of the reflection, we base this off the strength of the specular reflectance,
 	//     but also use a somewhat hacky 'reflectivity' term. In a physcally based model, this would be implied by a roughness factor
 	//     that also determines the size of the specular highlight.
-	vec3 reflectionWeight = hit.object->reflectivity * F_schlick(std::max(0.0f, dot(viewDir, hit.normal)), hit.object->baseSpecularReflectance); // fSpec(glm::reflect(ray.direction, hit.normal), viewDir, hit.normal, hit.object->shininess, hit.object->baseSpecularReflectance);
+	reflectionWeight = hit.material->reflectivity * F_schlick(std::max(0.0f, dot(viewDir, hit.normal)), hit.material->baseSpecularReflectance); // fSpec(glm::reflect(ray.direction, hit.normal), viewDir, hit.normal, hit.material->shininess, hit.material->baseSpecularReflectance);
 	//return reflectionWeight;
 
-	// If we're not too deep (application specified constant, could be replaced with weight based limit
-	// since as we get deeper the contribution to the pixel colour diminishes, unless pure mirrors).
+	// If we're not too deep (application specified constant, the weight based limit is applied by the caller, see 'continuePath').
 	if (depth < g_maxDepth && all(greaterThan(reflectionWeight, vec3(0.0f))))
 	{
 		// Construct reflection ray.
-		Ray reflectionRay;
 		// reflect the ray direction around the normal
 		reflectionRay.direction = glm::reflect(ray.direction, hit.normal);
 		// starting point of reflection ray. We offset the starting point slightly in the normal direction
 		// to avoid self-intersection. Note that we don't offset in the reflection direction since it may be nearly tangential.
 		// Which would then fail to move the starting point outside of the hit object.
 		reflectionRay.origin = hit.position + hit.normal * g_rayEpsilon;
-
-		// Add to result modulated by the weight
-		resultColour += trace(reflectionRay, g_objects, depth + 1) * reflectionWeight;
+	}
+	else
+	{
+		reflectionWeight = vec3(0.0f);
 	}
 
 	return resultColour;
@@ -513,71 +773,2643 @@ vec3 shade(const Ray &ray, const HitInfo &hit, int depth)
 
 #endif // SIMPLE_SHADING
 
-inline vec3 toSrgb(vec3 linearSpaceColour)
+/**
+ * A hash of the bits of the ray, used for random numbers. Taking these from the ray rather than a random number generator keeps the image
+ * the same however the tiles are spread over the threads.
+ */
+inline uint32_t hashRayBits(const Ray &ray)
 {
-	return glm::pow(linearSpaceColour, vec3(1.0f / 2.2f));
+	const float values[6] = { ray.origin.x, ray.origin.y, ray.origin.z, ray.direction.x, ray.direction.y, ray.direction.z };
+	uint32_t h = 2166136261u;
+	for (float v : values)
+	{
+		uint32_t bits;
+		memcpy(&bits, &v, sizeof(bits));
+		h = (h ^ bits) * 16777619u;
+	}
+	// Mix the bits (the MurmurHash3 finalizer), since the FNV hash above leaves the top bits poorly mixed.
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35u;
+	h ^= h >> 16;
+	return h;
 }
 
-// Callback that is called by GLUT system when a frame needs to be drawn, set up in main() using 'glutDisplayFunc'
-static void onGlutDisplay()
+/**
+ * A random number in [0,1) made from the bits of the ray, used for the Russian roulette.
+ */
+inline float hashRay(const Ray &ray)
 {
-	Camera camera = makeCamera(glutGet(GLUT_WINDOW_WIDTH), glutGet(GLUT_WINDOW_HEIGHT), g_viewPosition, g_viewTarget, g_viewUp, g_fov);
+	return float(hashRayBits(ray) >> 8) / 16777216.0f;
+}
 
-	// memory to use to store the pixels to
-	std::vector<vec3> pixels(camera.width * camera.height, g_backGroundColour);
-	
-	// loop over all the pixel locations.
-	
-	// It is trivial to use all the processor cores since rays are independent: 
-	// For a trivial, compute bound, scene like four spheres, this should get more or less linear speed up.
-	//     #pragma omp parallel for
-	for (int y = 0; y < camera.height; ++y)
+/**
+ * Decides if the reflection ray is worth tracing, given the path weight of the ray that hit the surface and the reflection weight, whose
+ * product is how much the reflection would contribute to the pixel. If this is below 'g_minPathWeight' in all channels, the reflection
+ * weight is set to zero, unless the ray survives the Russian roulette (see USE_RUSSIAN_ROULETTE), in which case the reflection weight is
+ * divided by the probability of surviving. Returns the path weight of the reflection ray.
+ */
+inline vec3 continuePath(const Ray &reflectionRay, const vec3 &pathWeight, vec3 &reflectionWeight)
+{
+	vec3 reflectionPathWeight = pathWeight * reflectionWeight;
+	const float maxWeight = std::max(reflectionPathWeight.x, std::max(reflectionPathWeight.y, reflectionPathWeight.z));
+	if (maxWeight >= g_minPathWeight || reflectionWeight == vec3(0.0f))
 	{
-		for (int x = 0; x < camera.width; ++x)
-		{
-			Ray r = generatePinHolePrimaryRay(x, y, camera);
-
-			// We also convert to srgb colour space since this seems to be what glDrawPixels expects
-			pixels[y * camera.width + x] = toSrgb(trace(r, g_objects)); 
-		}
+		return reflectionPathWeight;
+	}
+#if USE_RUSSIAN_ROULETTE
+	const float survivalProbability = maxWeight / g_minPathWeight;
+	if (hashRay(reflectionRay) < survivalProbability)
+	{
+		reflectionWeight /= survivalProbability;
+		return reflectionPathWeight / survivalProbability;
 	}
+#else // !USE_RUSSIAN_ROULETTE
+	// The ray is only used to seed the roulette.
+	(void)reflectionRay;
+#endif // USE_RUSSIAN_ROULETTE
+	COUNTER_ADD(terminatedRays, 1);
+	reflectionWeight = vec3(0.0f);
+	return vec3(0.0f);
+}
+
+/**
+ * Calculates the shading for the hit point, including the mirror reflection, which is traced recursively. 'pathWeight' is the product
+ * of the reflection weights from the camera to here, see 'continuePath'.
+ */
+vec3 shade(const Ray &ray, const HitInfo &hit, int depth, const vec3 &pathWeight)
+{
+	Ray reflectionRay;
+	vec3 reflectionWeight;
+	vec3 resultColour = shadeLocal(ray, hit, depth, reflectionRay, reflectionWeight);
+	vec3 reflectionPathWeight = continuePath(reflectionRay, pathWeight, reflectionWeight);
 
-	// Must check for empty vector (if window is made 0 size in either dimension)
-	if (!pixels.empty())
+	if (reflectionWeight != vec3(0.0f))
 	{
-		// just copy the pixel data to the frame buffer.
-		glDrawPixels(camera.width, camera.height, GL_RGB, GL_FLOAT, &pixels[0]);
+		// Add to result modulated by the weight
+		resultColour += trace(reflectionRay, g_objects, depth + 1, reflectionPathWeight) * reflectionWeight;
 	}
+	return resultColour;
+}
 
-	// tell GLUT to get the OS to swap the back and front buffers.
-	glutSwapBuffers();
+/**
+ * A rectangle of pixels, from (x0,y0) up to, but not including, (x1,y1).
+ */
+struct Tile
+{
+	int x0;
+	int y0;
+	int x1;
+	int y1;
+};
+
+/**
+ * The tile size actually used, 'g_tileSize' rounded up to whole packet blocks, see 'tracePrimaryRays'.
+ */
+inline int getTileSize()
+{
+	return std::max(1, (g_tileSize + RayPacket::s_side - 1) / RayPacket::s_side) * RayPacket::s_side;
 }
 
+inline int getNumTilesX(const Camera &camera)
+{
+	return (camera.width + getTileSize() - 1) / getTileSize();
+}
 
+inline int getNumTiles(const Camera &camera)
+{
+	return getNumTilesX(camera) * ((camera.height + getTileSize() - 1) / getTileSize());
+}
 
+/**
+ * Returns the tile with the given index, the tiles are numbered row by row.
+ */
+Tile getTile(const Camera &camera, int tileIndex)
+{
+	const int tileSize = getTileSize();
+	Tile tile;
+	tile.x0 = (tileIndex % getNumTilesX(camera)) * tileSize;
+	tile.y0 = (tileIndex / getNumTilesX(camera)) * tileSize;
+	tile.x1 = std::min(tile.x0 + tileSize, camera.width);
+	tile.y1 = std::min(tile.y0 + tileSize, camera.height);
+	return tile;
+}
 
-int main(int argc, char* argv[])
+/**
+ * The first hits of the camera rays for one camera, kept between frames so that when only the lighting changes (the light, or the
+ * parameters of the materials, which are read through the hits), the camera rays need not be traced again, see 'tracePrimaryRays'.
+ * The hits are stored tile by tile as the tiles are traced, and are kept as long as the camera is exactly the same and the scene has
+ * not changed, see 'g_sceneVersion'.
+ */
+struct FirstHitCache
 {
-	glutInit(&argc, argv);
-	glutInitDisplayMode(GLUT_RGB | GLUT_DEPTH | GLUT_DOUBLE);
-	glutSetOption(GLUT_ACTION_ON_WINDOW_CLOSE, GLUT_ACTION_GLUTMAINLOOP_RETURNS);
+	Camera camera;
+	uint32_t sceneVersion;
+	std::vector<HitInfo> hits;
+	// Set for the tiles whose hits are stored, each tile is only traced by one thread at a time.
+	std::vector<uint8_t> tileStored;
+};
 
-	glutInitWindowSize(g_startWidth, g_startHeight);
-	glutCreateWindow("A somewhat more structured and extensible ray tracer");
+static FirstHitCache g_firstHits;
 
-	glutSwapBuffers();
+/**
+ * Returns true if the cameras trace exactly the same rays, i.e., are the same view with the same samples (unlike 'isSameView').
+ */
+bool isSameCamera(const Camera &a, const Camera &b)
+{
+	return isSameView(a, b) && a.pixelSize == b.pixelSize && a.sampleOffset == b.sampleOffset;
+}
 
-	printf("--------------------------------------\nOpenGL\n  Vendor: %s\n  Renderer: %s\n  Version: %s\n--------------------------------------\n", glGetString(GL_VENDOR), glGetString(GL_RENDERER), glGetString(GL_VERSION));
+/**
+ * Sets up the cache of first hits for the frame about to be traced with 'camera', the hits already stored are kept if they are for
+ * the same camera and scene. Returns true if they were kept. Only the rays of this camera are cached, e.g., not the extra samples
+ * per pixel, which are traced with other cameras (see 'makeSampleCamera').
+ */
+#if USE_FIRST_HIT_CACHE
+bool useFirstHitCache(const Camera &camera)
+{
+	if (g_firstHits.sceneVersion == g_sceneVersion && !g_firstHits.tileStored.empty() && isSameCamera(g_firstHits.camera, camera))
+	{
+		return true;
+	}
+	g_firstHits.camera = camera;
+	g_firstHits.sceneVersion = g_sceneVersion;
+	g_firstHits.hits.resize(size_t(camera.width) * size_t(camera.height));
+	g_firstHits.tileStored.assign(getNumTiles(camera), 0);
+	return false;
+}
+#else // !USE_FIRST_HIT_CACHE
+bool useFirstHitCache(const Camera &)
+{
+	return false;
+}
+#endif // USE_FIRST_HIT_CACHE
 
-	// Set up scene: 
-	g_objects.push_back(makeSphere(vec3(-3.2f, 0.0f, 0.0f), 1.5f, vec3(0.2f, 0.3f, 1.0f), vec3(0.3f), 5.0f, 0.0f)); // blue sphere to the left
-	g_objects.push_back(makeSphere(vec3(0.0f, 2.0f, 0.0f), 1.5f, vec3(0.2f, 0.9f, 0.3f), vec3(0.3f), 80.0f, 0.8f)); // green sphere in the middle and up a bit
-	g_objects.push_back(makeSphere(vec3(3.2f, 0.0f, 0.0f), 1.5f, vec3(0.8f, 0.1f, 0.1f), vec3(0.02f), 40.0f, 0.8f)); // red sphere to the right.
-	//g_objects.push_back(makeSphere(vec3(0.0f, -1.0f, 0.0f), 1.0f, vec3(0.1f), 0.9f)); // smaller dark gray with high reflectivity
-	g_objects.push_back(makeSphere(vec3(0.0f, -1.0f, 0.0f), 1.5f, vec3(0.0f), vec3(1.0f, 0.71f, 0.29f), 50.0f, 0.99f)); // smaller gold with high reflectivity
-	g_objects.push_back(makeSphere(vec3(0.0f, -1003.0f, 0.0f), 1000.0f, vec3(0.8f), vec3(0.0f), 0.0f, 0.0f)); // huge light gray sphere underneath, no refleciton
+/**
+ * Returns the flag telling if the hits of the tile are stored in the cache and sets 'hits' to the cached hits (for the whole image),
+ * or returns null if the cache is not for this camera.
+ */
+#if USE_FIRST_HIT_CACHE
+inline uint8_t *getFirstHitCacheTile(const Camera &camera, const Tile &tile, HitInfo *&hits)
+{
+	if (g_firstHits.sceneVersion == g_sceneVersion && !g_firstHits.tileStored.empty() && isSameCamera(g_firstHits.camera, camera))
+	{
+		hits = g_firstHits.hits.data();
+		return &g_firstHits.tileStored[(tile.y0 / getTileSize()) * getNumTilesX(camera) + tile.x0 / getTileSize()];
+	}
+	return nullptr;
+}
+#else // !USE_FIRST_HIT_CACHE
+inline uint8_t *getFirstHitCacheTile(const Camera &, const Tile &, HitInfo *&)
+{
+	return nullptr;
+}
+#endif // USE_FIRST_HIT_CACHE
+
+/**
+ * Traces the primary rays for all pixels in the tile and calls 'hitFn(pixelIndex, ray, hit)' for each, note that the hit is invalid for
+ * rays that hit nothing. The pixels are not visited in order.
+ * If the first hits of the camera are cached (see 'useFirstHitCache'), the hits of the tile are taken from the cache if they are there,
+ * and otherwise stored there, so that only the shading is done when the same image is traced again.
+ */
+template <typename HIT_FN>
+void tracePrimaryRays(const Camera &camera, const Tile &tile, HIT_FN hitFn)
+{
+	HitInfo *cachedHits = nullptr;
+	uint8_t *tileStored = getFirstHitCacheTile(camera, tile, cachedHits);
+	if (tileStored && *tileStored)
+	{
+		// The rays are cheap to make again, and are exactly the same as those traced.
+		for (int y = tile.y0; y < tile.y1; ++y)
+		{
+			for (int x = tile.x0; x < tile.x1; ++x)
+			{
+				COUNTER_ADD(cachedPrimaryRays, 1);
+				hitFn(y * camera.width + x, generatePinHolePrimaryRay(x, y, camera), cachedHits[y * camera.width + x]);
+			}
+		}
+		return;
+	}
+	auto storeHitFn = [&](int pixel, const Ray &ray, const HitInfo &hit)
+	{
+		if (cachedHits)
+		{
+			cachedHits[pixel] = hit;
+		}
+		hitFn(pixel, ray, hit);
+	};
+
+#if USE_RAY_PACKETS
+	// loop over the tile in blocks, the primary rays for each block are traced as a packet, and then shaded one by one.
+	// The tile size is a multiple of the block size, so the blocks only stick out at the edges of the image.
+	for (int y0 = tile.y0; y0 < tile.y1; y0 += RayPacket::s_side)
+	{
+		for (int x0 = tile.x0; x0 < tile.x1; x0 += RayPacket::s_side)
+		{
+			RayPacket packet;
+			HitInfo hits[RayPacket::s_size];
+			PacketMask activeMask = generatePinHolePrimaryPacket(x0, y0, camera, packet);
+			findClosestIntersections(packet, activeMask, hits, g_objects);
+
+			for (int lane = 0; lane < RayPacket::s_size; ++lane)
+			{
+				if ((activeMask >> lane) & 1)
+				{
+					COUNTER_ADD_RAYS(RT_Primary, 0, 1);
+					const int x = x0 + lane % RayPacket::s_side;
+					const int y = y0 + lane / RayPacket::s_side;
+					storeHitFn(y * camera.width + x, makeRay(packet.getOrigin(lane), packet.getDirection(lane)), hits[lane]);
+				}
+			}
+		}
+	}
+#else // !USE_RAY_PACKETS
+	// loop over all the pixel locations in the tile.
+	for (int y = tile.y0; y < tile.y1; ++y)
+	{
+		for (int x = tile.x0; x < tile.x1; ++x)
+		{
+			Ray r = generatePinHolePrimaryRay(x, y, camera);
+			COUNTER_ADD_RAYS(RT_Primary, 0, 1);
+			storeHitFn(y * camera.width + x, r, findClosestIntersection(r, g_objects));
+		}
+	}
+#endif // USE_RAY_PACKETS
+	if (tileStored)
+	{
+		*tileStored = 1;
+	}
+}
+
+
+
+/**
+ * The light as seen by the path tracer (see 'tracePath'), a sphere around 'g_lightPosition'. A point light can only be found by the shadow
+ * rays, whereas a sphere can also be hit by the rays that sample the BRDF, which is what makes it possible to weigh the two against each
+ * other. The radiance is set so that the light falling on the view target is the same as from the point light (with the BRDF scaled
+ * by 1/pi, see 'evalBrdf'), which makes the direct light match that of 'shadeLocal'.
+ */
+struct SphereLight
+{
+	vec3 position;
+	float radius;
+	vec3 radiance;
+};
+
+SphereLight makeSphereLight()
+{
+	const float sinAngle = sinf(g_lightAngularRadius);
+	SphereLight light;
+	light.position = g_lightPosition;
+	light.radius = length(g_lightPosition - g_viewTarget) * sinAngle;
+	// The light covers a solid angle of about pi * sinAngle^2, which cancels the pi of the BRDF.
+	light.radiance = g_lightColour / (sinAngle * sinAngle);
+	return light;
+}
+
+/**
+ * Returns the next random number in [0,1) from the state, using the PCG hash (from "Hash Functions for GPU Rendering", Jarzynski & Olano).
+ */
+inline float nextRandom(uint32_t &state)
+{
+	state = state * 747796405u + 2891336453u;
+	uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+	return float(((word >> 22u) ^ word) >> 8) / 16777216.0f;
+}
+
+/**
+ * Returns the direction (x, y, z) in the frame where 'axis' is z, 'axis' must be unit length (from "Building an Orthonormal Basis,
+ * Revisited", Duff et al.).
+ */
+inline vec3 toWorld(const vec3 &axis, float x, float y, float z)
+{
+	const float sign = axis.z >= 0.0f ? 1.0f : -1.0f;
+	const float a = -1.0f / (sign + axis.z);
+	const float b = axis.x * axis.y * a;
+	const vec3 tangent = vec3(1.0f + sign * axis.x * axis.x * a, sign * b, -sign * axis.x);
+	const vec3 bitangent = vec3(b, sign + axis.y * axis.y * a, -axis.y);
+	return tangent * x + bitangent * y + axis * z;
+}
+
+/**
+ * Returns the direction around 'axis' with the given cosine and a random rotation.
+ */
+inline vec3 sampleCone(const vec3 &axis, float cosAngle, uint32_t &rng)
+{
+	const float sinAngle = sqrtf(std::max(0.0f, 1.0f - cosAngle * cosAngle));
+	const float phi = 2.0f * g_pi * nextRandom(rng);
+	return normalize(toWorld(axis, cosf(phi) * sinAngle, sinf(phi) * sinAngle, cosAngle));
+}
+
+inline float luminance(const vec3 &colour)
+{
+	return dot(colour, vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+/**
+ * The 'power heuristic' for multiple importance sampling (Veach), the weight of a sample taken with the density 'pdf' when it could also
+ * have been taken with 'otherPdf'.
+ */
+inline float powerHeuristic(float pdf, float otherPdf)
+{
+	return pdf * pdf / (pdf * pdf + otherPdf * otherPdf);
+}
+
+/**
+ * 1 - cos of the angle the light covers seen from 'position', or 0 when inside the light. The form avoids the cancellation in 1 - cos for
+ * small angles.
+ */
+inline float getSphereLightOneMinusCos(const SphereLight &light, const vec3 &position)
+{
+	const float sin2 = light.radius * light.radius / dot(light.position - position, light.position - position);
+	return sin2 < 1.0f ? sin2 / (1.0f + sqrtf(1.0f - sin2)) : 0.0f;
+}
+
+/**
+ * The density (per solid angle) of the directions chosen by 'sampleSphereLight', which are spread evenly over the cone of the light.
+ */
+inline float getSphereLightPdf(const SphereLight &light, const vec3 &position)
+{
+	const float oneMinusCos = getSphereLightOneMinusCos(light, position);
+	return oneMinusCos > 0.0f ? 1.0f / (2.0f * g_pi * oneMinusCos) : 0.0f;
+}
+
+/**
+ * Chooses a direction towards the light, and the distance to the light along it. Returns false if the position is inside the light.
+ */
+inline bool sampleSphereLight(const SphereLight &light, const vec3 &position, uint32_t &rng, vec3 &direction, float &distance)
+{
+	const float oneMinusCos = getSphereLightOneMinusCos(light, position);
+	if (oneMinusCos <= 0.0f)
+	{
+		return false;
+	}
+	const vec3 axis = normalize(light.position - position);
+	const float cosAngle = 1.0f - nextRandom(rng) * oneMinusCos;
+	direction = sampleCone(axis, cosAngle, rng);
+	if (!intersectRaySphere(position, direction, light.position, light.radius, distance))
+	{
+		// Only for directions at the very edge, as seen by the rounding.
+		distance = length(light.position - position) * cosAngle;
+	}
+	return true;
+}
+
+/**
+ * The physically based version of the BRDF used by 'shadeLocal' (without SIMPLE_SHADING), i.e., a lambertian diffuse and normalized
+ * Blinn-Phong specular with the Schlick Fresnel term, both divided by pi (which 'shadeLocal' leaves out since the light has no units).
+ */
+inline vec3 evalBrdf(const Material &material, const vec3 &lightDir, const vec3 &viewDir, const vec3 &normal)
+{
+	return (material.diffuseReflectance + fSpec(lightDir, viewDir, normal, material.shininess, material.baseSpecularReflectance)) / g_pi;
+}
+
+/**
+ * The probability of sampling the specular lobe, rather than the diffuse, in 'sampleBrdf', from how much each reflects.
+ */
+inline float getSpecularProbability(const Material &material)
+{
+	const float specular = luminance(material.baseSpecularReflectance);
+	const float diffuse = luminance(material.diffuseReflectance);
+	return specular + diffuse > 0.0f ? specular / (specular + diffuse) : 0.5f;
+}
+
+/**
+ * The density of the directions chosen by 'sampleBrdf': a mix of cosine weighted directions (for the diffuse part) and directions
+ * around the mirror direction, by sampling the half vector like the Blinn-Phong lobe.
+ */
+inline float getBrdfPdf(const Material &material, const vec3 &lightDir, const vec3 &viewDir, const vec3 &normal)
+{
+	const float cosAngle = dot(lightDir, normal);
+	if (cosAngle <= 0.0f)
+	{
+		return 0.0f;
+	}
+	const vec3 halfVector = normalize(lightDir + viewDir);
+	const float halfPdf = (material.shininess + 1.0f) / (2.0f * g_pi) * powf(std::max(0.0f, dot(normal, halfVector)), material.shininess);
+	const float specularPdf = halfPdf / (4.0f * std::max(1e-6f, dot(lightDir, halfVector)));
+	const float specularProbability = getSpecularProbability(material);
+	return (1.0f - specularProbability) * cosAngle / g_pi + specularProbability * specularPdf;
+}
+
+inline vec3 sampleBrdf(const Material &material, const vec3 &viewDir, const vec3 &normal, uint32_t &rng)
+{
+	if (nextRandom(rng) < getSpecularProbability(material))
+	{
+		const vec3 halfVector = sampleCone(normal, powf(nextRandom(rng), 1.0f / (material.shininess + 1.0f)), rng);
+		return glm::reflect(-viewDir, halfVector);
+	}
+	return sampleCone(normal, sqrtf(nextRandom(rng)), rng);
+}
+
+/**
+ * Traces a path from the camera, starting with the ray and the hit found for it, and returns the light arriving along it. This replaces
+ * the ambient light of 'shade' with light actually bouncing around the scene. At each bounce:
+ *   1. a direction towards the light is chosen, and if it is not in shadow the light is added (next event estimation),
+ *   2. the path continues in a direction chosen by the material, either the mirror reflection (with the weight of 'shadeLocal'),
+ *      or after the BRDF, and if the ray hits the light, this is added too.
+ * Both steps find the light reflected by the BRDF, the first is best for small lights and rough surfaces and the second for large lights
+ * and shiny surfaces, so each is weighted by how good it is at finding the direction (multiple importance sampling). The mirror
+ * reflection can only be found by the second, so it gets all the light it finds. Paths are ended by Russian roulette after a couple of
+ * bounces, and at the latest after 'g_maxDepth'. The random numbers are seeded from the first ray, so each sample takes a different path.
+ */
+vec3 tracePath(Ray ray, HitInfo hit, const SphereLight &light)
+{
+	uint32_t rng = hashRayBits(ray);
+	vec3 radiance = vec3(0.0f);
+	vec3 throughput = vec3(1.0f);
+	// The density of the BRDF sample that chose the ray, 0 for rays the light sampling cannot find, i.e., from the camera or the mirror.
+	float brdfPdf = 0.0f;
+	for (int depth = 0; ; ++depth)
+	{
+		float lightDistance;
+		if (intersectRaySphere(ray.origin, ray.direction, light.position, light.radius, lightDistance) && lightDistance < hit.time)
+		{
+			const float weight = brdfPdf > 0.0f ? powerHeuristic(brdfPdf, getSphereLightPdf(light, ray.origin)) : 1.0f;
+			return radiance + throughput * light.radiance * weight;
+		}
+		if (!hit.valid())
+		{
+			return radiance + throughput * g_backGroundColour;
+		}
+		COUNTER_ADD(shadeCalls, 1);
+
+		const Material &material = *hit.material;
+		const vec3 viewDir = -ray.direction;
+		// Shade the side that is seen, triangles may face either way.
+		const vec3 normal = dot(hit.normal, viewDir) < 0.0f ? -hit.normal : hit.normal;
+		const vec3 origin = hit.position + normal * g_rayEpsilon;
+		const vec3 mirrorWeight = material.reflectivity * F_schlick(std::max(0.0f, dot(viewDir, normal)), material.baseSpecularReflectance);
+		const float mirrorProbability = luminance(mirrorWeight) / std::max(1e-6f, luminance(mirrorWeight) + luminance(material.diffuseReflectance) + luminance(material.baseSpecularReflectance));
+
+		// 1. Light sampling.
+		vec3 lightDir;
+		if (sampleSphereLight(light, hit.position, rng, lightDir, lightDistance))
+		{
+			const float cosAngle = dot(lightDir, normal);
+			if (cosAngle > 0.0f && !isRayOccluded(makeRay(origin, lightDir), g_objects, lightDistance))
+			{
+				const float lightPdf = getSphereLightPdf(light, hit.position);
+				const float weight = powerHeuristic(lightPdf, (1.0f - mirrorProbability) * getBrdfPdf(material, lightDir, viewDir, normal));
+				radiance += throughput * evalBrdf(material, lightDir, viewDir, normal) * light.radiance * (cosAngle * weight / lightPdf);
+			}
+		}
+		if (depth >= g_maxDepth)
+		{
+			break;
+		}
+
+		// 2. Choose the next direction, and update the throughput with the weight of the sample (BRDF * cos / pdf).
+		vec3 direction;
+		if (nextRandom(rng) < mirrorProbability)
+		{
+			direction = glm::reflect(ray.direction, normal);
+			throughput *= mirrorWeight / mirrorProbability;
+			brdfPdf = 0.0f;
+		}
+		else
+		{
+			direction = sampleBrdf(material, viewDir, normal, rng);
+			const float cosAngle = dot(direction, normal);
+			brdfPdf = (1.0f - mirrorProbability) * getBrdfPdf(material, direction, viewDir, normal);
+			if (cosAngle <= 0.0f || brdfPdf <= 0.0f)
+			{
+				break;
+			}
+			throughput *= evalBrdf(material, direction, viewDir, normal) * (cosAngle / brdfPdf);
+		}
+
+		// 3. Russian roulette, paths that carry little light are likely to end, and those that survive are weighted up to make up for it.
+		if (depth >= 2)
+		{
+			const float survivalProbability = std::min(1.0f, std::max(throughput.x, std::max(throughput.y, throughput.z)));
+			if (nextRandom(rng) >= survivalProbability)
+			{
+				break;
+			}
+			throughput /= survivalProbability;
+		}
+
+		ray = makeRay(origin, direction);
+		COUNTER_ADD_RAYS(RT_Reflection, depth + 1, 1);
+		hit = findClosestIntersection(ray, g_objects);
+	}
+	return radiance;
+}
+
+/**
+ * Renders the tile with path tracing (see 'tracePath'), one path per pixel, the samples are averaged by the caller.
+ */
+void renderPathTraced(const Camera &camera, const Tile &tile, std::vector<vec3> &pixels, GBuffer *gBuffer = nullptr)
+{
+	const SphereLight light = makeSphereLight();
+	tracePrimaryRays(camera, tile, [&](int pixel, const Ray &ray, const HitInfo &hit)
+	{
+		pixels[pixel] = tracePath(ray, hit, light);
+		if (gBuffer)
+		{
+			gBuffer->store(pixel, hit);
+		}
+	});
+}
+
+
+
+/**
+ * A ray in the wavefront queue, the weight is the product of the reflection weights along the path from the camera,
+ * i.e., how much of the light found by this ray ends up in the pixel.
+ */
+struct WavefrontRay
+{
+	Ray ray;
+	vec3 weight;
+	uint32_t pixel;
+};
+
+/**
+ * Spreads out the lowest 9 bits, such that there are two zero bits between each, used to interleave x, y & z into a Morton code.
+ */
+inline uint32_t expandBits9(uint32_t v)
+{
+	v &= 0x1ff;
+	v = (v | (v << 16)) & 0x030000ff;
+	v = (v | (v << 8)) & 0x0300f00f;
+	v = (v | (v << 4)) & 0x030c30c3;
+	v = (v | (v << 2)) & 0x09249249;
+	return v;
+}
+
+/**
+ * Sorts the rays such that rays with the same direction octant (i.e., the signs of the direction) end up together, and within
+ * each octant by the Morton code of the origin. Rays that are next to each other in the queue thus start close to each other and
+ * go in roughly the same direction, which means they tend to visit the same BVH nodes and primitives, so these are more likely
+ * to be in the cache.
+ */
+void sortWavefront(std::vector<WavefrontRay> &queue)
+{
+	// 1. The Morton codes are relative to the bounds of the ray origins.
+	Aabb bounds = make_inverse_extreme_aabb();
+	for (const WavefrontRay &r : queue)
+	{
+		bounds = combine(bounds, r.ray.origin);
+	}
+	const vec3 scale = 511.0f / glm::max(bounds.max - bounds.min, vec3(1e-6f));
+
+	// 2. Make 30 bit keys, the octant in the top 3 bits and then 9 bits per axis of Morton code, and store the index of the ray
+	//    in the low 32 bits, it's cheaper to shuffle these around than the whole rays.
+	static thread_local std::vector<uint64_t> keys;
+	keys.resize(queue.size());
+	for (size_t i = 0; i < queue.size(); ++i)
+	{
+		const Ray &r = queue[i].ray;
+		glm::uvec3 cell = glm::uvec3((r.origin - bounds.min) * scale);
+		uint32_t morton = (expandBits9(cell.x) << 2) | (expandBits9(cell.y) << 1) | expandBits9(cell.z);
+		uint32_t octant = (r.direction.x < 0.0f ? 4 : 0) | (r.direction.y < 0.0f ? 2 : 0) | (r.direction.z < 0.0f ? 1 : 0);
+		keys[i] = (uint64_t((octant << 27) | morton) << 32) | uint64_t(i);
+	}
+
+	// 3. Radix sort on the keys, 10 bits at a time starting with the least significant, which is a lot faster than a
+	//    comparison sort for this many keys. Each pass is a stable counting sort, so the order from the earlier passes is kept.
+	static thread_local std::vector<uint64_t> temp;
+	temp.resize(keys.size());
+	for (int shift = 32; shift < 62; shift += 10)
+	{
+		uint32_t offsets[1024] = { 0 };
+		for (uint64_t k : keys)
+		{
+			++offsets[(k >> shift) & 1023];
+		}
+		uint32_t sum = 0;
+		for (uint32_t &o : offsets)
+		{
+			uint32_t count = o;
+			o = sum;
+			sum += count;
+		}
+		for (uint64_t k : keys)
+		{
+			temp[offsets[(k >> shift) & 1023]++] = k;
+		}
+		keys.swap(temp);
+	}
+
+	static thread_local std::vector<WavefrontRay> sorted;
+	sorted.resize(queue.size());
+	for (size_t i = 0; i < keys.size(); ++i)
+	{
+		sorted[i] = queue[uint32_t(keys[i])];
+	}
+	queue.swap(sorted);
+}
+
+/**
+ * Finds the closest intersection for all the rays in the queue. With packets enabled, runs of RayPacket::s_size consecutive rays are
+ * traced together. There is no common origin, so no frustum, but after sorting the rays in a packet mostly visit the same nodes.
+ */
+void traceWavefront(std::vector<WavefrontRay> &queue, std::vector<HitInfo> &hits)
+{
+	hits.resize(queue.size());
+#if USE_RAY_PACKETS
+	for (size_t start = 0; start < queue.size(); start += RayPacket::s_size)
+	{
+		const int count = int(std::min(queue.size() - start, size_t(RayPacket::s_size)));
+		RayPacket packet;
+		PacketMask activeMask = 0;
+		for (int lane = 0; lane < RayPacket::s_size; ++lane)
+		{
+			// Unused lanes are filled with a copy of the last ray, to not have to deal with garbage in the SIMD code.
+			const Ray &r = queue[start + std::min(lane, count - 1)].ray;
+			packet.setRay(lane, r.origin, r.direction, HitInfo::s_missTime);
+			activeMask |= PacketMask(lane < count ? 1 : 0) << lane;
+		}
+		HitInfo packetHits[RayPacket::s_size];
+		findClosestIntersections(packet, activeMask, packetHits, g_objects);
+		std::copy(packetHits, packetHits + count, hits.begin() + start);
+	}
+#else // !USE_RAY_PACKETS
+	for (size_t i = 0; i < queue.size(); ++i)
+	{
+		hits[i] = findClosestIntersection(queue[i].ray, g_objects);
+	}
+#endif // USE_RAY_PACKETS
+}
+
+#if USE_BATCHED_SHADING
+
+/**
+ * The hits of one bounce (or a tile of camera rays), laid out for 'shadeBatch' as a structure of arrays: the inputs to the shading model
+ * gathered from the hits and their materials, and the results. The arrays have room for a whole number of SIMD registers, so that the
+ * shading model can be evaluated for g_simdWidth hits at a time, whatever mix of materials they have.
+ */
+struct ShadingBatch
+{
+	// Inputs, the simple model (SIMPLE_SHADING) only uses the position, normal, diffuse colour and reflectivity.
+	std::vector<float> position[3];
+	std::vector<float> normal[3];
+	std::vector<float> direction[3];
+	std::vector<float> diffuse[3];
+	std::vector<float> specular[3];
+	std::vector<float> shininess;
+	std::vector<float> reflectivity;
+	// Results: the light reflected from the ambient light and, unless the shadow ray is blocked, from the light, the direction and
+	// distance to the light (for the shadow ray, which is only traced if 'cosAngle' is positive), and the reflection weight.
+	std::vector<float> ambient[3];
+	std::vector<float> direct[3];
+	std::vector<float> lightDir[3];
+	std::vector<float> lightDistance;
+	std::vector<float> cosAngle;
+	std::vector<float> reflectionWeight[3];
+	// The ray that hit in each lane, with its path weight and pixel.
+	std::vector<WavefrontRay> rays;
+	size_t count;
+
+	ShadingBatch() : count(0) { }
+
+	/**
+	 * Empties the batch, making sure there is room for 'maxCount' hits.
+	 */
+	void clear(size_t maxCount)
+	{
+		count = 0;
+		const size_t size = maxCount + g_simdWidth;
+		if (shininess.size() >= size)
+		{
+			return;
+		}
+		for (int c = 0; c < 3; ++c)
+		{
+			position[c].resize(size);
+			normal[c].resize(size);
+			direction[c].resize(size);
+			diffuse[c].resize(size);
+			specular[c].resize(size);
+			ambient[c].resize(size);
+			direct[c].resize(size);
+			lightDir[c].resize(size);
+			reflectionWeight[c].resize(size);
+		}
+		shininess.resize(size);
+		reflectivity.resize(size);
+		lightDistance.resize(size);
+		cosAngle.resize(size);
+		rays.resize(size);
+	}
+
+	/**
+	 * Adds the (valid) hit of the ray.
+	 */
+	inline void add(const WavefrontRay &ray, const HitInfo &hit)
+	{
+		const Material &material = *hit.material;
+		for (int c = 0; c < 3; ++c)
+		{
+			position[c][count] = hit.position[c];
+			normal[c][count] = hit.normal[c];
+			diffuse[c][count] = material.diffuseReflectance[c];
+#if !SIMPLE_SHADING
+			direction[c][count] = ray.ray.direction[c];
+			specular[c][count] = material.baseSpecularReflectance[c];
+#endif // !SIMPLE_SHADING
+		}
+#if !SIMPLE_SHADING
+		shininess[count] = material.shininess;
+#endif // !SIMPLE_SHADING
+		reflectivity[count] = material.reflectivity;
+		rays[count] = ray;
+		++count;
+	}
+};
+
+/**
+ * The SIMD version of 'F_schlick', for one channel of 'r0'.
+ */
+inline SimdFloat simdSchlick(SimdFloat cosAngle, SimdFloat r0)
+{
+	const SimdFloat a = simdSub(simdSet(1.0f), cosAngle);
+	const SimdFloat a2 = simdMul(a, a);
+	return simdAdd(r0, simdMul(simdSub(simdSet(1.0f), r0), simdMul(simdMul(a2, a2), a)));
+}
+
+/**
+ * Evaluates the shading model of 'shadeLocal' for the lanes [start, start + g_simdWidth) of the batch, apart from the shadow ray.
+ */
+inline void shadeBatchLanes(ShadingBatch &b, size_t start, int depth)
+{
+	SimdFloat p[3], n[3], l[3];
+	for (int c = 0; c < 3; ++c)
+	{
+		p[c] = simdLoad(b.position[c].data() + start);
+		n[c] = simdLoad(b.normal[c].data() + start);
+		l[c] = simdSub(simdSet(g_lightPosition[c]), p[c]);
+	}
+	// 1. The direction and distance to the light, and the cosine of the angle to the normal.
+	const SimdFloat lightDistance = simdSqrt(simdAdd(simdAdd(simdMul(l[0], l[0]), simdMul(l[1], l[1])), simdMul(l[2], l[2])));
+	const SimdFloat invLightDistance = simdDiv(simdSet(1.0f), lightDistance);
+	for (int c = 0; c < 3; ++c)
+	{
+		l[c] = simdMul(l[c], invLightDistance);
+		simdStore(b.lightDir[c].data() + start, l[c]);
+	}
+	const SimdFloat cosAngle = simdAdd(simdAdd(simdMul(l[0], n[0]), simdMul(l[1], n[1])), simdMul(l[2], n[2]));
+	const SimdFloat clampedCosAngle = simdMax(cosAngle, simdZero());
+	simdStore(b.lightDistance.data() + start, lightDistance);
+	simdStore(b.cosAngle.data() + start, cosAngle);
+
+	const SimdFloat reflectivity = simdLoad(b.reflectivity.data() + start);
+	const SimdFloat canReflect = depth < g_maxDepth ? simdCmpGt(reflectivity, simdZero()) : simdZero();
+#if SIMPLE_SHADING
+	// 2. Lambertian diffuse, and a constant reflection weight.
+	for (int c = 0; c < 3; ++c)
+	{
+		const SimdFloat diffuse = simdLoad(b.diffuse[c].data() + start);
+		simdStore(b.ambient[c].data() + start, simdMul(diffuse, simdSet(g_ambientLight[c])));
+		simdStore(b.direct[c].data() + start, simdMul(diffuse, simdMul(simdSet(g_lightColour[c]), clampedCosAngle)));
+		simdStore(b.reflectionWeight[c].data() + start, simdAnd(canReflect, reflectivity));
+	}
+#else // !SIMPLE_SHADING
+	// 2. The half vector between the light and view directions, for the normalized Blinn-Phong specular.
+	SimdFloat d[3], h[3];
+	for (int c = 0; c < 3; ++c)
+	{
+		d[c] = simdLoad(b.direction[c].data() + start);
+		h[c] = simdSub(l[c], d[c]);
+	}
+	const SimdFloat invHalfLength = simdDiv(simdSet(1.0f), simdSqrt(simdAdd(simdAdd(simdMul(h[0], h[0]), simdMul(h[1], h[1])), simdMul(h[2], h[2]))));
+	for (int c = 0; c < 3; ++c)
+	{
+		h[c] = simdMul(h[c], invHalfLength);
+	}
+	const SimdFloat cosHalfNormal = simdMax(simdAdd(simdAdd(simdMul(n[0], h[0]), simdMul(n[1], h[1])), simdMul(n[2], h[2])), simdZero());
+	const SimdFloat cosHalfLight = simdMax(simdAdd(simdAdd(simdMul(l[0], h[0]), simdMul(l[1], h[1])), simdMul(l[2], h[2])), simdZero());
+	const SimdFloat cosViewNormal = simdMax(simdSub(simdZero(), simdAdd(simdAdd(simdMul(d[0], n[0]), simdMul(d[1], n[1])), simdMul(d[2], n[2]))), simdZero());
+	const SimdFloat shininess = simdLoad(b.shininess.data() + start);
+	const SimdFloat blinnPhong = simdMul(simdMul(simdAdd(shininess, simdSet(2.0f)), simdSet(0.5f)), simdPow(cosHalfNormal, shininess));
+
+	// 3. Lambertian diffuse plus specular, and the reflection weight from the Fresnel term, which must be positive in all channels.
+	SimdFloat reflectionWeight[3];
+	SimdFloat reflects = canReflect;
+	for (int c = 0; c < 3; ++c)
+	{
+		const SimdFloat diffuse = simdLoad(b.diffuse[c].data() + start);
+		const SimdFloat r0 = simdLoad(b.specular[c].data() + start);
+		const SimdFloat specular = simdMul(blinnPhong, simdSchlick(cosHalfLight, r0));
+		simdStore(b.ambient[c].data() + start, simdMul(diffuse, simdSet(g_ambientLight[c])));
+		simdStore(b.direct[c].data() + start, simdMul(simdAdd(diffuse, specular), simdMul(simdSet(g_lightColour[c]), clampedCosAngle)));
+		reflectionWeight[c] = simdMul(reflectivity, simdSchlick(cosViewNormal, r0));
+		reflects = simdAnd(reflects, simdCmpGt(reflectionWeight[c], simdZero()));
+	}
+	for (int c = 0; c < 3; ++c)
+	{
+		simdStore(b.reflectionWeight[c].data() + start, simdAnd(reflects, reflectionWeight[c]));
+	}
+#endif // SIMPLE_SHADING
+}
+
+/**
+ * Shades the hits in the batch in one go, the batched version of calling 'shadeLocal' for each: the shading model is evaluated
+ * g_simdWidth hits at a time (see 'shadeBatchLanes'), and then the shadow rays are traced and the reflection rays that are worth tracing
+ * (see 'continuePath') are added to 'nextQueue', or if it is null, traced right away (recursively, like 'shade'). The light is added
+ * to 'pixels', weighted by the path weight of each ray.
+ */
+void shadeBatch(ShadingBatch &b, int depth, std::vector<vec3> &pixels, std::vector<WavefrontRay> *nextQueue)
+{
+	const size_t count = b.count;
+	if (count == 0)
+	{
+		return;
+	}
+	// 1. The unused lanes at the end are filled with a copy of the last hit, to not have to deal with garbage in the SIMD code.
+	const size_t paddedCount = (count + g_simdWidth - 1) & ~size_t(g_simdWidth - 1);
+	for (size_t i = count; i < paddedCount; ++i)
+	{
+		for (int c = 0; c < 3; ++c)
+		{
+			b.position[c][i] = b.position[c][count - 1];
+			b.normal[c][i] = b.normal[c][count - 1];
+			b.diffuse[c][i] = b.diffuse[c][count - 1];
+#if !SIMPLE_SHADING
+			b.direction[c][i] = b.direction[c][count - 1];
+			b.specular[c][i] = b.specular[c][count - 1];
+#endif // !SIMPLE_SHADING
+		}
+#if !SIMPLE_SHADING
+		b.shininess[i] = b.shininess[count - 1];
+#endif // !SIMPLE_SHADING
+		b.reflectivity[i] = b.reflectivity[count - 1];
+	}
+
+	// 2. The shading model.
+	for (size_t start = 0; start < paddedCount; start += g_simdWidth)
+	{
+		shadeBatchLanes(b, start, depth);
+	}
+
+	// 3. The shadow and reflection rays.
+	COUNTER_ADD(shadeCalls, count);
+	for (size_t j = 0; j < count; ++j)
+	{
+		const WavefrontRay &r = b.rays[j];
+		const vec3 position = vec3(b.position[0][j], b.position[1][j], b.position[2][j]);
+		const vec3 normal = vec3(b.normal[0][j], b.normal[1][j], b.normal[2][j]);
+		vec3 light = vec3(b.ambient[0][j], b.ambient[1][j], b.ambient[2][j]);
+		if (b.cosAngle[j] > 0.0f)
+		{
+			const vec3 lightDir = vec3(b.lightDir[0][j], b.lightDir[1][j], b.lightDir[2][j]);
+			if (!isRayOccluded(makeRay(position + normal * g_rayEpsilon, lightDir), g_objects, b.lightDistance[j]))
+			{
+				light += vec3(b.direct[0][j], b.direct[1][j], b.direct[2][j]);
+			}
+		}
+		pixels[r.pixel] += r.weight * light;
+
+		vec3 reflectionWeight = vec3(b.reflectionWeight[0][j], b.reflectionWeight[1][j], b.reflectionWeight[2][j]);
+		if (reflectionWeight != vec3(0.0f))
+		{
+			const Ray reflectionRay = makeRay(position + normal * g_rayEpsilon, glm::reflect(r.ray.direction, normal));
+			vec3 reflectionPathWeight = continuePath(reflectionRay, r.weight, reflectionWeight);
+			if (reflectionWeight != vec3(0.0f) && nextQueue)
+			{
+				WavefrontRay next = { reflectionRay, reflectionPathWeight, r.pixel };
+				nextQueue->push_back(next);
+			}
+			else if (reflectionWeight != vec3(0.0f))
+			{
+				pixels[r.pixel] += r.weight * (trace(reflectionRay, g_objects, depth + 1, reflectionPathWeight) * reflectionWeight);
+			}
+		}
+	}
+}
+
+#endif // USE_BATCHED_SHADING
+
+/**
+ * Renders the tile depth first: each pixel is completely shaded before moving on to the next, with 'shade' tracing the
+ * reflections recursively. If 'gBuffer' is given, the first hit of each pixel is stored there. With USE_BATCHED_SHADING, the hits of
+ * the camera rays are shaded together first (see 'shadeBatch'), and then the reflections are traced recursively for each.
+ */
+void renderRecursive(const Camera &camera, const Tile &tile, std::vector<vec3> &pixels, GBuffer *gBuffer = nullptr)
+{
+#if USE_BATCHED_SHADING
+	static thread_local ShadingBatch batch;
+	batch.clear(size_t(tile.x1 - tile.x0) * size_t(tile.y1 - tile.y0));
+	tracePrimaryRays(camera, tile, [&](int pixel, const Ray &ray, const HitInfo &hit)
+	{
+		if (hit.valid())
+		{
+			WavefrontRay r = { ray, vec3(1.0f), uint32_t(pixel) };
+			pixels[pixel] = vec3(0.0f);
+			batch.add(r, hit);
+		}
+		else
+		{
+			pixels[pixel] = g_backGroundColour;
+		}
+		if (gBuffer)
+		{
+			gBuffer->store(pixel, hit);
+		}
+	});
+	shadeBatch(batch, 0, pixels, nullptr);
+#else // !USE_BATCHED_SHADING
+	tracePrimaryRays(camera, tile, [&](int pixel, const Ray &ray, const HitInfo &hit)
+	{
+		pixels[pixel] = hit.valid() ? shade(ray, hit, 0, vec3(1.0f)) : g_backGroundColour;
+		if (gBuffer)
+		{
+			gBuffer->store(pixel, hit);
+		}
+	});
+#endif // USE_BATCHED_SHADING
+}
+
+/**
+ * Renders the tile breadth first (a.k.a., wavefront), one bounce at a time. The primary rays are traced and shaded, and the
+ * reflection rays they spawn are gathered in a queue. This is then sorted, traced and shaded in bulk, producing the queue
+ * for the next bounce, until no more rays are spawned (at the latest when 'g_maxDepth' is reached). The result is the same
+ * as 'renderRecursive', but the contribution of each ray is added to the pixel weighted by the product of the reflection weights.
+ */
+void renderWavefront(const Camera &camera, const Tile &tile, std::vector<vec3> &pixels, GBuffer *gBuffer = nullptr)
+{
+	for (int y = tile.y0; y < tile.y1; ++y)
+	{
+		std::fill(pixels.begin() + y * camera.width + tile.x0, pixels.begin() + y * camera.width + tile.x1, vec3(0.0f));
+	}
+
+	// The queues are kept between tiles (one set per thread), to not allocate memory for every tile.
+	static thread_local std::vector<WavefrontRay> queue;
+	static thread_local std::vector<WavefrontRay> nextQueue;
+	static thread_local std::vector<HitInfo> hits;
+	nextQueue.clear();
+
+#if !USE_BATCHED_SHADING
+	auto shadeHit = [&](uint32_t pixel, const Ray &ray, const HitInfo &hit, const vec3 &weight, int depth)
+	{
+		if (!hit.valid())
+		{
+			pixels[pixel] += weight * g_backGroundColour;
+			return;
+		}
+		Ray reflectionRay;
+		vec3 reflectionWeight;
+		pixels[pixel] += weight * shadeLocal(ray, hit, depth, reflectionRay, reflectionWeight);
+		vec3 reflectionPathWeight = continuePath(reflectionRay, weight, reflectionWeight);
+		if (reflectionWeight != vec3(0.0f))
+		{
+			WavefrontRay r = { reflectionRay, reflectionPathWeight, pixel };
+			nextQueue.push_back(r);
+		}
+	};
+#endif // !USE_BATCHED_SHADING
+
+#if USE_BATCHED_SHADING
+	// The hits are gathered into a batch and shaded together, see 'shadeBatch', the misses get the background colour right away.
+	static thread_local ShadingBatch batch;
+	auto addHit = [&](const WavefrontRay &r, const HitInfo &hit)
+	{
+		if (!hit.valid())
+		{
+			pixels[r.pixel] += r.weight * g_backGroundColour;
+			return;
+		}
+		batch.add(r, hit);
+	};
+
+	// 1. The primary rays are coherent to begin with, so these are traced directly.
+	batch.clear(size_t(tile.x1 - tile.x0) * size_t(tile.y1 - tile.y0));
+	tracePrimaryRays(camera, tile, [&](int pixel, const Ray &ray, const HitInfo &hit)
+	{
+		WavefrontRay r = { ray, vec3(1.0f), uint32_t(pixel) };
+		addHit(r, hit);
+		if (gBuffer)
+		{
+			gBuffer->store(pixel, hit);
+		}
+	});
+	shadeBatch(batch, 0, pixels, &nextQueue);
+#else // !USE_BATCHED_SHADING
+	// 1. The primary rays are coherent to begin with, so these are traced directly.
+	tracePrimaryRays(camera, tile, [&](int pixel, const Ray &ray, const HitInfo &hit)
+	{
+		shadeHit(uint32_t(pixel), ray, hit, vec3(1.0f), 0);
+		if (gBuffer)
+		{
+			gBuffer->store(pixel, hit);
+		}
+	});
+#endif // USE_BATCHED_SHADING
+
+	// 2. Process the bounces until no more rays are spawned.
+	for (int depth = 1; !nextQueue.empty(); ++depth)
+	{
+		queue.swap(nextQueue);
+		nextQueue.clear();
+
+		sortWavefront(queue);
+		traceWavefront(queue, hits);
+		COUNTER_ADD_RAYS(RT_Reflection, depth, queue.size());
+#if USE_BATCHED_SHADING
+		batch.clear(queue.size());
+		for (size_t i = 0; i < queue.size(); ++i)
+		{
+			addHit(queue[i], hits[i]);
+		}
+		shadeBatch(batch, depth, pixels, &nextQueue);
+#else // !USE_BATCHED_SHADING
+		for (size_t i = 0; i < queue.size(); ++i)
+		{
+			shadeHit(queue[i].pixel, queue[i].ray, hits[i], queue[i].weight, depth);
+		}
+#endif // USE_BATCHED_SHADING
+	}
+}
+
+
+
+inline void renderTile(const Camera &camera, const Tile &tile, std::vector<vec3> &pixels, GBuffer *gBuffer = nullptr)
+{
+	if (g_pathTracing)
+	{
+		renderPathTraced(camera, tile, pixels, gBuffer);
+		return;
+	}
+#if USE_WAVEFRONT
+	renderWavefront(camera, tile, pixels, gBuffer);
+#else // !USE_WAVEFRONT
+	renderRecursive(camera, tile, pixels, gBuffer);
+#endif // USE_WAVEFRONT
+}
+
+/**
+ * Renders the tiles [firstTile, firstTile + numTiles) into 'pixels', which must have room for camera.width * camera.height pixels,
+ * as linear colours.
+ * It is trivial to use all the processor cores since rays are independent, but the cost of pixels varies a lot, e.g., pixels
+ * covering reflective spheres are far more expensive than the background. Therefore the image is split into many small tiles that
+ * are handed out by the work stealing thread pool, so that threads that get cheap tiles steal from those that get expensive ones.
+ */
+void renderTiles(const Camera &camera, int firstTile, int numTiles, std::vector<vec3> &pixels, ThreadPool &threadPool, GBuffer *gBuffer = nullptr)
+{
+	threadPool.parallelFor(numTiles, [&](int taskIndex, int)
+	{
+		renderTile(camera, getTile(camera, firstTile + taskIndex), pixels, gBuffer);
+	});
+}
+
+/**
+ * Returns the i:th number of the van der Corput sequence in the given base, i.e., the digits of i mirrored around the decimal point.
+ * Used in pairs (bases 2 & 3, a.k.a. the Halton sequence) to place the samples in a pixel, since these cover the pixel more evenly
+ * than random samples.
+ */
+inline float radicalInverse(int i, int base)
+{
+	float result = 0.0f;
+	float digitWeight = 1.0f / float(base);
+	for (; i > 0; i /= base)
+	{
+		result += float(i % base) * digitWeight;
+		digitWeight /= float(base);
+	}
+	return result;
+}
+
+/**
+ * Returns the position within the pixel of the i:th sample, the first is in the corner of the pixel, where the single sample is placed.
+ */
+inline vec2 getSampleOffset(int i)
+{
+	return vec2(radicalInverse(i, 2), radicalInverse(i, 3));
+}
+
+/**
+ * Renders the whole image into the frame buffer, which is resized to match the camera, averaging 'numSamples' samples for each pixel.
+ * Each tile is packed as soon as it is done, see 'renderTiles'. The samples after the first are rendered to 'samplePixels', which is
+ * kept by the caller so that it is not allocated every frame, it is not used for a single sample. If 'gBuffer' is given, the first hits
+ * of the first sample are stored there.
+ */
+void renderImage(const Camera &camera, int numSamples, FrameBuffer &frameBuffer, std::vector<vec3> &samplePixels, ThreadPool &threadPool, GBuffer *gBuffer = nullptr)
+{
+	frameBuffer.resize(camera.width, camera.height);
+	if (numSamples > 1)
+	{
+		samplePixels.resize(camera.width * camera.height);
+	}
+	if (gBuffer)
+	{
+		gBuffer->resize(camera.width, camera.height);
+	}
+	std::vector<vec3> &pixels = frameBuffer.getPixels();
+	threadPool.parallelFor(getNumTiles(camera), [&](int tileIndex, int)
+	{
+		const Tile tile = getTile(camera, tileIndex);
+		renderTile(camera, tile, pixels, gBuffer);
+		for (int s = 1; s < numSamples; ++s)
+		{
+			renderTile(makeSampleCamera(camera, 1, getSampleOffset(s)), tile, samplePixels);
+			for (int y = tile.y0; y < tile.y1; ++y)
+			{
+				for (int x = tile.x0; x < tile.x1; ++x)
+				{
+					pixels[y * camera.width + x] += samplePixels[y * camera.width + x];
+				}
+			}
+		}
+		if (numSamples > 1)
+		{
+			for (int y = tile.y0; y < tile.y1; ++y)
+			{
+				for (int x = tile.x0; x < tile.x1; ++x)
+				{
+					pixels[y * camera.width + x] /= float(numSamples);
+				}
+			}
+		}
+		frameBuffer.pack(tile.x0, tile.y0, tile.x1, tile.y1);
+	});
+}
+
+/**
+ * Returns how different two linear colours look, as the largest difference of the square roots of the channels, since the square root
+ * is about how the eye (and sRGB) spreads out the levels. So 0.1 is roughly 25 steps of the 8-bit output, in any part of the range.
+ */
+inline float getContrast(const vec3 &a, const vec3 &b)
+{
+	vec3 d = abs(sqrt(max(a, vec3(0.0f))) - sqrt(max(b, vec3(0.0f))));
+	return std::max(d.x, std::max(d.y, d.z));
+}
+
+/**
+ * Renders the whole image into the frame buffer with adaptive antialiasing: only the pixels on edges get more samples, instead of
+ * all the pixels as with 'renderImage'. This is done in three steps, each over all the tiles, since each step needs the neighbouring
+ * tiles to be done with the last:
+ *   1. one sample per pixel is traced, as usual, also storing the first hits in the G-buffer,
+ *   2. the pixels that differ from their neighbours, in colour (see 'getContrast') or surface, are marked for refinement,
+ *   3. the marked pixels get 'maxSamples' samples.
+ * The samples are placed like those of 'renderImage' (see 'getSampleOffset'), so a refined pixel gets the same colour as with
+ * 'maxSamples' samples for every pixel. (Stopping after a few samples if these agree saves little, since few pixels are refined anyway,
+ * but misses many thin details.) The pixels on the edges are too scattered for the usual packets of neighbouring pixels, instead the
+ * extra samples of each tile are gathered in a queue and traced like the rays of a wavefront (see 'traceWavefront'), so the samples of
+ * a pixel end up in the same packet. 'refine' is kept by the caller, like 'samplePixels' for 'renderImage'. Returns the total number of
+ * samples traced.
+ */
+uint64_t renderImageAdaptive(const Camera &camera, int maxSamples, FrameBuffer &frameBuffer, GBuffer &gBuffer, std::vector<uint8_t> &refine, ThreadPool &threadPool)
+{
+	frameBuffer.resize(camera.width, camera.height);
+	gBuffer.resize(camera.width, camera.height);
+	refine.resize(camera.width * camera.height);
+	std::vector<vec3> &pixels = frameBuffer.getPixels();
+	const int numTiles = getNumTiles(camera);
+
+	// 1. One sample per pixel.
+	threadPool.parallelFor(numTiles, [&](int tileIndex, int)
+	{
+		renderTile(camera, getTile(camera, tileIndex), pixels, &gBuffer);
+	});
+
+	// 2. The single sample is in the (lower left) corner of the pixel, so the pixel covers the square between its own sample and those
+	//    of the neighbours to the right and above, which is where an edge that needs more samples would be.
+	const uint32_t *surfaceIds = gBuffer.getSurfaceIds();
+	threadPool.parallelFor(numTiles, [&](int tileIndex, int)
+	{
+		const Tile tile = getTile(camera, tileIndex);
+		for (int y = tile.y0; y < tile.y1; ++y)
+		{
+			for (int x = tile.x0; x < tile.x1; ++x)
+			{
+				const int pixel = y * camera.width + x;
+				bool edge = false;
+				for (int n = 1; n < 4 && !edge; ++n)
+				{
+					const int nx = std::min(x + (n & 1), camera.width - 1);
+					const int ny = std::min(y + (n >> 1), camera.height - 1);
+					const int neighbour = ny * camera.width + nx;
+					edge = surfaceIds[neighbour] != surfaceIds[pixel] || getContrast(pixels[neighbour], pixels[pixel]) > g_adaptiveContrast;
+				}
+				refine[pixel] = edge ? 1 : 0;
+			}
+		}
+	});
+
+	// 3. Refine the marked pixels.
+	std::atomic<int> numRefined(0);
+	const float sampleWeight = 1.0f / float(maxSamples);
+	threadPool.parallelFor(numTiles, [&](int tileIndex, int)
+	{
+		const Tile tile = getTile(camera, tileIndex);
+		static thread_local std::vector<WavefrontRay> queue;
+		static thread_local std::vector<HitInfo> hits;
+		queue.clear();
+		for (int y = tile.y0; y < tile.y1; ++y)
+		{
+			for (int x = tile.x0; x < tile.x1; ++x)
+			{
+				const int pixel = y * camera.width + x;
+				if (refine[pixel])
+				{
+					pixels[pixel] *= sampleWeight;
+					for (int s = 1; s < maxSamples; ++s)
+					{
+						WavefrontRay r = { generatePinHolePrimaryRay(x, y, makeSampleCamera(camera, 1, getSampleOffset(s))), vec3(sampleWeight), uint32_t(pixel) };
+						queue.push_back(r);
+					}
+				}
+			}
+		}
+		traceWavefront(queue, hits);
+		COUNTER_ADD_RAYS(RT_Primary, 0, queue.size());
+		const SphereLight light = makeSphereLight();
+#if USE_BATCHED_SHADING
+		// The hits are shaded together into 'samples' (the batch rays index the queue), with a path weight of one like 'shade' below, and
+		// then added to the pixels with the sample weight.
+		static thread_local ShadingBatch batch;
+		static thread_local std::vector<vec3> samples;
+		batch.clear(queue.size());
+		samples.assign(queue.size(), vec3(0.0f));
+#endif // USE_BATCHED_SHADING
+		for (size_t i = 0; i < queue.size(); ++i)
+		{
+			if (g_pathTracing)
+			{
+				pixels[queue[i].pixel] += queue[i].weight * tracePath(queue[i].ray, hits[i], light);
+			}
+#if USE_BATCHED_SHADING
+			else if (hits[i].valid())
+			{
+				WavefrontRay r = { queue[i].ray, vec3(1.0f), uint32_t(i) };
+				batch.add(r, hits[i]);
+			}
+#endif // USE_BATCHED_SHADING
+			else
+			{
+				pixels[queue[i].pixel] += queue[i].weight * (hits[i].valid() ? shade(queue[i].ray, hits[i], 0, vec3(1.0f)) : g_backGroundColour);
+			}
+		}
+#if USE_BATCHED_SHADING
+		shadeBatch(batch, 0, samples, nullptr);
+		for (size_t j = 0; j < batch.count; ++j)
+		{
+			const WavefrontRay &sample = queue[batch.rays[j].pixel];
+			pixels[sample.pixel] += sample.weight * samples[batch.rays[j].pixel];
+		}
+#endif // USE_BATCHED_SHADING
+		numRefined += int(queue.size()) / std::max(1, maxSamples - 1);
+		frameBuffer.pack(tile.x0, tile.y0, tile.x1, tile.y1);
+	});
+	return uint64_t(camera.width) * uint64_t(camera.height) + uint64_t(numRefined) * uint64_t(maxSamples - 1);
+}
+
+/**
+ * Filters the noise from 'pixels' (scaled by 'scale') using the first hits in the G-buffer (see Denoiser), and packs the result into the
+ * frame buffer. 'denoisedPixels' may be the same as 'pixels'. Returns the time taken, in seconds.
+ */
+double denoiseImage(const Camera &camera, const std::vector<vec3> &pixels, float scale, const GBuffer &gBuffer, std::vector<vec3> &denoisedPixels, FrameBuffer &frameBuffer, ThreadPool &threadPool)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+	g_denoiser.denoise(pixels, scale, gBuffer, denoisedPixels, threadPool);
+	threadPool.parallelFor(getNumTiles(camera), [&](int tileIndex, int)
+	{
+		const Tile tile = getTile(camera, tileIndex);
+		frameBuffer.pack(denoisedPixels, tile.x0, tile.y0, tile.x1, tile.y1);
+	});
+	return std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+/**
+ * What is kept of the last frame traced by 'renderImageReprojected', to reuse in the next.
+ */
+struct ReprojectionState
+{
+	ReprojectionState() : camera(), sceneVersion(0), frame(0) { }
+
+	Camera camera;
+	uint32_t sceneVersion;
+	vec3 lightPosition;
+	vec3 lightColour;
+	// Counts the frames, to pick the pixels that are refreshed, see 'isRefreshedPixel'.
+	int frame;
+	// The linear colours and the first hits of the last frame, the colours are empty before the first frame.
+	std::vector<vec3> pixels;
+	GBuffer gBuffer;
+	// The frame being traced goes into these, which are then swapped with the above, so nothing is copied.
+	std::vector<vec3> nextPixels;
+	GBuffer nextGBuffer;
+};
+
+/**
+ * The inverse of 'generatePinHolePrimaryRay', set up once for projecting many positions into the image of a camera.
+ */
+struct CameraProjection
+{
+	vec3 position;
+	vec3 dir;
+	// The image plane axes, scaled so that the dot product with a position (relative to the camera) divided by its depth is in pixels.
+	vec3 xAxis;
+	vec3 yAxis;
+	// Added to get the pixel coordinates, including 0.5 to round them to the nearest pixel.
+	vec2 offset;
+	int width;
+	int height;
+};
+
+CameraProjection makeCameraProjection(const Camera &c)
+{
+	CameraProjection p;
+	p.position = c.position;
+	p.dir = c.dir;
+	p.xAxis = c.left / (c.tanHalfFovY * c.aspectRatio * c.pixelSize.x);
+	p.yAxis = c.up / (c.tanHalfFovY * c.pixelSize.y);
+	p.offset = 1.0f / c.pixelSize - c.sampleOffset + 0.5f;
+	p.width = c.width;
+	p.height = c.height;
+	return p;
+}
+
+/**
+ * Returns the pixel whose sample is closest to where 'position' is seen, or -1 if it is outside the image or behind the camera.
+ */
+inline int projectToPixel(const CameraProjection &p, const vec3 &position)
+{
+	const vec3 v = position - p.position;
+	const float z = dot(v, p.dir);
+	if (z <= 0.0f)
+	{
+		return -1;
+	}
+	const float invZ = 1.0f / z;
+	const int x = int(floorf(dot(v, p.xAxis) * invZ + p.offset.x));
+	const int y = int(floorf(dot(v, p.yAxis) * invZ + p.offset.y));
+	if (x < 0 || y < 0 || x >= p.width || y >= p.height)
+	{
+		return -1;
+	}
+	return y * p.width + x;
+}
+
+/**
+ * Returns true if the pixel is shaded again this frame even if it could be reprojected. The pixels take turns, in a scattered pattern,
+ * so that each is refreshed every 'g_reprojectionRefreshPeriod' frames.
+ */
+inline bool isRefreshedPixel(int pixel, int frame)
+{
+	return int(((uint32_t(pixel) * 0x9E3779B9U) >> 16) % uint32_t(g_reprojectionRefreshPeriod)) == frame % g_reprojectionRefreshPeriod;
+}
+
+/**
+ * Renders the whole image with one sample per pixel, like 'renderImage', but reuses the colours of the last frame where possible, which
+ * saves most of the shading (i.e., the shadow and reflection rays, or the paths) when the camera moves slowly.
+ * The camera rays are still traced (which is cheap, since they are traced in packets), and the first hit of each pixel is projected into
+ * the last camera. If the last frame saw the same surface there, i.e., with about the same depth and normal, and the same surface id, its
+ * colour is used. Otherwise, e.g., where the surface was hidden in the last frame or outside the image, the pixel is shaded as usual.
+ * The reused colours lag behind for the view dependent shading (e.g., reflections), so a few pixels are shaded again every frame anyway,
+ * see 'isRefreshedPixel'. Nothing is reused if the scene or the light has changed. The first hits end up in 'state.gBuffer'. Returns
+ * the number of pixels that were reprojected.
+ */
+uint64_t renderImageReprojected(const Camera &camera, FrameBuffer &frameBuffer, ReprojectionState &state, ThreadPool &threadPool)
+{
+	frameBuffer.resize(camera.width, camera.height);
+	std::vector<vec3> &pixels = frameBuffer.getPixels();
+	GBuffer &gBuffer = state.nextGBuffer;
+	gBuffer.resize(camera.width, camera.height);
+	std::vector<vec3> &nextPixels = state.nextPixels;
+	nextPixels.resize(pixels.size());
+	const bool hasLastFrame = !state.pixels.empty() && state.sceneVersion == g_sceneVersion && state.lightPosition == g_lightPosition
+		&& state.lightColour == g_lightColour;
+	// Only used when there is a last frame, before the first frame the camera is not set up.
+	const CameraProjection lastCamera = hasLastFrame ? makeCameraProjection(state.camera) : CameraProjection();
+	const GBuffer &lastHits = state.gBuffer;
+	const SphereLight light = makeSphereLight();
+
+	std::atomic<uint64_t> numReprojected(0);
+	threadPool.parallelFor(getNumTiles(camera), [&](int tileIndex, int)
+	{
+		const Tile tile = getTile(camera, tileIndex);
+		uint64_t tileReprojected = 0;
+#if USE_BATCHED_SHADING
+		// The hits that are not reprojected are shaded together into 'nextPixels' once the whole tile is traced, see 'renderRecursive'.
+		static thread_local ShadingBatch batch;
+		batch.clear(size_t(tile.x1 - tile.x0) * size_t(tile.y1 - tile.y0));
+#endif // USE_BATCHED_SHADING
+		tracePrimaryRays(camera, tile, [&](int pixel, const Ray &ray, const HitInfo &hit)
+		{
+			gBuffer.store(pixel, hit);
+			const int lastPixel = hasLastFrame && hit.valid() && !isRefreshedPixel(pixel, state.frame) ? projectToPixel(lastCamera, hit.position) : -1;
+			if (lastPixel >= 0 && lastHits.getSurfaceIds()[lastPixel] == GBuffer::getSurfaceId(hit))
+			{
+				const float depth = length(hit.position - lastCamera.position);
+				const vec3 lastNormal = vec3(lastHits.getNormal(0)[lastPixel], lastHits.getNormal(1)[lastPixel], lastHits.getNormal(2)[lastPixel]);
+				if (fabsf(lastHits.getDepth()[lastPixel] - depth) < g_reprojectionDepthTolerance * depth && dot(lastNormal, hit.normal) > g_reprojectionMinCosNormal)
+				{
+					pixels[pixel] = nextPixels[pixel] = state.pixels[lastPixel];
+					++tileReprojected;
+					return;
+				}
+			}
+			if (g_pathTracing)
+			{
+				pixels[pixel] = nextPixels[pixel] = tracePath(ray, hit, light);
+			}
+#if USE_BATCHED_SHADING
+			else if (hit.valid())
+			{
+				WavefrontRay r = { ray, vec3(1.0f), uint32_t(pixel) };
+				nextPixels[pixel] = vec3(0.0f);
+				batch.add(r, hit);
+			}
+#endif // USE_BATCHED_SHADING
+			else
+			{
+				pixels[pixel] = nextPixels[pixel] = hit.valid() ? shade(ray, hit, 0, vec3(1.0f)) : g_backGroundColour;
+			}
+		});
+#if USE_BATCHED_SHADING
+		shadeBatch(batch, 0, nextPixels, nullptr);
+		for (size_t i = 0; i < batch.count; ++i)
+		{
+			pixels[batch.rays[i].pixel] = nextPixels[batch.rays[i].pixel];
+		}
+#endif // USE_BATCHED_SHADING
+		numReprojected += tileReprojected;
+		frameBuffer.pack(tile.x0, tile.y0, tile.x1, tile.y1);
+	});
+
+	state.camera = camera;
+	state.sceneVersion = g_sceneVersion;
+	state.lightPosition = g_lightPosition;
+	state.lightColour = g_lightColour;
+	++state.frame;
+	state.pixels.swap(nextPixels);
+	std::swap(state.gBuffer, state.nextGBuffer);
+	return numReprojected;
+}
+
+/**
+ * Renders the whole image with one sample per pixel.
+ */
+void renderImage(const Camera &camera, FrameBuffer &frameBuffer, ThreadPool &threadPool)
+{
+	std::vector<vec3> unusedSamplePixels;
+	renderImage(camera, 1, frameBuffer, unusedSamplePixels, threadPool, g_denoise ? &g_gBuffer : nullptr);
+	if (g_denoise)
+	{
+		denoiseImage(camera, frameBuffer.getPixels(), 1.0f, g_gBuffer, frameBuffer.getPixels(), frameBuffer, threadPool);
+	}
+}
+
+/**
+ * The state of the progressive renderer, which is kept between frames. The image is refined in passes, each pass traces one sample
+ * for each pixel of a 'sample camera' (see 'makeSampleCamera'):
+ *   pass 0 traces every 4th pixel in each direction, which is shown as 4x4 blocks,
+ *   pass 1 traces every 2nd pixel, shown as 2x2 blocks,
+ *   pass 2 traces all pixels,
+ *   pass 3 and on trace another sample for each pixel, at a different place in the pixel, and these are averaged.
+ * The passes are traced a few tiles at a time so that a pass can be spread over as many frames as is needed. The result is written to
+ * the packed pixels of the frame buffer, and the linear pixels are used to sum the full resolution samples. When denoising, the full
+ * resolution samples are shown denoised, once all the tiles of a pass are done.
+ */
+struct ProgressiveState
+{
+	Camera camera;
+	// The step of the current pass, 1 when at full resolution.
+	int step;
+	// Index of the next tile to render in the current pass.
+	int nextTile;
+	// Number of completed full resolution samples.
+	int numSamples;
+	// The output of the current pass, at the resolution of the sample camera.
+	std::vector<vec3> passPixels;
+	// The average of the full resolution samples, denoised, see 'g_denoise'.
+	std::vector<vec3> denoisedPixels;
+};
+
+static ProgressiveState g_progressive;
+
+inline int getProgressiveMaxSamples()
+{
+	return g_pathTracing ? g_pathTracingMaxSamples : g_progressiveMaxSamples;
+}
+
+/**
+ * Starts the progressive rendering over, e.g., when the window is resized.
+ */
+void resetProgressive(ProgressiveState &state, const Camera &camera, FrameBuffer &frameBuffer)
+{
+	state.camera = camera;
+	useFirstHitCache(camera);
+	state.step = g_progressiveStartStep;
+	state.nextTile = 0;
+	state.numSamples = 0;
+	frameBuffer.resize(camera.width, camera.height);
+	std::fill(frameBuffer.getPixels().begin(), frameBuffer.getPixels().end(), vec3(0.0f));
+	std::fill(frameBuffer.getPackedPixels().begin(), frameBuffer.getPackedPixels().end(), frameBuffer.packColour(g_backGroundColour));
+}
+
+/**
+ * Returns the camera used to trace the current pass.
+ */
+Camera getPassCamera(const ProgressiveState &state)
+{
+	// The first full resolution sample is in the corner of the pixel, like the subsampled passes, the others are spread over the pixel.
+	return makeSampleCamera(state.camera, state.step, state.step == 1 ? getSampleOffset(state.numSamples) : vec2(0.0f));
+}
+
+/**
+ * Copies a tile that has been rendered in the current pass to the displayed image, either by filling the block of pixels
+ * that each sample stands for, or by adding the sample to the accumulated samples at full resolution.
+ */
+void updateDisplay(ProgressiveState &state, const Camera &passCamera, const Tile &tile, FrameBuffer &frameBuffer)
+{
+	const Camera &c = state.camera;
+	std::vector<vec3> &sums = frameBuffer.getPixels();
+	std::vector<uint32_t> &display = frameBuffer.getPackedPixels();
+	for (int y = tile.y0; y < tile.y1; ++y)
+	{
+		for (int x = tile.x0; x < tile.x1; ++x)
+		{
+			const vec3 &colour = state.passPixels[y * passCamera.width + x];
+			if (state.step == 1)
+			{
+				const int pixel = y * c.width + x;
+				sums[pixel] += colour;
+				if (!g_denoise)
+				{
+					display[pixel] = frameBuffer.packColour(sums[pixel] / float(state.numSamples + 1));
+				}
+			}
+			else
+			{
+				const uint32_t packedColour = frameBuffer.packColour(colour);
+				for (int by = y * state.step; by < std::min((y + 1) * state.step, c.height); ++by)
+				{
+					for (int bx = x * state.step; bx < std::min((x + 1) * state.step, c.width); ++bx)
+					{
+						display[by * c.width + bx] = packedColour;
+					}
+				}
+			}
+		}
+	}
+}
+
+/**
+ * Continues rendering the image for 'camera' for about 'timeBudget' seconds, starting over if the view has changed. The result is in
+ * the packed pixels of the frame buffer. Returns true when there is nothing more to do, i.e., when all pixels have all their samples
+ * (see 'getProgressiveMaxSamples').
+ * The tiles are rendered in batches of a few per thread, and a new batch is started until the time is up, so the time taken may exceed
+ * the budget by about the time for one batch, which is tiny compared to a whole frame.
+ */
+bool renderProgressive(ProgressiveState &state, const Camera &camera, double timeBudget, FrameBuffer &frameBuffer, ThreadPool &threadPool)
+{
+	if (!isSameView(state.camera, camera) || frameBuffer.getWidth() != camera.width || frameBuffer.getHeight() != camera.height)
+	{
+		resetProgressive(state, camera, frameBuffer);
+	}
+	const int batchSize = threadPool.getNumThreads() * 2;
+	auto start = std::chrono::high_resolution_clock::now();
+	while (state.numSamples < getProgressiveMaxSamples())
+	{
+		const Camera passCamera = getPassCamera(state);
+		const int numTiles = getNumTiles(passCamera);
+		if (state.nextTile == 0)
+		{
+			state.passPixels.resize(passCamera.width * passCamera.height);
+		}
+
+		const int count = std::min(batchSize, numTiles - state.nextTile);
+		// The first hits are the same for all samples, since they are in the corner of the pixel, see 'getPassCamera'.
+		const bool storeFirstHits = g_denoise && state.step == 1 && state.numSamples == 0;
+		if (storeFirstHits && state.nextTile == 0)
+		{
+			g_gBuffer.resize(passCamera.width, passCamera.height);
+		}
+		renderTiles(passCamera, state.nextTile, count, state.passPixels, threadPool, storeFirstHits ? &g_gBuffer : nullptr);
+		for (int i = state.nextTile; i < state.nextTile + count; ++i)
+		{
+			updateDisplay(state, passCamera, getTile(passCamera, i), frameBuffer);
+		}
+		state.nextTile += count;
+
+		// Move on to the next pass.
+		if (state.nextTile == numTiles)
+		{
+			state.nextTile = 0;
+			if (state.step > 1)
+			{
+				state.step /= 2;
+			}
+			else
+			{
+				++state.numSamples;
+				if (g_denoise)
+				{
+					denoiseImage(state.camera, frameBuffer.getPixels(), 1.0f / float(state.numSamples), g_gBuffer, state.denoisedPixels, frameBuffer, threadPool);
+				}
+			}
+		}
+		if (std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count() >= timeBudget)
+		{
+			break;
+		}
+	}
+	return state.numSamples >= getProgressiveMaxSamples();
+}
+
+
+
+/**
+ * Returns the thread counts to measure: 1, 2, 4, ... up to 'maxThreads' (0 means all hardware threads), which is always included.
+ */
+std::vector<int> getBenchmarkThreadCounts(int maxThreads)
+{
+	if (maxThreads <= 0)
+	{
+		maxThreads = std::max(1, int(std::thread::hardware_concurrency()));
+	}
+	std::vector<int> threadCounts;
+	for (int n = 1; n < maxThreads; n *= 2)
+	{
+		threadCounts.push_back(n);
+	}
+	threadCounts.push_back(maxThreads);
+	return threadCounts;
+}
+
+/**
+ * Renders the image with 1, 2, 4, ... up to 'maxThreads' threads (0 means all hardware threads) and prints the time and the speed-up
+ * compared to one thread. Each measurement is the best of a few frames to reduce the noise.
+ */
+void runScalingBenchmark(const Camera &camera, int maxThreads)
+{
+	std::vector<int> threadCounts = getBenchmarkThreadCounts(maxThreads);
+
+	printf("Scaling benchmark: %dx%d pixels, %d pixel tiles\n", camera.width, camera.height, g_tileSize);
+	printf("threads, ms, Mpixels/s, speed-up, efficiency, steals\n");
+	FrameBuffer frameBuffer;
+	double singleThreadTime = 0.0;
+	for (int numThreads : threadCounts)
+	{
+		ThreadPool pool(numThreads);
+		const int numFrames = 3;
+		double bestTime = 1e30;
+		for (int i = 0; i < numFrames; ++i)
+		{
+			auto start = std::chrono::high_resolution_clock::now();
+			renderImage(camera, frameBuffer, pool);
+			bestTime = std::min(bestTime, std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count());
+		}
+		if (numThreads == 1)
+		{
+			singleThreadTime = bestTime;
+		}
+		double speedUp = singleThreadTime / bestTime;
+		printf("%d, %.1f, %.2f, %.2f, %.2f, %d\n", numThreads, bestTime * 1000.0, double(camera.width * camera.height) / bestTime / 1e6, speedUp, speedUp / numThreads, pool.getNumSteals());
+	}
+}
+
+
+
+/**
+ * Deletes all the objects, before setting up another scene.
+ */
+void clearScene()
+{
+	for (auto o : g_objects)
+	{
+		delete o;
+	}
+	g_objects.clear();
+	for (auto o : g_instancedObjects)
+	{
+		delete o;
+	}
+	g_instancedObjects.clear();
+	g_sceneFile.close();
+}
+
+/**
+ * Must be called when the objects of the scene have been added, builds the acceleration structures.
+ */
+void finishScene()
+{
+	// Animated spheres are kept as Sphere objects, so that they can be moved one by one, see 'animateScene'.
+	if (g_animate)
+	{
+		std::mt19937 rng(1);
+		auto random = [&]() { return float(rng()) / 4294967296.0f; };
+		for (auto o : g_objects)
+		{
+			Sphere *sphere = dynamic_cast<Sphere*>(o);
+			if (sphere && sphere->radius < g_animationMaxRadius)
+			{
+				sphere->motion = normalize(vec3(random(), random(), random()) * 2.0f - 1.0f) * g_animationAmplitude;
+				sphere->phase = random() * 2.0f * g_pi;
+			}
+		}
+	}
+#if USE_SPHERE_SET
+	else
+	{
+		packSpheres(g_objects);
+	}
+#endif // USE_SPHERE_SET
+
+	// The BVH must be built after the scene is set up, and rebuilt if it changes.
+	buildObjectBvh(g_objectBvh, g_objects);
+	++g_sceneVersion;
+}
+
+/**
+ * Moves the spheres to where they are at 'time' (in seconds) and refits the object BVH to match, which is much faster than rebuilding
+ * it, see DynamicBvh. Both are done in parallel, the objects are updated in chunks, one task each.
+ */
+void animateScene(float time, ThreadPool &threadPool)
+{
+	const size_t chunkSize = 4096;
+	g_objectAabbs.resize(g_objects.size());
+	threadPool.parallelFor(int((g_objects.size() + chunkSize - 1) / chunkSize), [&](int chunk, int)
+	{
+		for (size_t i = chunk * chunkSize; i < std::min(g_objects.size(), (chunk + 1) * chunkSize); ++i)
+		{
+			if (Sphere *sphere = dynamic_cast<Sphere*>(g_objects[i]))
+			{
+				sphere->position = sphere->basePosition + sphere->motion * sinf(time * g_animationSpeed + sphere->phase);
+			}
+			g_objectAabbs[i] = g_objects[i]->getAabb();
+		}
+	});
+	g_objectBvh.update(g_objectAabbs, &threadPool);
+	++g_sceneVersion;
+}
+
+/**
+ * The default scene, five spheres of different materials on top of a huge sphere acting as the floor.
+ */
+void makeDefaultScene()
+{
+	g_viewPosition = vec3(0.0f, 0.0f, -10.0f);
+	g_viewTarget = vec3(0.0f, 0.0f, 0.0f);
+	g_lightPosition = vec3(-100.0f, 100.0f, 20.0f);
+
+	g_objects.push_back(makeSphere(vec3(-3.2f, 0.0f, 0.0f), 1.5f, vec3(0.2f, 0.3f, 1.0f), vec3(0.3f), 5.0f, 0.0f)); // blue sphere to the left
+	g_objects.push_back(makeSphere(vec3(0.0f, 2.0f, 0.0f), 1.5f, vec3(0.2f, 0.9f, 0.3f), vec3(0.3f), 80.0f, 0.8f)); // green sphere in the middle and up a bit
+	g_objects.push_back(makeSphere(vec3(3.2f, 0.0f, 0.0f), 1.5f, vec3(0.8f, 0.1f, 0.1f), vec3(0.02f), 40.0f, 0.8f)); // red sphere to the right.
+	//g_objects.push_back(makeSphere(vec3(0.0f, -1.0f, 0.0f), 1.0f, vec3(0.1f), 0.9f)); // smaller dark gray with high reflectivity
+	g_objects.push_back(makeSphere(vec3(0.0f, -1.0f, 0.0f), 1.5f, vec3(0.0f), vec3(1.0f, 0.71f, 0.29f), 50.0f, 0.99f)); // smaller gold with high reflectivity
+	g_objects.push_back(makeSphere(vec3(0.0f, -1003.0f, 0.0f), 1000.0f, vec3(0.8f), vec3(0.0f), 0.0f, 0.0f)); // huge light gray sphere underneath, no refleciton
+}
+
+/**
+ * The three spheres used in the structured_ray_tracer.
+ */
+void makeThreeSphereScene()
+{
+	g_viewPosition = vec3(0.0f, 0.0f, -10.0f);
+	g_viewTarget = vec3(0.0f, 0.0f, 0.0f);
+	g_lightPosition = vec3(-100.0f, 100.0f, 20.0f);
+
+	g_objects.push_back(makeSphere(vec3(-3.2f, 0.0f, 0.0f), 1.5f, vec3(0.2f, 0.3f, 1.0f))); // blue sphere to the left
+	g_objects.push_back(makeSphere(vec3(0.0f, 2.0f, 0.0f), 1.5f, vec3(0.2f, 0.9f, 0.3f))); // green sphere in the middle and up a bit
+	g_objects.push_back(makeSphere(vec3(3.2f, 0.0f, 0.0f), 1.5f, vec3(0.8f, 0.4f, 0.1f))); // red sphere to the right.
+}
+
+/**
+ * A cube filled with randomly placed spheres of random materials, seen from the outside. The random numbers are taken directly from
+ * std::mt19937, which (unlike the std distributions) gives the same sequence with all compilers, so the scene is always the same.
+ */
+void makeRandomSphereScene(int numSpheres, uint32_t seed)
+{
+	std::mt19937 rng(seed);
+	auto random = [&]() { return float(rng()) / 4294967296.0f; };
+
+	// On average one sphere per 2x2x2 units.
+	const float halfSize = powf(float(numSpheres), 1.0f / 3.0f);
+	for (int i = 0; i < numSpheres; ++i)
+	{
+		vec3 position = (vec3(random(), random(), random()) * 2.0f - 1.0f) * halfSize;
+		float radius = 0.2f + 0.6f * random();
+		vec3 colour = vec3(random(), random(), random());
+		g_objects.push_back(makeSphere(position, radius, colour, vec3(0.04f), 20.0f, random() * 0.8f));
+	}
+	g_viewPosition = vec3(0.0f, 0.0f, -3.0f * halfSize);
+	g_viewTarget = vec3(0.0f, 0.0f, 0.0f);
+	g_lightPosition = vec3(-halfSize, 4.0f * halfSize, -2.0f * halfSize);
+}
+
+/**
+ * Loads an OBJ model and traces it as a TriangleMesh. The camera is placed inside the model, looking along the longest axis, and the
+ * light above it, which works for Sponza. Returns false if the model could not be loaded.
+ */
+bool makeModelScene(const std::string &fileName)
+{
+	// The model is only needed until the triangle mesh is built, since this copies the data.
+	OBJModel model;
+	if (!model.load(fileName))
+	{
+		return false;
+	}
+	TriangleMesh *mesh = makeTriangleMesh(model, 0.0f, g_bvhNodeFormat);
+	g_objects.push_back(mesh);
+	printf("Triangle mesh: %d triangles, %d BVH nodes, %.1f MB\n", int(mesh->getNumTriangles()), int(mesh->getBvh().getNumNodes()), double(mesh->getBvh().getMemoryUsage()) / (1024.0 * 1024.0));
+
+	Aabb aabb = mesh->getAabb();
+	vec3 centre = aabb.getCentre();
+	vec3 halfSize = aabb.getHalfSize();
+	vec3 axis = halfSize.x > halfSize.z ? vec3(1.0f, 0.0f, 0.0f) : vec3(0.0f, 0.0f, 1.0f);
+	g_viewPosition = centre + axis * dot(axis, halfSize) * 0.8f - vec3(0.0f, halfSize.y * 0.5f, 0.0f);
+	g_viewTarget = centre - axis * dot(axis, halfSize) - vec3(0.0f, halfSize.y * 0.5f, 0.0f);
+	g_lightPosition = centre + vec3(0.0f, halfSize.y * 4.0f, 0.0f);
+	return true;
+}
+
+
+/**
+ * Replaces the objects of the scene with a grid of instances of them, each with a random rotation around the y axis. The objects (e.g.,
+ * a TriangleMesh with its BVH) are shared by all the instances, which only store a transform, so the memory used grows very slowly with
+ * the number of instances, see Instance. The object BVH is built over the instances, making it the top level of a two-level acceleration
+ * structure, and the BVH of each shared object is the bottom level. The camera looks at the grid from above one side.
+ */
+void makeInstancedScene(int numInstances, uint32_t seed)
+{
+	// The spheres must be in a SphereSet, which has its own BVH, or the instances would only contain a single sphere each.
+	packSpheres(g_objects);
+	g_instancedObjects.swap(g_objects);
+
+	Aabb aabb = make_inverse_extreme_aabb();
+	for (auto o : g_instancedObjects)
+	{
+		aabb = combine(aabb, o->getAabb());
+	}
+	const vec3 centre = aabb.getCentre();
+	const vec3 halfSize = aabb.getHalfSize();
+	// Leave room for the instances to rotate, the diagonal is the widest they get.
+	const float spacing = 2.2f * sqrtf(halfSize.x * halfSize.x + halfSize.z * halfSize.z);
+	const int side = int(ceilf(sqrtf(float(numInstances))));
+
+	std::mt19937 rng(seed);
+	for (int i = 0; i < numInstances; ++i)
+	{
+		vec3 position = vec3(float(i % side) - 0.5f * float(side - 1), 0.0f, float(i / side) - 0.5f * float(side - 1)) * spacing;
+		float angle = float(rng()) / 4294967296.0f * 2.0f * g_pi;
+		glm::mat4 transform = glm::translate(glm::mat4(1.0f), position) * glm::rotate(glm::mat4(1.0f), angle, vec3(0.0f, 1.0f, 0.0f)) * glm::translate(glm::mat4(1.0f), -centre);
+		for (auto o : g_instancedObjects)
+		{
+			g_objects.push_back(new Instance(o, transform));
+		}
+	}
+
+	size_t sharedBvhMemory = 0;
+	for (auto o : g_instancedObjects)
+	{
+		if (TriangleMesh *mesh = dynamic_cast<TriangleMesh*>(o))
+		{
+			sharedBvhMemory += mesh->getBvh().getMemoryUsage();
+		}
+		else if (SphereSet *sphereSet = dynamic_cast<SphereSet*>(o))
+		{
+			sharedBvhMemory += sphereSet->getBvh().getMemoryUsage();
+		}
+	}
+	printf("Instances: %d instances of %d objects, %.1f MB of shared BVH nodes, %.1f KB for the instances\n", numInstances, int(g_instancedObjects.size()), double(sharedBvhMemory) / (1024.0 * 1024.0), double(g_objects.size() * sizeof(Instance)) / 1024.0);
+
+	const float extent = float(side) * spacing;
+	g_viewTarget = vec3(0.0f);
+	g_viewPosition = vec3(0.0f, 0.4f * extent + halfSize.y, -0.8f * extent);
+	g_lightPosition = vec3(-extent, 2.0f * extent, -0.5f * extent);
+}
+
+
+/**
+ * Loads a scene file (see SceneFile.h) in either form, the camera and light are replaced by those given in the file. The binary form
+ * is used in place, so it is kept mapped by 'g_sceneFile' until 'clearScene'. Returns false if the file could not be loaded.
+ */
+bool makeSceneFromFile(const std::string &fileName)
+{
+	SceneSettings settings = { g_viewPosition, g_viewTarget, g_fov, g_lightPosition, g_lightColour };
+	auto start = std::chrono::high_resolution_clock::now();
+	if (!g_sceneFile.load(fileName, g_bvhNodeFormat, settings, g_objects))
+	{
+		return false;
+	}
+	double loadTime = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+	printf("Scene file: '%s' (%s) loaded in %.1f ms\n", fileName.c_str(), g_sceneFile.isMapped() ? "binary, mapped" : "text", loadTime * 1000.0);
+
+	g_viewPosition = settings.viewPosition;
+	g_viewTarget = settings.viewTarget;
+	g_fov = settings.fov;
+	g_lightPosition = settings.lightPosition;
+	g_lightColour = settings.lightColour;
+	return true;
+}
+
+/**
+ * Saves the objects, camera and light as a binary scene file, which can then be loaded without parsing or building anything. The spheres
+ * are packed into a SphereSet first, which is what the file stores.
+ */
+bool saveScene(const std::string &fileName)
+{
+	packSpheres(g_objects);
+	SceneSettings settings = { g_viewPosition, g_viewTarget, g_fov, g_lightPosition, g_lightColour };
+	if (!SceneFile::save(fileName, g_objects, settings))
+	{
+		return false;
+	}
+	printf("Scene file: saved '%s'\n", fileName.c_str());
+	return true;
+}
+
+
+
+// Where Sponza is found when running from the project directory, the OBJ file is not included in the repository (only the materials).
+const char *g_sponzaFileName = "../rasterizer_with_obj_loader/data/crysponza/sponza.obj";
+
+/**
+ * A shadow ray, from a surface point towards the light, which must not find anything beyond the light.
+ */
+struct ShadowRay
+{
+	Ray ray;
+	float maxDistance;
+};
+
+/**
+ * The measurements for one kind of ray in one scene with a certain number of threads.
+ */
+struct BenchmarkResult
+{
+	std::string scene;
+	const char *rayType;
+	int numThreads;
+	size_t numRays;
+	// Millions of rays per second for each repetition, sorted.
+	std::vector<double> mraysPerSecond;
+};
+
+/**
+ * Returns the value at the given percentile (0 to 100) of the sorted values, using the nearest rank.
+ */
+inline double getPercentile(const std::vector<double> &sortedValues, double percentile)
+{
+	if (sortedValues.empty())
+	{
+		return 0.0;
+	}
+	int rank = int(ceil(percentile / 100.0 * double(sortedValues.size())));
+	return sortedValues[std::min(std::max(rank, 1), int(sortedValues.size())) - 1];
+}
+
+/**
+ * Calls 'traceFn' (which traces all the rays once) 'numRepetitions' times and returns the sorted rates in millions of rays per second.
+ */
+template <typename TRACE_FN>
+std::vector<double> measureRays(size_t numRays, int numRepetitions, TRACE_FN traceFn)
+{
+	std::vector<double> rates;
+	for (int i = 0; i < numRepetitions && numRays > 0; ++i)
+	{
+		auto start = std::chrono::high_resolution_clock::now();
+		traceFn();
+		double time = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+		rates.push_back(double(numRays) / std::max(time, 1e-9) / 1e6);
+	}
+	std::sort(rates.begin(), rates.end());
+	return rates;
+}
+
+/**
+ * Measures the time to trace each kind of ray separately: the primary rays, using the same code as when rendering (i.e., packets if
+ * enabled), and then the shadow and reflection rays from the primary hits. The secondary rays are collected before timing, so the time
+ * only includes the tracing and not the shading. This is done for a set of scenes, going from a few spheres to Sponza, with 1, 2, 4 ...
+ * 'maxThreads' threads, each measurement is repeated 'numRepetitions' times.
+ *
+ * The results are printed and written as JSON to 'fileName', to make it easy to compare runs (e.g., before and after a change) with a
+ * script. Returns false if the file could not be written. Scenes that cannot be set up (i.e., if Sponza is missing) are listed as
+ * skipped.
+ */
+bool runBenchmark(const std::string &fileName, const std::string &sponzaFileName, int width, int height, int numRepetitions, int maxThreads)
+{
+	struct BenchmarkScene
+	{
+		const char *name;
+		std::function<bool()> setUp;
+	};
+	const BenchmarkScene scenes[] =
+	{
+		{ "spheres3", []() { makeThreeSphereScene(); return true; } },
+		{ "spheres5", []() { makeDefaultScene(); return true; } },
+		{ "random10k", []() { makeRandomSphereScene(10000, 1); return true; } },
+		{ "random1M", []() { makeRandomSphereScene(1000000, 1); return true; } },
+		{ "sponza", [&]() { return makeModelScene(sponzaFileName); } },
+	};
+	const std::vector<int> threadCounts = getBenchmarkThreadCounts(maxThreads);
+
+	printf("Benchmark: %dx%d pixels, %d repetitions\n", width, height, numRepetitions);
+	std::vector<BenchmarkResult> results;
+	std::vector<std::string> skipped;
+	for (const BenchmarkScene &scene : scenes)
+	{
+		clearScene();
+		if (!scene.setUp())
+		{
+			printf("%s: could not be set up, skipped\n", scene.name);
+			skipped.push_back(scene.name);
+			continue;
+		}
+		finishScene();
+		Camera camera = makeCamera(width, height, g_viewPosition, g_viewTarget, g_viewUp, g_fov);
+
+		// 1. Collect the secondary rays, this also warms up the caches.
+		std::vector<ShadowRay> shadowRays;
+		std::vector<Ray> reflectionRays;
+		for (int t = 0; t < getNumTiles(camera); ++t)
+		{
+			tracePrimaryRays(camera, getTile(camera, t), [&](int, const Ray &ray, const HitInfo &hit)
+			{
+				if (!hit.valid())
+				{
+					return;
+				}
+				const vec3 origin = hit.position + hit.normal * g_rayEpsilon;
+				const vec3 toLight = g_lightPosition - hit.position;
+				if (dot(toLight, hit.normal) > 0.0f)
+				{
+					const float lightDistance = length(toLight);
+					shadowRays.push_back({ makeRay(origin, toLight / lightDistance), lightDistance });
+				}
+				reflectionRays.push_back(makeRay(origin, reflect(ray.direction, hit.normal)));
+			});
+		}
+
+		// 2. Time each kind of ray, the secondary rays are handed out to the threads in chunks. The number of hits is counted per
+		//    thread, so that the compiler cannot remove the tracing.
+		const int chunkSize = 4096;
+		for (int numThreads : threadCounts)
+		{
+			ThreadPool pool(numThreads);
+			std::vector<size_t> numHits(numThreads, 0);
+
+			std::vector<double> primaryRates = measureRays(size_t(width * height), numRepetitions, [&]()
+			{
+				pool.parallelFor(getNumTiles(camera), [&](int tileIndex, int threadIndex)
+				{
+					tracePrimaryRays(camera, getTile(camera, tileIndex), [&](int, const Ray &, const HitInfo &hit)
+					{
+						numHits[threadIndex] += hit.valid() ? 1 : 0;
+					});
+				});
+			});
+			std::vector<double> shadowRates = measureRays(shadowRays.size(), numRepetitions, [&]()
+			{
+				pool.parallelFor(int((shadowRays.size() + chunkSize - 1) / chunkSize), [&](int chunk, int threadIndex)
+				{
+					const size_t end = std::min(shadowRays.size(), size_t(chunk + 1) * chunkSize);
+					for (size_t i = size_t(chunk) * chunkSize; i < end; ++i)
+					{
+						numHits[threadIndex] += isRayOccluded(shadowRays[i].ray, g_objects, shadowRays[i].maxDistance) ? 1 : 0;
+					}
+				});
+			});
+			std::vector<double> reflectionRates = measureRays(reflectionRays.size(), numRepetitions, [&]()
+			{
+				pool.parallelFor(int((reflectionRays.size() + chunkSize - 1) / chunkSize), [&](int chunk, int threadIndex)
+				{
+					const size_t end = std::min(reflectionRays.size(), size_t(chunk + 1) * chunkSize);
+					for (size_t i = size_t(chunk) * chunkSize; i < end; ++i)
+					{
+						numHits[threadIndex] += findClosestIntersection(reflectionRays[i], g_objects).valid() ? 1 : 0;
+					}
+				});
+			});
+
+			results.push_back({ scene.name, "primary", numThreads, size_t(width * height), primaryRates });
+			results.push_back({ scene.name, "shadow", numThreads, shadowRays.size(), shadowRates });
+			results.push_back({ scene.name, "reflection", numThreads, reflectionRays.size(), reflectionRates });
+			size_t totalHits = 0;
+			for (size_t h : numHits)
+			{
+				totalHits += h;
+			}
+			printf("%s, %d threads: primary %.2f, shadow %.2f, reflection %.2f Mrays/s (median), %d hits\n", scene.name, numThreads,
+				getPercentile(primaryRates, 50.0), getPercentile(shadowRates, 50.0), getPercentile(reflectionRates, 50.0), int(totalHits));
+		}
+	}
+	clearScene();
+
+	FILE *f = fopen(fileName.c_str(), "w");
+	if (!f)
+	{
+		printf("Error: could not write '%s'\n", fileName.c_str());
+		return false;
+	}
+	fprintf(f, "{\n  \"config\": { \"width\": %d, \"height\": %d, \"repetitions\": %d, \"tileSize\": %d, \"simdWidth\": %d, "
+		"\"useSphereSet\": %d, \"useRayPackets\": %d, \"useQuantizedBvh\": %d, \"useWideBvh\": %d, \"hardwareThreads\": %d },\n", width, height, numRepetitions, 
+		getTileSize(), g_simdWidth, USE_SPHERE_SET, USE_RAY_PACKETS, USE_QUANTIZED_BVH, USE_WIDE_BVH, int(std::thread::hardware_concurrency()));
+	fprintf(f, "  \"skipped\": [");
+	for (size_t i = 0; i < skipped.size(); ++i)
+	{
+		fprintf(f, "%s\"%s\"", i > 0 ? ", " : "", skipped[i].c_str());
+	}
+	fprintf(f, "],\n  \"results\": [\n");
+	for (size_t i = 0; i < results.size(); ++i)
+	{
+		const BenchmarkResult &r = results[i];
+		// The speed-up is relative to the median with one thread, which is always the first result for the scene and ray type.
+		auto first = std::find_if(results.begin(), results.end(), [&](const BenchmarkResult &o) { return o.scene == r.scene && strcmp(o.rayType, r.rayType) == 0; });
+		double singleThreadRate = getPercentile(first->mraysPerSecond, 50.0);
+		double median = getPercentile(r.mraysPerSecond, 50.0);
+		fprintf(f, "    { \"scene\": \"%s\", \"rayType\": \"%s\", \"threads\": %d, \"rays\": %d, \"mraysPerSecond\": { \"min\": %.4f, "
+			"\"p10\": %.4f, \"median\": %.4f, \"p90\": %.4f, \"max\": %.4f }, \"speedUp\": %.3f, \"samples\": [", r.scene.c_str(), r.rayType,
+			r.numThreads, int(r.numRays), getPercentile(r.mraysPerSecond, 0.0), getPercentile(r.mraysPerSecond, 10.0), median,
+			getPercentile(r.mraysPerSecond, 90.0), getPercentile(r.mraysPerSecond, 100.0), singleThreadRate > 0.0 ? median / singleThreadRate : 0.0);
+		for (size_t j = 0; j < r.mraysPerSecond.size(); ++j)
+		{
+			fprintf(f, "%s%.4f", j > 0 ? ", " : "", r.mraysPerSecond[j]);
+		}
+		fprintf(f, "] }%s\n", i + 1 < results.size() ? "," : "");
+	}
+	fprintf(f, "  ]\n}\n");
+	bool ok = ferror(f) == 0;
+	if (fclose(f) != 0 || !ok)
+	{
+		printf("Error: could not write '%s'\n", fileName.c_str());
+		return false;
+	}
+	printf("Wrote '%s'\n", fileName.c_str());
+	return true;
+}
+
+
+
+/**
+ * When the counters are enabled (see Counters.h), prints what was counted since the last call as one line of JSON, skipping frames
+ * where nothing was traced (e.g., when the progressive rendering is done).
+ */
+void printFrameCounters()
+{
+#if USE_COUNTERS
+	static int frame = 0;
+	Counters counters = gatherCounters();
+	if (counters.rays[RT_Primary] + counters.rays[RT_Shadow] + counters.rays[RT_Reflection] != 0)
+	{
+		counters.writeJson(stdout, frame);
+	}
+	++frame;
+#endif // USE_COUNTERS
+}
+
+
+
+/**
+ * The settings for a frame that is rendered without a window, see 'renderFrames'.
+ */
+struct FrameSettings
+{
+	int width;
+	int height;
+	int numSamples;
+	// If set, 'numSamples' is the most samples a pixel gets, and only the edges get more than one, see 'renderImageAdaptive'.
+	bool adaptive;
+	// If not set, the default view for the scene is used.
+	bool hasView;
+	vec3 viewPosition;
+	vec3 viewTarget;
+	// If 0, the field of view of the scene is used (which may come from a scene file).
+	float fov;
+	// Time (in seconds) of the animation, when animated.
+	float time;
+	// If not set, the light of the scene is used.
+	bool hasLight;
+	vec3 lightPosition;
+	vec3 lightColour;
+	std::string outputFileName;
+};
+
+/**
+ * If args[i] is one of the frame settings, parses it (and its arguments) into 'settings' and advances 'i' to the last argument used.
+ * Returns false if it is not a frame setting, or if the arguments are missing.
+ *   -size <width> <height>
+ *   -samples <count>
+ *   -adaptive <max samples>
+ *   -camera <position x y z> <target x y z>
+ *   -fov <vertical field of view in degrees>
+ *   -time <seconds>
+ *   -light <position x y z> <colour r g b>
+ */
+bool parseFrameSetting(const std::vector<std::string> &args, size_t &i, FrameSettings &settings)
+{
+	auto numArgs = [&](size_t n) { return i + n < args.size(); };
+	auto floatArg = [&]() { return float(atof(args[++i].c_str())); };
+	if (args[i] == "-size" && numArgs(2))
+	{
+		settings.width = std::max(1, atoi(args[++i].c_str()));
+		settings.height = std::max(1, atoi(args[++i].c_str()));
+	}
+	else if (args[i] == "-samples" && numArgs(1))
+	{
+		settings.numSamples = std::max(1, atoi(args[++i].c_str()));
+		settings.adaptive = false;
+	}
+	else if (args[i] == "-adaptive" && numArgs(1))
+	{
+		settings.numSamples = std::max(1, atoi(args[++i].c_str()));
+		settings.adaptive = true;
+	}
+	else if (args[i] == "-camera" && numArgs(6))
+	{
+		settings.viewPosition.x = floatArg();
+		settings.viewPosition.y = floatArg();
+		settings.viewPosition.z = floatArg();
+		settings.viewTarget.x = floatArg();
+		settings.viewTarget.y = floatArg();
+		settings.viewTarget.z = floatArg();
+		settings.hasView = true;
+	}
+	else if (args[i] == "-fov" && numArgs(1))
+	{
+		settings.fov = floatArg();
+	}
+	else if (args[i] == "-time" && numArgs(1))
+	{
+		settings.time = floatArg();
+	}
+	else if (args[i] == "-light" && numArgs(6))
+	{
+		settings.lightPosition.x = floatArg();
+		settings.lightPosition.y = floatArg();
+		settings.lightPosition.z = floatArg();
+		settings.lightColour.r = floatArg();
+		settings.lightColour.g = floatArg();
+		settings.lightColour.b = floatArg();
+		settings.hasLight = true;
+	}
+	else
+	{
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Reads the whitespace separated words from the file to 'args', skipping comments (from '#' to the end of the line). The words are
+ * used exactly as if they were given on the command line. Returns false if the file could not be opened.
+ */
+bool readArgumentsFile(const char *fileName, std::vector<std::string> &args)
+{
+	std::ifstream file(fileName);
+	if (!file)
+	{
+		return false;
+	}
+	std::string word;
+	while (file >> word)
+	{
+		if (word[0] == '#')
+		{
+			std::getline(file, word);
+		}
+		else
+		{
+			args.push_back(word);
+		}
+	}
+	return true;
+}
+
+/**
+ * Renders the frames one after the other and saves them, without opening a window or touching OpenGL, so that this can be run in
+ * batch on machines without a display or GPU. A file name ending in '.pfm' saves the linear colours as floats, anything else is saved
+ * as an 8-bit sRGB PPM. Returns the number of frames that could not be saved.
+ */
+int renderFrames(const std::vector<FrameSettings> &frames, ThreadPool &threadPool)
+{
+	// Kept for all the frames, so the memory is only allocated again if the size changes.
+	FrameBuffer frameBuffer;
+	std::vector<vec3> samplePixels;
+	std::vector<uint8_t> refine;
+	ReprojectionState reprojection;
+	int numFailed = 0;
+	for (size_t i = 0; i < frames.size(); ++i)
+	{
+		const FrameSettings &f = frames[i];
+		Camera camera = makeCamera(f.width, f.height, f.hasView ? f.viewPosition : g_viewPosition, f.hasView ? f.viewTarget : g_viewTarget, g_viewUp, f.fov > 0.0f ? f.fov : g_fov);
+		if (g_animate)
+		{
+			auto animateStart = std::chrono::high_resolution_clock::now();
+			animateScene(f.time, threadPool);
+			double animateTime = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - animateStart).count();
+			printf("Animation: time %.2f, update %.2f ms, SAH cost %.2f times that of the build, %d rebuilds\n", f.time, animateTime * 1000.0, 
+				g_objectBvh.getSahCostRatio(), g_objectBvh.getNumRebuilds());
+		}
+
+		if (f.hasLight)
+		{
+			g_lightPosition = f.lightPosition;
+			g_lightColour = f.lightColour;
+		}
+
+		auto start = std::chrono::high_resolution_clock::now();
+		// The camera rays are only traced again if the camera or the scene has changed since the last frame.
+		const bool firstHitsCached = useFirstHitCache(camera);
+		uint64_t numSamples = uint64_t(f.width) * uint64_t(f.height) * uint64_t(f.numSamples);
+		uint64_t numReprojected = 0;
+		// The first hits of the frame, for the denoiser.
+		const GBuffer *frameHits = &g_gBuffer;
+		if (f.adaptive)
+		{
+			numSamples = renderImageAdaptive(camera, f.numSamples, frameBuffer, g_gBuffer, refine, threadPool);
+		}
+		else if (g_reproject && f.numSamples == 1)
+		{
+			numReprojected = renderImageReprojected(camera, frameBuffer, reprojection, threadPool);
+			frameHits = &reprojection.gBuffer;
+		}
+		else
+		{
+			renderImage(camera, f.numSamples, frameBuffer, samplePixels, threadPool, g_denoise ? &g_gBuffer : nullptr);
+		}
+		double denoiseTime = g_denoise ? denoiseImage(camera, frameBuffer.getPixels(), 1.0f, *frameHits, frameBuffer.getPixels(), frameBuffer, threadPool) : 0.0;
+		double time = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+		const std::string &fileName = f.outputFileName;
+		const bool isPfm = fileName.size() >= 4 && (fileName.compare(fileName.size() - 4, 4, ".pfm") == 0 || fileName.compare(fileName.size() - 4, 4, ".PFM") == 0);
+		if (!(isPfm ? frameBuffer.savePfm(fileName.c_str()) : frameBuffer.savePpm(fileName.c_str())))
+		{
+			fprintf(stderr, "Failed to save '%s'\n", fileName.c_str());
+			++numFailed;
+		}
+		printf("Frame %d/%d: %dx%d, %s%d samples, %.2f per pixel, %.1f ms, '%s'\n", int(i + 1), int(frames.size()), f.width, f.height, f.adaptive ? "adaptive, up to " : "",
+			f.numSamples, double(numSamples) / double(f.width * f.height), time * 1000.0, fileName.c_str());
+		if (g_denoise)
+		{
+			const Denoiser::Timings &t = g_denoiser.getTimings();
+			printf("  of which %.1f ms denoising (copy in %.1f ms, iterations", denoiseTime * 1000.0, t.copyIn * 1000.0);
+			for (double iterationTime : t.iterations)
+			{
+				printf(" %.1f", iterationTime * 1000.0);
+			}
+			printf(" ms, copy out %.1f ms)\n", t.copyOut * 1000.0);
+		}
+		if (firstHitsCached)
+		{
+			printf("  camera rays reused from the last frame\n");
+		}
+		if (g_reproject)
+		{
+			printf("  %.1f%% of the pixels reprojected from the last frame\n", 100.0 * double(numReprojected) / double(f.width * f.height));
+		}
+		printFrameCounters();
+	}
+	return numFailed;
+}
+
+
+
+// Callback that is called by GLUT system when a frame needs to be drawn, set up in main() using 'glutDisplayFunc'
+static void onGlutDisplay()
+{
+	Camera camera = makeCamera(glutGet(GLUT_WINDOW_WIDTH), glutGet(GLUT_WINDOW_HEIGHT), g_viewPosition, g_viewTarget, g_viewUp, g_fov);
+
+	if (g_animate)
+	{
+		static auto startTime = std::chrono::high_resolution_clock::now();
+		animateScene(float(std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - startTime).count()), *g_threadPool);
+#if USE_PROGRESSIVE
+		// The scene has changed, so start over, which means that the image stays at the resolution that can be traced in one frame.
+		resetProgressive(g_progressive, camera, g_frameBuffer);
+#endif // USE_PROGRESSIVE
+		glutPostRedisplay();
+	}
+
+#if USE_PROGRESSIVE
+	if (!renderProgressive(g_progressive, camera, g_progressiveFrameTime, g_frameBuffer, *g_threadPool))
+	{
+		// Not done yet, so ask GLUT to draw another frame as soon as possible.
+		glutPostRedisplay();
+	}
+#else // !USE_PROGRESSIVE
+	useFirstHitCache(camera);
+	renderImage(camera, g_frameBuffer, *g_threadPool);
+#endif // USE_PROGRESSIVE
+	printFrameCounters();
+
+	// Draw the image (converted to the srgb colour space when it was packed) in the window.
+	g_frameBuffer.present();
+
+	// tell GLUT to get the OS to swap the back and front buffers.
+	glutSwapBuffers();
+}
+
+
+
+// Callback that is called by GLUT when a key is pressed, set up in main() using 'glutKeyboardFunc'. 'l' and 'L' swing the light around
+// the view target, which only changes the shading, so the image is shaded again from the cached first hits (see 'useFirstHitCache').
+static void onGlutKeyboard(unsigned char key, int, int)
+{
+	if (key == 'l' || key == 'L')
+	{
+		const float angle = degreesToRadians(key == 'l' ? 15.0f : -15.0f);
+		const vec3 offset = g_lightPosition - g_viewTarget;
+		g_lightPosition = g_viewTarget + vec3(offset.x * cosf(angle) - offset.z * sinf(angle), offset.y, offset.x * sinf(angle) + offset.z * cosf(angle));
+		printf("Light at (%.1f, %.1f, %.1f)\n", g_lightPosition.x, g_lightPosition.y, g_lightPosition.z);
+#if USE_PROGRESSIVE
+		// The camera and the objects are the same, so the first hits are kept.
+		Camera camera = makeCamera(glutGet(GLUT_WINDOW_WIDTH), glutGet(GLUT_WINDOW_HEIGHT), g_viewPosition, g_viewTarget, g_viewUp, g_fov);
+		resetProgressive(g_progressive, camera, g_frameBuffer);
+#endif // USE_PROGRESSIVE
+		glutPostRedisplay();
+	}
+}
+
+
+
+
+int main(int argc, char* argv[])
+{
+	// Parse the command line: [-threads <count>] [-tile <size>] [-scaling] [-benchmark <file.json> [-repetitions <count>]] [-args <file>]
+	//   [-spheres <count>] [-animate] [-instances <count>] [-scene <file>] [-save <file>] [-pathtrace] [-denoise] [-reproject] [frame settings] [-output <file>] [model.obj]
+	// '-scaling' runs the thread scaling benchmark (see 'runScalingBenchmark') instead of opening a window.
+	// '-benchmark' runs the benchmark suite (see 'runBenchmark') and writes the results to the file, the model (if given) is used
+	// instead of Sponza, and '-size' sets the resolution.
+	// '-output' renders a frame with the frame settings given so far (see 'parseFrameSetting') and saves it to the file, the settings
+	// carry over to the next frame, so several frames can be rendered by giving new settings followed by '-output' again. If there are
+	// any frames, no window is opened, see 'renderFrames'.
+	// '-args' reads more arguments from a file, e.g., a list of cameras and output files for rendering an animation.
+	// '-spheres' replaces the default scene with that many randomly placed spheres (see 'makeRandomSphereScene'), and '-animate' makes
+	// the spheres move (see 'animateScene'), '-time' sets the time of each frame.
+	// '-instances' replaces the scene (the model, or else 1000 random spheres, or as many as given by '-spheres') with a grid of that
+	// many instances of it, see 'makeInstancedScene'.
+	// '-scene' loads the scene from a file instead (see SceneFile.h), and '-save' writes the scene as a binary scene file, which loads
+	// much faster, after which the program exits unless there are frames to render.
+	// '-pathtrace' path traces the image (see 'tracePath'), use '-samples' to set the number of paths per pixel for the saved frames.
+	// '-denoise' filters the noise from the images, see 'denoiseImage'. It is not real-time, about 200 ms per 1080p frame on one core.
+	// '-reproject' reuses the shading of the last frame when rendering a sequence of frames with one sample, see 'renderImageReprojected'.
+	std::vector<std::string> args(argv + 1, argv + argc);
+	std::string modelFileName;
+	bool scalingBenchmark = false;
+	std::string benchmarkFileName;
+	int numRepetitions = 5;
+	int numRandomSpheres = 0;
+	int numInstances = 0;
+	std::string sceneFileName;
+	std::string saveFileName;
+	FrameSettings frameSettings = { g_startWidth, g_startHeight, 1, false, false, vec3(0.0f), vec3(0.0f), 0.0f, 0.0f, false, vec3(0.0f), vec3(0.0f), std::string() };
+	std::vector<FrameSettings> frames;
+	for (size_t i = 0; i < args.size(); ++i)
+	{
+		if (args[i] == "-threads" && i + 1 < args.size())
+		{
+			g_numThreads = atoi(args[++i].c_str());
+		}
+		else if (args[i] == "-tile" && i + 1 < args.size())
+		{
+			g_tileSize = std::max(1, atoi(args[++i].c_str()));
+		}
+		else if (args[i] == "-scaling")
+		{
+			scalingBenchmark = true;
+		}
+		else if (args[i] == "-benchmark" && i + 1 < args.size())
+		{
+			benchmarkFileName = args[++i];
+		}
+		else if (args[i] == "-repetitions" && i + 1 < args.size())
+		{
+			numRepetitions = std::max(1, atoi(args[++i].c_str()));
+		}
+		else if (args[i] == "-spheres" && i + 1 < args.size())
+		{
+			numRandomSpheres = std::max(1, atoi(args[++i].c_str()));
+		}
+		else if (args[i] == "-animate")
+		{
+			g_animate = true;
+		}
+		else if (args[i] == "-pathtrace")
+		{
+			g_pathTracing = true;
+		}
+		else if (args[i] == "-denoise")
+		{
+			g_denoise = true;
+		}
+		else if (args[i] == "-reproject")
+		{
+			g_reproject = true;
+		}
+		else if (args[i] == "-instances" && i + 1 < args.size())
+		{
+			numInstances = std::max(1, atoi(args[++i].c_str()));
+		}
+		else if (args[i] == "-scene" && i + 1 < args.size())
+		{
+			sceneFileName = args[++i];
+		}
+		else if (args[i] == "-save" && i + 1 < args.size())
+		{
+			saveFileName = args[++i];
+		}
+		else if (args[i] == "-args" && i + 1 < args.size())
+		{
+			std::vector<std::string> fileArgs;
+			if (!readArgumentsFile(args[i + 1].c_str(), fileArgs))
+			{
+				fprintf(stderr, "Failed to read arguments from '%s'\n", args[i + 1].c_str());
+				return 1;
+			}
+			// Replace '-args <file>' with the contents of the file.
+			args.erase(args.begin() + i, args.begin() + i + 2);
+			args.insert(args.begin() + i, fileArgs.begin(), fileArgs.end());
+			--i;
+		}
+		else if (args[i] == "-output" && i + 1 < args.size())
+		{
+			frameSettings.outputFileName = args[++i];
+			frames.push_back(frameSettings);
+		}
+		else if (parseFrameSetting(args, i, frameSettings))
+		{
+		}
+		else if (args[i][0] != '-')
+		{
+			modelFileName = args[i];
+		}
+		else
+		{
+			fprintf(stderr, "Ignoring unknown or incomplete option '%s'\n", args[i].c_str());
+		}
+	}
+
+	if (!benchmarkFileName.empty())
+	{
+		return runBenchmark(benchmarkFileName, modelFileName.empty() ? g_sponzaFileName : modelFileName, frameSettings.width, frameSettings.height, numRepetitions, g_numThreads) ? 0 : 1;
+	}
+
+	// Set up scene: 
+	// Optionally, an OBJ model can be given on the command line, e.g., '../rasterizer_with_obj_loader/data/crysponza/sponza.obj', 
+	// this replaces the default scene with the model.
+	if (!sceneFileName.empty())
+	{
+		if (!makeSceneFromFile(sceneFileName))
+		{
+			return 1;
+		}
+	}
+	else if (modelFileName.empty() || !makeModelScene(modelFileName))
+	{
+		if (numRandomSpheres > 0 || numInstances > 0)
+		{
+			makeRandomSphereScene(numRandomSpheres > 0 ? numRandomSpheres : 1000, 1);
+		}
+		else
+		{
+			makeDefaultScene();
+		}
+	}
+	if (numInstances > 0)
+	{
+		makeInstancedScene(numInstances, 1);
+	}
+	if (!saveFileName.empty())
+	{
+		if (!saveScene(saveFileName))
+		{
+			return 1;
+		}
+		if (frames.empty() && !scalingBenchmark)
+		{
+			return 0;
+		}
+	}
+	finishScene();
+
+	if (scalingBenchmark)
+	{
+		runScalingBenchmark(makeCamera(g_startWidth, g_startHeight, g_viewPosition, g_viewTarget, g_viewUp, g_fov), g_numThreads);
+		return 0;
+	}
+	if (!frames.empty())
+	{
+		ThreadPool threadPool(g_numThreads);
+		printf("Rendering %d frames with %d threads, %d pixel tiles\n", int(frames.size()), threadPool.getNumThreads(), g_tileSize);
+		return renderFrames(frames, threadPool) == 0 ? 0 : 1;
+	}
+
+	glutInit(&argc, argv);
+	glutInitDisplayMode(GLUT_RGB | GLUT_DEPTH | GLUT_DOUBLE);
+	glutSetOption(GLUT_ACTION_ON_WINDOW_CLOSE, GLUT_ACTION_GLUTMAINLOOP_RETURNS);
+
+	glutInitWindowSize(g_startWidth, g_startHeight);
+	glutCreateWindow("A somewhat more structured and extensible ray tracer");
+
+	// glewInit sets up the function pointers for the OpenGL functionality beyond 1.1, e.g., the pixel buffer objects used by the FrameBuffer.
+	glewInit();
+
+	glutSwapBuffers();
+
+	printf("--------------------------------------\nOpenGL\n  Vendor: %s\n  Renderer: %s\n  Version: %s\n--------------------------------------\n", glGetString(GL_VENDOR), glGetString(GL_RENDERER), glGetString(GL_VERSION));
+
+	g_threadPool = new ThreadPool(g_numThreads);
+	printf("Rendering with %d threads, %d pixel tiles\n", g_threadPool->getNumThreads(), g_tileSize);
 
 	glutDisplayFunc(onGlutDisplay);
+	glutKeyboardFunc(onGlutKeyboard);
 
 	glutMainLoop();
 
@@ -1,14 +1,19 @@
 /****************************************************************************/
 /* Copyright (c) 2016, Ola Olsson */
 /****************************************************************************/
+#include <GL/glew.h>
 #include <GL/freeglut.h>
 
 #include <glm/glm.hpp>
 
+#include "../recursive_ray_tracer/Bvh.h"
+#include "../recursive_ray_tracer/FrameBuffer.h"
+
 #include <stdio.h>
 #include <vector>
 #include <algorithm>
 #include <functional>
+#include <assert.h>
 
 // We're using the 2 & 3 dimensional vectors of GLM so alias these type names to 'vec2' and 'vec3'.
 // The type of the elements of these types is 'float' i.e., single precision (32-bit) floating point numbers.
@@ -43,6 +48,8 @@ class Object;
 
 // Scene object list (initialized in main)
 std::vector<Object*> g_objects;
+// Bounding volume hierarchy over the objects in 'g_objects', must be rebuilt using 'buildObjectBvh' whenever the list of objects changes.
+Bvh g_objectBvh;
 
 // Data types:
 
@@ -120,6 +127,11 @@ public:
 	 */
 	virtual HitInfo intersect(const Ray &ray) = 0;
 
+	/**
+	 * Returns the axis aligned bounding box of the object, this is used to build the BVH, so it should be as tight as possible.
+	 */
+	virtual Aabb getAabb() const = 0;
+
 	vec3 colour; // This is sensibly replaced with a more comprehensive material class, or some such that takes care of the shading calculation!
 };
 
@@ -186,6 +198,11 @@ public:
 		return hit;
 	}
 
+	virtual Aabb getAabb() const override
+	{
+		return make_aabb(position, radius);
+	}
+
 	// Data for representing a sphere.
 	vec3 position;
 	float radius;
@@ -227,6 +244,21 @@ Ray generatePinHolePrimaryRay(int x, int y, const Camera &c)
 }
 
 
+/**
+ * (Re-)builds the BVH over the objects. This must be called whenever objects are added, removed or moved, since the
+ * BVH stores the bounding boxes and refers to the objects by their index in the list.
+ */
+void buildObjectBvh(Bvh &bvh, const std::vector<Object*> &objects)
+{
+	std::vector<Aabb> aabbs;
+	aabbs.reserve(objects.size());
+	for (auto o : objects)
+	{
+		aabbs.push_back(o->getAabb());
+	}
+	bvh.build(aabbs);
+}
+
 /**
 * Finds the closest (smallest time value) intersection with the objects.
 * The hit info is initially invalid, and this is returned if no hit was found.
@@ -234,21 +266,27 @@ Ray generatePinHolePrimaryRay(int x, int y, const Camera &c)
 */
 HitInfo findClosestIntersection(const Ray &ray, const std::vector<Object*> &objects)
 {
+	assert(g_objectBvh.getNumPrimitives() == objects.size());
+
 	// A hit info is intialized to float max time.
 	HitInfo best;
 
-	// This uses a linear search which is fine for a small handful of objects, to support a large scene
-	// an acceleration structure such as a Bounding Volume Hierarchy (BVH) should be used.
-	for (auto o : objects)
+	// The BVH lets us skip all objects whose bounding boxes are not hit by the ray, and visits the closest first so that
+	// most objects behind the nearest hit can be skipped too. The lambda is called for each object in the leaves reached.
+	BvhRay bvhRay = makeBvhRay(ray.origin, ray.direction);
+	float tMax = best.time;
+	g_objectBvh.traverse(bvhRay, tMax, [&](uint32_t objectIndex, float &closestTime) -> bool
 	{
-		HitInfo h = o->intersect(ray);
+		HitInfo h = objects[objectIndex]->intersect(ray);
 
 		// Check if new hit time is better
 		if (h.time < best.time)
 		{
 			best = h;
+			closestTime = h.time;
 		}
-	}
+		return false;
+	});
 	return best;
 }
 
@@ -268,13 +306,19 @@ vec3 shade(const Ray &ray, const HitInfo &hit)
 }
 
 
+// The image shown in the window, kept between frames so that the memory is not allocated every frame. The colours are shown as they are,
+// without converting to sRGB, see the recursive_ray_tracer for that.
+FrameBuffer g_frameBuffer(FrameBuffer::F_Rgba8, false);
+
 // Callback that is called by GLUT system when a frame needs to be drawn, set up in main() using 'glutDisplayFunc'
 static void onGlutDisplay()
 {
 	Camera camera = makeCamera(glutGet(GLUT_WINDOW_WIDTH), glutGet(GLUT_WINDOW_HEIGHT), g_viewPosition, g_viewTarget, g_viewUp, g_fov);
 
 	// memory to use to store the pixels to
-	std::vector<vec3> pixels(camera.width * camera.height, g_backGroundColour);
+	g_frameBuffer.resize(camera.width, camera.height);
+	std::vector<vec3> &pixels = g_frameBuffer.getPixels();
+	std::fill(pixels.begin(), pixels.end(), g_backGroundColour);
 	
 	// loop over all the pixel locations.
 	for (int y = 0; y < camera.height; ++y)
@@ -292,12 +336,9 @@ static void onGlutDisplay()
 		}
 	}
 
-	// Must check for empty vector (if window is made 0 size in either dimension)
-	if (!pixels.empty())
-	{
-		// just copy the pixel data to the frame buffer.
-		glDrawPixels(camera.width, camera.height, GL_RGB, GL_FLOAT, &pixels[0]);
-	}
+	// Pack the pixels to 8 bits per channel and draw them in the window.
+	g_frameBuffer.pack(0, 0, camera.width, camera.height);
+	g_frameBuffer.present();
 
 	// tell GLUT to get the OS to swap the back and front buffers.
 	glutSwapBuffers();
@@ -315,6 +356,9 @@ int main(int argc, char* argv[])
 	glutInitWindowSize(g_startWidth, g_startHeight);
 	glutCreateWindow("A somewhat more structured and extensible ray tracer");
 
+	// glewInit sets up the function pointers for the OpenGL functionality beyond 1.1, e.g., the pixel buffer objects used by the FrameBuffer.
+	glewInit();
+
 	glutSwapBuffers();
 
 	printf("--------------------------------------\nOpenGL\n  Vendor: %s\n  Renderer: %s\n  Version: %s\n--------------------------------------\n", glGetString(GL_VENDOR), glGetString(GL_RENDERER), glGetString(GL_VERSION));
@@ -324,6 +368,9 @@ int main(int argc, char* argv[])
 	g_objects.push_back(makeSphere(vec3(0.0f, 2.0f, 0.0f), 1.5f, vec3(0.2f, 0.9f, 0.3f))); // green sphere in the middle and up a bit
 	g_objects.push_back(makeSphere(vec3(3.2f, 0.0f, 0.0f), 1.5f, vec3(0.8f, 0.4f, 0.1f))); // red sphere to the right.
 
+	// The BVH must be built after the scene is set up, and rebuilt if it changes.
+	buildObjectBvh(g_objectBvh, g_objects);
+
 	glutDisplayFunc(onGlutDisplay);
 
 	glutMainLoop();